@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <vector>
 
 #include <glad/gl.h>
@@ -137,3 +138,76 @@ class UniformBuffer final : public Buffer {
    */
   void bindUniformBlockIndex(GLuint index) const noexcept;
 };
+
+/**
+ * @brief Vertex buffer for data rewritten every frame. The buffer is split into regions, each write goes to the next
+ * region so that it does not wait for draws still reading the previous one.
+ * With GL 4.4 the storage is persistently mapped and regions are guarded by fences, otherwise
+ * the storage is orphaned whenever the regions wrap around.
+ *
+ */
+class StreamArrayBuffer final : public Buffer {
+ public:
+  StreamArrayBuffer() noexcept;
+  DELETE_COPY(StreamArrayBuffer)
+  DELETE_MOVE(StreamArrayBuffer)
+  /**
+   * @brief Destroy the StreamArrayBuffer object. Unmap the storage and release the fences.
+   *
+   */
+  ~StreamArrayBuffer() override;
+  /**
+   * @brief Get the type string
+   *
+   * @return String description of the buffer type.
+   */
+  CONSTEXPR_VIRTUAL const char* getTypeName() const noexcept override { return "Stream array buffer"; }
+  /**
+   * @brief Get the type enum
+   *
+   * @return OpenGL enum of the buffer type.
+   */
+  CONSTEXPR_VIRTUAL GLenum getType() const noexcept override { return GL_ARRAY_BUFFER; }
+  /**
+   * @brief Allocate the regions, call on a exist object will reallocate it.
+   *
+   * @param _regionSize Size of one region in bytes, rounded up to regionAlignment.
+   */
+  void allocateRegions(GLsizeiptr _regionSize) noexcept;
+  /**
+   * @brief Move to the next region, all draws of the current region must have been issued.
+   *
+   * @return Offset of the new region in bytes.
+   */
+  GLintptr nextRegion() noexcept;
+  /**
+   * @brief Write data to the current region.
+   *
+   * @param offset The offset into the current region in bytes.
+   * @param _size The size of the data in bytes.
+   * @param data Pointer to the data to be written.
+   */
+  void write(GLintptr offset, GLsizeiptr _size, const void* data) const noexcept;
+  /**
+   * @brief Get the offset of the current region in bytes.
+   *
+   */
+  GLintptr regionOffset() const noexcept { return current * regionSize; }
+  /**
+   * @brief Whether the storage is persistently mapped.
+   *
+   */
+  bool isPersistent() const noexcept { return mapped != nullptr; }
+
+  static constexpr int regionCount = 3;
+  static constexpr GLsizeiptr regionAlignment = 256;
+
+ private:
+  void release() noexcept;
+
+  GLsizeiptr regionSize;
+  int current;
+  char* mapped;
+  // Signaled when the GPU is done with the draws of each region, persistent mapping only
+  std::array<GLsync, regionCount> fences;
+};
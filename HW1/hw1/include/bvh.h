@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <vector>
+
+#include <Eigen/Core>
+
+/**
+ * @brief Bounding volume hierarchy over the triangles of a mesh whose topology does not change.
+ * The tree is built once, then only the boxes are refit to the moved vertices, which keeps the cost of an update linear
+ * in the number of triangles.
+ *
+ */
+class TriangleBVH {
+ public:
+  TriangleBVH() noexcept = default;
+  /**
+   * @brief Build the tree by splitting the triangles at the median centroid along the longest axis.
+   *
+   * @param triangles Vertex indices of each triangle.
+   * @param positions Vertex positions, w is ignored.
+   */
+  void build(const std::vector<std::array<int, 3>>& triangles, const Eigen::Ref<const Eigen::Matrix4Xf>& positions);
+  /**
+   * @brief Refit the boxes so that each one covers its triangles at positions and at positions + displacement.
+   *
+   * @param displacement Motion of every vertex over the coming step, w is ignored.
+   */
+  void refit(const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+             const Eigen::Ref<const Eigen::Matrix4Xf>& displacement);
+  /**
+   * @brief Append the index of every triangle whose box overlaps the box [minCorner, maxCorner], in no particular
+   * order.
+   *
+   * @param result Indices are appended to it.
+   */
+  void query(const Eigen::Ref<const Eigen::Vector4f>& minCorner,
+             const Eigen::Ref<const Eigen::Vector4f>& maxCorner,
+             std::vector<int>& result) const;
+  const std::vector<std::array<int, 3>>& triangles() const { return _triangles; }
+
+ private:
+  // Leaves have count > 0 and own order[first, first + count), inner nodes have the left child right after them and
+  // the right child at first. Children always come after their parent.
+  struct Node {
+    Eigen::Vector4f minCorner;
+    Eigen::Vector4f maxCorner;
+    int first;
+    int count;
+  };
+  int buildNode(int first, int last, const Eigen::Matrix4Xf& centroids);
+
+  std::vector<std::array<int, 3>> _triangles;
+  std::vector<int> order;
+  std::vector<Node> nodes;
+  // Traversal stack of query
+  mutable std::vector<int> stack;
+};
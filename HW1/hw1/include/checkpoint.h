@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+
+class Cloth;
+class Spheres;
+
+/**
+ * @brief Fixed-size header of a binary checkpoint. The file is in native byte order, each section starts at a multiple
+ * of 16 bytes:
+ *
+ *   CheckpointHeader
+ *   cloth position, velocity, acceleration    3 x clothParticles float4, clothParticles = instances x particlesPerEdge^2
+ *   cloth mass                                 clothParticles floats
+ *   springs                                    springCount x (int32 start, int32 end, float rest length, int32 type)
+ *   sphere position, velocity, acceleration   3 x sphereCount float4
+ *   sphere mass, radius                        2 x sphereCount floats
+ *
+ */
+struct CheckpointHeader {
+  // 2: instanceCount
+  // 3: springs of a color sorted by start particle
+  static constexpr uint32_t currentVersion = 3;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  int32_t particlesPerEdge;
+  int32_t instanceCount;
+  float clothWidth;
+  float clothHeight;
+  int32_t springCount;
+  int32_t sphereCount;
+  float deltaTime;
+  float springCoef;
+  float damperCoef;
+  float viscousCoef;
+  // Relative stiffness of structural, shear and bend springs
+  float stiffness[3];
+  // Simulation steps taken before the checkpoint
+  int64_t steps;
+};
+
+/**
+ * @brief Write the state of the cloth and the spheres, and the configs needed to continue it.
+ *
+ * @param filename The checkpoint file, overwritten if it exists.
+ * @param steps Steps taken so far, stored in the header.
+ * @return false if the file cannot be written, error is printed to stderr.
+ */
+bool saveCheckpoint(const std::filesystem::path& filename, Cloth& cloth, Spheres& spheres, int64_t steps = 0);
+/**
+ * @brief Read and validate only the header, to create a cloth of the right size before loadCheckpoint.
+ *
+ * @return false if the file cannot be read or is not a checkpoint of this version, error is printed to stderr.
+ */
+bool readCheckpointHeader(const std::filesystem::path& filename, CheckpointHeader& header);
+/**
+ * @brief Map a checkpoint and copy its state into the cloth and the spheres. deltaTime and the coefficients are
+ * restored as well. The cloth must have the same size, instances and springs as the one saved, the spheres are
+ * replaced and every island of the cloth is woken up.
+ *
+ * @param header Filled with the header of the file when not null.
+ * @return false if the file cannot be read or does not match the cloth, nothing is changed in that case and error is
+ * printed to stderr.
+ */
+bool loadCheckpoint(const std::filesystem::path& filename, Cloth& cloth, Spheres& spheres,
+                    CheckpointHeader* header = nullptr);
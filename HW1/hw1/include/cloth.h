@@ -1,40 +1,155 @@
 #pragma once
-#include <glad/gl.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
 #include <vector>
 
-#include "buffer.h"
+#include "bvh.h"
 #include "shape.h"
+#include "snapshot.h"
+#include "spatialhash.h"
 #include "spring.h"
 #include "utils.h"
+#ifndef HW1_HEADLESS
+#include <glad/gl.h>
+
+#include "buffer.h"
 #include "vertexarray.h"
+#endif
 
 class Cloth final : public Shape {
  public:
   MOVE_ONLY(Cloth)
+  // Rows of particles per sleep island, the last island of an instance also takes the remaining rows
+  static constexpr int islandRows = 4;
+  // Rows spanned by the longest spring, the vertical bend spring
+  static constexpr int springReachRows = 2;
   enum class DrawType { FULL, STRUCTURAL, SHEAR, BEND, PARTICLE };
-  Cloth();
+  /**
+   * @brief Construct square grid cloths centered at the origin on the xz plane, one per instance offset.
+   * All instances share one particle pool and one spring list, instance k owns particles instanceRange(k), so every
+   * pass over the cloth handles all instances at once.
+   *
+   * @param particlesPerEdge Number of particles on each edge, at least 3.
+   * @param width Half extent along x.
+   * @param height Half extent along z.
+   * @param instanceOffsets Translation of each instance, at least one.
+   */
+  explicit Cloth(int particlesPerEdge = 25, float width = 2.0f, float height = 2.0f,
+                 const std::vector<Eigen::Vector4f>& instanceOffsets = {Eigen::Vector4f::Zero()});
+  int particlesPerEdge() const { return _particlesPerEdge; }
+  int instanceCount() const { return _instanceCount; }
+  /**
+   * @brief Particles [first, second) of the pool belong to instance k.
+   *
+   */
+  std::pair<int, int> instanceRange(int k) const {
+    int size = _particlesPerEdge * _particlesPerEdge;
+    return {k * size, (k + 1) * size};
+  }
+  float width() const { return _width; }
+  /**
+   * @brief Vertex indices of the two triangles of every quad, in the order they are drawn.
+   *
+   */
+  const std::vector<std::array<int, 3>>& triangles() const { return _triangles; }
+  /**
+   * @brief Tree over triangles(), built once. Refit it to the current positions before querying.
+   *
+   */
+  TriangleBVH& triangleBVH() { return _triangleBVH; }
+  float height() const { return _height; }
   /**
    * @brief Get the springs.
    *
    */
   std::vector<Spring>& springs() { return _springs; }
   /**
-   * @brief Render the cloth based on the given type.
+   * @brief Get the structure-of-arrays copy of the springs, used when currentSpringKernel is 1.
+   *
+   */
+  SpringArray& springArray() { return _springArray; }
+  /**
+   * @brief Bytes allocated for the springs, their SoA copies in color and tile order and the offsets into them.
+   *
+   */
+  size_t springMemoryBytes() const;
+  /**
+   * @brief Springs of color i are springs()[offsets[i], offsets[i + 1]), springs of a color never share a particle.
+   *
+   */
+  const std::vector<int>& springColorOffsets() const { return _springColorOffsets; }
+  /**
+   * @brief Springs of color c touching particles [first, last), which must start and end on island boundaries, e.g.
+   * a range of particles().activeRanges(). These start in the range or in the springReachRows rows of its instance
+   * before it, and are contiguous because springs of a color are sorted by start particle. Some of them only join the
+   * sleeping particles around the range.
+   *
+   * @return The springs [first, second) of springs().
+   */
+  std::pair<int, int> springRange(int color, int first, int last) const {
+    int firstRow = first / _particlesPerEdge;
+    int instanceFirstRow = firstRow - firstRow % _particlesPerEdge;
+    const int* offsets = &springRowOffsets[color * (_instanceCount * _particlesPerEdge + 1)];
+    return {offsets[std::max(firstRow - springReachRows, instanceFirstRow)], offsets[last / _particlesPerEdge]};
+  }
+  /**
+   * @brief Whether computeSpringForce adds anything, turned off while a constraint solver handles the springs.
+   *
+   */
+  bool& springForceEnabled() { return _springForceEnabled; }
+#ifndef HW1_HEADLESS
+  /**
+   * @brief Write the positions and normals of a snapshot to the next region of the vertex stream, once per snapshot.
+   * Every draw type reads the last upload.
+   *
+   */
+  void upload(const SimulationSnapshot& snapshot);
+  /**
+   * @brief Render the cloth based on the given type. FULL is skipped when the last upload had no normals.
    *
    * @param type The render type.
    */
   void draw(DrawType type) const;
+#endif
   /**
    * @brief Compute the internal force produce by the springs.
    * Which includes spring force and damper force.
+   * Runs on ThreadPool::getPool(), one spring color group at a time.
+   * currentSpringKernel selects the per-spring scalar loop (0 and 2) or the vectorized SoA kernel (1).
+   * Springs between sleeping particles are skipped, sleeping particles keep zero acceleration. Does nothing when
+   * springForceEnabled() is false.
    *
    */
   void computeSpringForce();
+  /**
+   * @brief Compute external and spring forces, same as computeExternalForce followed by computeSpringForce.
+   * When currentSpringKernel is 2 both are done in one sweep over tiles of particle rows with the SoA spring kernel,
+   * so that the particles of a tile stay in cache between the two. The tiles do not depend on the thread count,
+   * neither does the result. Tiles may span several islands, so the two passes are used while one of them sleeps.
+   *
+   */
+  void computeForces();
   /**
    * @brief Compute the smooth normal of the surface. Only called when draw type is FULL
+   * Rows of quads are split between the threads of ThreadPool::getPool(), even rows first and then odd rows, so that
+   * no two threads add to the same normal. Nothing is computed unless markPositionsChanged() was called since the last
+   * time.
    *
+   * @return Whether the normals were recomputed.
    */
-  void computeNormal();
+  bool computeNormal();
+  /**
+   * @brief Call after writing particles().position(), i.e. after a step, a loaded checkpoint or a restored state.
+   *
+   */
+  void markPositionsChanged() { ++positionGeneration; }
+  /**
+   * @brief Get the normals of the last computeNormal.
+   *
+   */
+  const Eigen::Matrix4Xf& normal() const { return normals; }
   /**
    * @brief Cloth collide with unknown shape
    *
@@ -47,21 +162,158 @@ class Cloth final : public Shape {
    * @param sphere The sphere to be tested.
    */
   void collide(Spheres* sphere) override;
+  /**
+   * @brief Self-collision, particles of the cloth closer than selfCollisionThickness() are pushed apart and their
+   * approaching velocity removed. Pairs at most 2 rows and columns apart in the same instance are connected by springs
+   * and skipped, different instances collide with each other.
+   * Broadphase is a spatial hash rebuilt every call, the queries are split between the threads of
+   * ThreadPool::getPool(). Contacts are sorted by particle pair and resolved together, each particle moves by the
+   * average of its contacts, so the result does not depend on the thread count.
+   *
+   */
+  void collide() override;
+  /**
+   * @brief Same as collide() but tests every pair, kept as a reference for benchmarks.
+   *
+   */
+  void collideAllPairs();
+  /**
+   * @brief Contact distance of self-collision, the smaller grid spacing. A particle passing through the middle of a
+   * quad is closer than that to its corners.
+   *
+   */
+  float selfCollisionThickness() const;
+  /**
+   * @brief Number of contacts found by the last collide() or collideAllPairs().
+   *
+   */
+  int selfContactCount() const { return static_cast<int>(selfContacts.size()); }
+  /**
+   * @brief Put to sleep the islands whose root mean square speed stayed below sleepVelocity, with no particle faster
+   * than 4 sleepVelocity, for sleepDelay seconds, and wake the ones passed to wake() since the last call.
+   * An island is a band of islandRows rows of an instance. Particles in the springReachRows rows next to a neighboring
+   * island faster than 4 sleepVelocity keep it awake, or wake it, so a disturbance spreads through the springs.
+   * Sleeping particles keep zero velocity and acceleration and are left out of particles().activeRanges(), so forces,
+   * collisions and integrators skip them and see them as fixed. Call after every batch of steps, every island is woken
+   * when isSleepingEnabled is off.
+   *
+   * @param steps The steps of deltaTime taken since the last call, the speeds are only checked at the end of them.
+   */
+  void updateSleeping(int steps = 1);
+  /**
+   * @brief Wake the island of a particle at the next updateSleeping, for contacts that disturb it.
+   *
+   */
+  void wake(int particle) { wakeRequested[islandOf(particle)] = 1; }
+  /**
+   * @brief Wake every island now, after the particles were replaced.
+   *
+   */
+  void wakeAll();
+  bool isSleeping(int particle) const { return particleSleeping[particle]; }
+  int activeParticleCount() const { return awakeParticles; }
 
  private:
   /**
    * @brief Initialize the model, setting OpenGL related buffers.
    *
    */
-  void initializeVertex();
+  void initializeVertex(const std::vector<Eigen::Vector4f>& instanceOffsets);
   /**
    * @brief Connect particles with springs.
    *
    */
   void initializeSpring();
+  /**
+   * @brief Greedy edge coloring, sort springs so that springs in the same group never share a particle.
+   * Each group can then be accumulated in parallel without races, and the result does not depend on thread count.
+   *
+   */
+  void colorSprings();
+  /**
+   * @brief Group the springs by the tile of rows of their start particle, for the fused kernel of computeForces.
+   *
+   */
+  void tileSprings();
+  /**
+   * @brief Whether particles i < j are a self-collision contact.
+   *
+   */
+  bool isSelfContact(int i, int j, float thickness);
+  /**
+   * @brief Resolve selfContacts, every contact sees the positions and velocities from before the call.
+   *
+   */
+  void resolveSelfContacts(float thickness);
+  int islandsPerInstance() const { return std::max(1, _particlesPerEdge / islandRows); }
+  int islandOf(int particle) const {
+    int row = particle / _particlesPerEdge;
+    return row / _particlesPerEdge * islandsPerInstance() +
+           std::min(row % _particlesPerEdge / islandRows, islandsPerInstance() - 1);
+  }
+  /**
+   * @brief Particles [first, second) of the pool belong to island i.
+   *
+   */
+  std::pair<int, int> islandRange(int i) const;
+  /**
+   * @brief Set particles().activeRanges() to the runs of awake islands, and the sleep state of every particle.
+   *
+   */
+  void updateActiveRanges();
+  int _particlesPerEdge;
+  int _instanceCount;
+  float _width;
+  float _height;
+  std::vector<std::array<int, 3>> _triangles;
+  TriangleBVH _triangleBVH;
+  Eigen::Matrix4Xf normals;
+  // Bumped by markPositionsChanged(), normalGeneration is its value at the last computeNormal
+  long long positionGeneration;
+  long long normalGeneration;
   std::vector<Spring> _springs;
+  // Springs of color i are in [_springColorOffsets[i], _springColorOffsets[i + 1])
+  std::vector<int> _springColorOffsets;
+  // Springs of color c starting in row r of the pool start at springRowOffsets[c * (rows + 1) + r]
+  std::vector<int> springRowOffsets;
+  bool _springForceEnabled;
+  SpringArray _springArray;
+  // Rows of particles per tile of the fused kernel
+  int tileRows;
+  // Springs sorted by the tile of their start particle, then by color. Springs of tile t with both ends in the tile
+  // are runs [tileRunOffsets[2t], tileRunOffsets[2t + 1]) of tileRuns, the ones ending in tile t + 1 are the runs up
+  // to tileRunOffsets[2t + 2]. Springs of a run have the same color.
+  SpringArray tileSpringArray;
+  std::vector<std::pair<int, int>> tileRuns;
+  std::vector<int> tileRunOffsets;
+  // Self-collision broadphase and contacts, rebuilt every call. Candidates and contacts are per thread.
+  SpatialHash selfCollisionHash;
+  std::vector<std::vector<int>> threadCandidates;
+  std::vector<std::vector<std::pair<int, int>>> threadContacts;
+  std::vector<std::pair<int, int>> selfContacts;
+  // Sum of the corrections of each particle and the number of contacts adding to it
+  Eigen::Matrix4Xf contactPositionDelta;
+  Eigen::Matrix4Xf contactVelocityDelta;
+  std::vector<int> contactCount;
+  // Sleep state of each island, vector<bool> would not be addressable
+  std::vector<uint8_t> islandSleeping;
+  std::vector<uint8_t> wakeRequested;
+  // Whether each awake island was quiet in the last updateSleeping, and whether a neighbor disturbs it
+  std::vector<uint8_t> islandQuiet;
+  std::vector<uint8_t> islandDisturbed;
+  // Time each awake island has been quiet
+  std::vector<float> quietTime;
+  int sleepingIslands;
+  // Sleep state of each particle, and the number of awake ones
+  std::vector<uint8_t> particleSleeping;
+  int awakeParticles;
+  // Sleeping rows within springReachRows of an active range, springs of the range also add to them
+  std::vector<std::pair<int, int>> sleepingHalo;
+#ifndef HW1_HEADLESS
   VertexArray vao;
-  ArrayBuffer positionBuffer;
-  ArrayBuffer normalBuffer;
+  // Positions followed by normals in each region
+  StreamArrayBuffer vertexStream;
+  bool hasUploadedNormal;
   ElementArrayBuffer ebo, structuralSpring, shearSpring, bendSpring;
+#endif
 };
@@ -1,10 +1,9 @@
 #pragma once
+#include <array>
+
 #include <Eigen/Core>
 
 // constants
-inline constexpr int particlesPerEdge = 25;
-inline constexpr int clothWidth = 2;
-inline constexpr int clothHeight = 2;
 inline constexpr float particleMass = 1.0f;
 inline constexpr float sphereDensity = 1e3f;
 inline constexpr float baseSpeed = 1e-3f;
@@ -23,10 +22,25 @@ extern float keyboardMoveSpeed;
 
 extern float deltaTime;
 extern int simulationPerFrame;
+extern int simulationThreads;
+// Measured by the viewer's simulation thread, for display
+extern float simulationStepsPerSecond;
+extern int activeClothParticles;
+extern int clothParticleCount;
 
 extern float springCoef;
 extern float damperCoef;
+// Stiffness of structural, shear and bend springs, relative to springCoef
+extern std::array<float, 3> springStiffness;
 extern float viscousCoef;
+extern float adaptiveTolerance;
+extern int constraintIterations;
+extern bool isSelfColliding;
+extern bool isUsingContinuousCollision;
+// Cloth islands with a root mean square speed below sleepVelocity (m/s) for sleepDelay (s) are put to sleep
+extern bool isSleepingEnabled;
+extern float sleepVelocity;
+extern float sleepDelay;
 
 extern Eigen::Vector4f sphereColor;
 extern Eigen::Vector4f clothColor;
@@ -40,5 +54,17 @@ extern bool isDrawingBendSprings;
 extern bool isDrawingCloth;
 extern bool isPaused;
 extern bool isStateSwitched;
+extern bool isSavingCheckpoint;
+extern bool isLoadingCheckpoint;
+extern bool isRecordingTrajectory;
+extern bool isPlayingTrajectory;
+// Recorded frame shown by the timeline, -1 shows the simulation
+extern int timelineFrame;
+extern int recordedFrames;
+// Profiler panel and its timers, tracing collects every timed scope until the trace is saved
+extern bool isProfiling;
+extern bool isTracing;
+extern bool isSavingTrace;
 
 extern int currentIntegrator;
+extern int currentSpringKernel;
@@ -2,11 +2,17 @@
 
 #include "buffer.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "cloth.h"
 #include "configs.h"
 #include "glcontext.h"
 #include "gui.h"
 #include "integrator.h"
+#include "profiler.h"
+#include "scene.h"
 #include "shader.h"
+#include "simulationthread.h"
 #include "sphere.h"
+#include "threadpool.h"
+#include "trajectorycache.h"
 #include "utils.h"
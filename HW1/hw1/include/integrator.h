@@ -1,17 +1,94 @@
 #pragma once
 #include <Eigen/Core>
+#include <Eigen/SparseCholesky>
+#include <Eigen/SparseCore>
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <functional>
+#include <tuple>
 #include <vector>
 
+#include "configs.h"
 #include "particles.h"
 #include "utils.h"
 
+class Cloth;
+
+/**
+ * @brief Set Cloth::springForceEnabled, for the constraint solvers whose templates cannot see Cloth.
+ *
+ * @return The previous value.
+ */
+bool setSpringForceEnabled(Cloth &cloth, bool enabled);
+
+/**
+ * @brief Call f(columns) once for every range of BasicParticles::activeRanges, columns(m) is the block of the range in
+ * m, a particle property or a scratch slot of the same set.
+ *
+ */
+template <class P, class F>
+void forEachActiveRange(const P &particles, F &&f) {
+  for (const auto &[first, last] : particles.activeRanges()) {
+    f([first = first, count = last - first](auto &&matrix) { return matrix.middleCols(first, count); });
+  }
+}
+
+/**
+ * @brief Matrices reused between integration steps, a few slots per particle set.
+ * Storage only grows, so once the largest particle sets have been seen integrators run without heap allocation.
+ * Each particle layout has its own slots, reserve and get must be called with the same one.
+ *
+ */
+class IntegratorScratch {
+ public:
+  IntegratorScratch() noexcept : _growCount(0) {}
+  /**
+   * @brief Make room for slots matrices for each particle set, sized to the current capacity of the set.
+   *
+   * @param particles The particle sets to be integrated.
+   * @param slots Number of matrices needed per set.
+   */
+  template <class P>
+  void reserve(const std::vector<P *> &particles, int slots);
+  /**
+   * @brief Get a slot of a particle set, it has as many columns as the set had at the last reserve.
+   *
+   * @tparam P Particle layout of the sets passed to reserve.
+   * @param set Index of the particle set in the vector passed to reserve.
+   * @param slot Index of the slot, less than slots.
+   */
+  template <class P = Particles>
+  Eigen::Block<typename P::Matrix, P::width, Eigen::Dynamic, true> get(int set, int slot) {
+    Slots<typename P::Matrix> &slots = std::get<Slots<typename P::Matrix>>(layouts);
+    return slots.storage[set * slots.slotsPerSet + slot].leftCols(slots.columns[set]);
+  }
+  /**
+   * @brief Number of times reserve had to allocate, stays constant at steady state.
+   *
+   */
+  long long growCount() const { return _growCount; }
+
+ private:
+  template <class Matrix>
+  struct Slots {
+    int slotsPerSet = 0;
+    std::vector<int> columns;
+    // Slot j of set i is storage[i * slotsPerSet + j], may have more columns than needed
+    std::vector<Matrix> storage;
+  };
+
+  long long _growCount;
+  std::tuple<Slots<Particles::Matrix>, Slots<PackedParticles::Matrix>, Slots<DoubleParticles::Matrix>> layouts;
+};
+
 class Integrator {
  public:
   Integrator() noexcept {}
   DELETE_COPY(Integrator)
   DELETE_MOVE(Integrator)
-  enum class Type { EXPLICIT_EULER, IMPLICIT_EULER, MIDPOINT_EULER, RUNGE_KUTTA_FOURTH };
+  enum class Type { EXPLICIT_EULER, IMPLICIT_EULER, MIDPOINT_EULER, RUNGE_KUTTA_FOURTH, BACKWARD_EULER, BOGACKI_SHAMPINE,
+                    EXTENDED_POSITION_BASED, PROJECTIVE_DYNAMICS };
   /**
    * @brief Integrate the ODE of acceleration and velocity.
    *
@@ -21,28 +98,620 @@ class Integrator {
   virtual void integrate(const std::vector<Particles *> &particles,
                          std::function<void(void)> simulateOneStep) const = 0;
   CONSTEXPR_VIRTUAL virtual Type getType() const = 0;
+  /**
+   * @brief Number of times the scratch storage grew, see IntegratorScratch::growCount.
+   *
+   */
+  long long scratchGrowCount() const { return scratch.growCount(); }
+
+ protected:
+  // Scratch slots of the multi-stage integrators
+  enum Slot { ORIGIN_POSITION, ORIGIN_VELOCITY, SUM_ACCELERATION, SUM_VELOCITY };
+  // integrate() is const in the interface
+  mutable IntegratorScratch scratch;
 };
 
-class ExplicitEuler : public Integrator {
+class ExplicitEuler final : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override {
+    integrateWith(particles, simulateOneStep);
+  }
+  /**
+   * @brief Same as integrate, but simulateOneStep is called directly so that it can be inlined. Like the other
+   * integrators without a cloth, it works on any particle layout.
+   *
+   */
+  template <class P, class Step>
+  void integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::EXPLICIT_EULER; }
 };
 
-class ImplicitEuler : public Integrator {
+class ImplicitEuler final : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override {
+    integrateWith(particles, simulateOneStep);
+  }
+  template <class P, class Step>
+  void integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::IMPLICIT_EULER; }
 };
 
-class MidpointEuler : public Integrator {
+class MidpointEuler final : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override {
+    integrateWith(particles, simulateOneStep);
+  }
+  template <class P, class Step>
+  void integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::MIDPOINT_EULER; }
 };
 
-class RungeKuttaFourth : public Integrator {
+class RungeKuttaFourth final : public Integrator {
  public:
-  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override;
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override {
+    integrateWith(particles, simulateOneStep);
+  }
+  template <class P, class Step>
+  void integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const;
   CONSTEXPR_VIRTUAL Type getType() const override { return Type::RUNGE_KUTTA_FOURTH; }
 };
+
+/**
+ * @brief Linearized backward euler of Baraff and Witkin 1998, "Large Steps in Cloth Simulation".
+ * Solves (M - h * df/dv - h^2 * df/dx) dv = h * (f + h * df/dx * v) for the cloth with conjugate gradient,
+ * other particles are integrated with explicit euler.
+ *
+ */
+class BackwardEuler final : public Integrator {
+ public:
+  /**
+   * @brief Construct a new backward euler integrator.
+   *
+   * @param cloth The cloth whose springs build the force Jacobian, must outlive the integrator.
+   */
+  explicit BackwardEuler(Cloth &cloth) noexcept :
+      cloth(cloth), patternParticles(-1), patternSprings(-1), _iterations(0), _error(0.0f) {}
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)>) const override {
+    integrateWith(particles, [] {});
+  }
+  /**
+   * @brief Same as integrate, simulateOneStep is not needed.
+   *
+   */
+  template <class Step>
+  void integrateWith(const std::vector<Particles *> &particles, Step &&) const {
+    advance(particles);
+  }
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::BACKWARD_EULER; }
+  /**
+   * @brief Conjugate gradient iterations of the last step.
+   *
+   */
+  int iterations() const { return _iterations; }
+  /**
+   * @brief Relative residual of the last step.
+   *
+   */
+  float error() const { return _error; }
+
+ private:
+  /**
+   * @brief Build the sparsity pattern of the system matrix, one 3x3 block per particle and per spring end.
+   * Only runs when the cloth topology changed.
+   *
+   */
+  void buildPattern() const;
+  void advance(const std::vector<Particles *> &particles) const;
+  void solveCloth(Particles &particles) const;
+  /**
+   * @brief Jacobi preconditioned conjugate gradient on systemMatrix, starting from deltaVelocity.
+   *
+   */
+  void conjugateGradient() const;
+
+  Cloth &cloth;
+  // Scratch state, integrate() is const in the interface
+  mutable Eigen::SparseMatrix<float> systemMatrix;
+  // Index into systemMatrix.valuePtr() of the top of each block column, 3 per block
+  mutable std::vector<int> diagonalOffset;
+  // Blocks (start, end) and (end, start) of each spring, 6 per spring
+  mutable std::vector<int> springOffset;
+  mutable Eigen::VectorXf rightHandSide;
+  // Kept between steps as the initial guess
+  mutable Eigen::VectorXf deltaVelocity;
+  // Conjugate gradient work vectors, Eigen::ConjugateGradient would allocate them on every solve
+  mutable Eigen::VectorXf inverseDiagonal, residual, direction, preconditioned, product;
+  mutable int patternParticles;
+  mutable int patternSprings;
+  mutable int _iterations;
+  mutable float _error;
+};
+
+/**
+ * @brief Adaptive Runge Kutta 3(2) of Bogacki and Shampine 1989.
+ * The difference between the third and the embedded second order solution estimates the local error,
+ * steps whose error exceeds adaptiveTolerance are rejected and retried with a smaller step.
+ *
+ */
+class BogackiShampine final : public Integrator {
+ public:
+  BogackiShampine() noexcept : _stepSize(0.0f), _acceptedSteps(0), _rejectedSteps(0) {}
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)> simulateOneStep) const override {
+    integrateWith(particles, simulateOneStep);
+  }
+  /**
+   * @brief Advance deltaTime with as many adaptive steps as needed.
+   *
+   */
+  template <class Step>
+  void integrateWith(const std::vector<Particles *> &particles, Step &&simulateOneStep) const {
+    advance(particles, simulateOneStep, deltaTime);
+  }
+  /**
+   * @brief Advance duration with adaptive steps, the step size is kept between calls.
+   * The acceleration must be up to date, and is up to date again on return.
+   *
+   * @param particles A vector of particles to be integrated.
+   * @param simulateOneStep A function that computes next step f(x, t+h)
+   * @param duration Simulated time to advance.
+   */
+  template <class Step>
+  void advance(const std::vector<Particles *> &particles, Step &&simulateOneStep, float duration) const;
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::BOGACKI_SHAMPINE; }
+  float stepSize() const { return _stepSize; }
+  long long acceptedSteps() const { return _acceptedSteps; }
+  long long rejectedSteps() const { return _rejectedSteps; }
+  void resetStatistics() {
+    _acceptedSteps = 0;
+    _rejectedSteps = 0;
+  }
+
+ private:
+  // Scratch slots after the ones of Integrator::Slot
+  enum Stage { ORIGIN_ACCELERATION = SUM_VELOCITY + 1, K2_VELOCITY, K2_ACCELERATION, K3_VELOCITY, K3_ACCELERATION };
+  static constexpr int stageCount = K3_ACCELERATION + 1;
+
+  // Next step size to try, 0 until the first step
+  mutable float _stepSize;
+  mutable long long _acceptedSteps;
+  mutable long long _rejectedSteps;
+};
+
+/**
+ * @brief Extended position based dynamics of Macklin et al. 2016, "XPBD: Position-Based Simulation of Compliant
+ * Constrained Dynamics". Each spring is a distance constraint with compliance 1 / stiffness, and the damper is the
+ * constraint damping of the paper. constraintIterations Gauss-Seidel sweeps are run per step, one spring color at a
+ * time so that a color can be projected in parallel. Other particles are integrated with explicit euler.
+ *
+ */
+class ExtendedPositionBasedDynamics final : public Integrator {
+ public:
+  /**
+   * @brief Construct a new XPBD integrator.
+   *
+   * @param cloth The cloth whose springs are the constraints, must outlive the integrator.
+   */
+  explicit ExtendedPositionBasedDynamics(Cloth &cloth) noexcept : cloth(cloth) {}
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)>) const override {
+    integrateWith(particles, [] {});
+  }
+  /**
+   * @brief Same as integrate, simulateOneStep is not needed.
+   * The cloth acceleration must not contain spring forces, they are recomputed without them when it does.
+   *
+   */
+  template <class Step>
+  void integrateWith(const std::vector<Particles *> &particles, Step &&) const {
+    advance(particles);
+  }
+  /**
+   * @brief Run substeps with the cloth spring forces turned off, they would be counted twice otherwise.
+   *
+   * @param particles A vector of particles to be integrated.
+   * @param simulateOneStep A function that computes next step f(x, t+h)
+   * @param substeps Number of steps.
+   */
+  template <class Step>
+  void integrateSubsteps(const std::vector<Particles *> &particles, Step &&simulateOneStep, int substeps) const;
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::EXTENDED_POSITION_BASED; }
+  /**
+   * @brief Largest relative stretch |l - l0| / l0 of the springs in the current state.
+   *
+   */
+  float maxStrain() const;
+
+ private:
+  void advance(const std::vector<Particles *> &particles) const;
+  void solveCloth(Particles &particles) const;
+  /**
+   * @brief Project springs [first, last) once, they must not share particles with springs projected concurrently.
+   *
+   */
+  void projectSprings(Particles &particles, int first, int last) const;
+
+  Cloth &cloth;
+  // Scratch state, integrate() is const in the interface
+  // Cloth position at the start of the step
+  mutable Eigen::Matrix4Xf previousPosition;
+  // Lagrange multiplier of each spring, reset every step
+  mutable std::vector<float> lambda;
+};
+
+/**
+ * @brief Projective dynamics of Bouaziz et al. 2014, "Projective Dynamics: Fusing Constraint Projections for Fast
+ * Simulation", over the cloth springs. Each of the constraintIterations local / global iterations projects every
+ * spring to its rest length (local, in parallel) and solves
+ * (M / h^2 + L + D / h) dx = M / h^2 * (s - x) + J * p - L * x - D_p / h * (x - x0) (global)
+ * for the correction dx of the positions x, which float keeps more precisely than x itself.
+ * D is the spring Laplacian weighted by damperCoef and D_p its part along the current spring directions, so once the
+ * iterations converge the dampers act along the springs like in the other integrators while the matrix stays constant.
+ * It only depends on springCoef, damperCoef, springStiffness, deltaTime and the awake particles, so it is factored
+ * with SimplicialLDLT on the first step and only refactored when one of them changes. Other particles are integrated
+ * with explicit euler.
+ *
+ */
+class ProjectiveDynamics final : public Integrator {
+ public:
+  /**
+   * @brief Construct a new projective dynamics integrator, the system matrix is factored on the first step.
+   *
+   * @param cloth The cloth whose springs are the constraints, must outlive the integrator.
+   * Fixed particles (mass 0) are read when the system is factored, changing them later needs a new integrator.
+   */
+  explicit ProjectiveDynamics(Cloth &cloth);
+  void integrate(const std::vector<Particles *> &particles, std::function<void(void)>) const override {
+    integrateWith(particles, [] {});
+  }
+  /**
+   * @brief Same as integrate, simulateOneStep is not needed.
+   * The cloth acceleration must not contain spring forces, they are recomputed without them when it does.
+   *
+   */
+  template <class Step>
+  void integrateWith(const std::vector<Particles *> &particles, Step &&) const {
+    advance(particles);
+  }
+  /**
+   * @brief Run substeps with the cloth spring forces turned off, they would be counted twice otherwise.
+   *
+   */
+  template <class Step>
+  void integrateSubsteps(const std::vector<Particles *> &particles, Step &&simulateOneStep, int substeps) const;
+  CONSTEXPR_VIRTUAL Type getType() const override { return Type::PROJECTIVE_DYNAMICS; }
+  /**
+   * @brief Number of times the system matrix was factored, including the one of the first step.
+   *
+   */
+  int factorizationCount() const { return _factorizationCount; }
+
+ private:
+  using PositionMatrix = Eigen::Matrix<float, Eigen::Dynamic, 3>;
+  /**
+   * @brief Build and factor the system matrix over the free particles, when any of its inputs changed.
+   *
+   */
+  void factorize() const;
+  void advance(const std::vector<Particles *> &particles) const;
+  void solveCloth(Particles &particles) const;
+  /**
+   * @brief Local step of springs [first, last), adds the pull towards their projections and their damping to
+   * rightHandSide.
+   * The springs must not share particles with springs handled concurrently.
+   *
+   */
+  void accumulateProjections(Particles &particles, int first, int last) const;
+
+  Cloth &cloth;
+  // Row of each particle in the system, -1 for fixed and sleeping particles
+  mutable std::vector<int> particleRow;
+  // Particle of each row
+  mutable std::vector<int> rowParticle;
+  // Scratch state, integrate() is const in the interface
+  mutable Eigen::SimplicialLDLT<Eigen::SparseMatrix<float>> solver;
+  // springCoef * relative stiffness of each spring, the weight of its projection
+  mutable std::vector<float> springWeight;
+  // Inputs of the factored matrix, it is rebuilt when one of them changes
+  mutable float factoredSpringCoef;
+  mutable float factoredDamperCoef;
+  mutable float factoredDeltaTime;
+  mutable std::array<float, 3> factoredStiffness;
+  mutable int factoredSprings;
+  mutable std::vector<std::pair<int, int>> factoredRanges;
+  mutable int _factorizationCount;
+  mutable Eigen::Matrix4Xf previousPosition;
+  // Inertial prediction s of each row
+  mutable PositionMatrix prediction;
+  mutable PositionMatrix rightHandSide;
+  mutable PositionMatrix solution;
+};
+
+template <class P, class Step>
+void ExplicitEuler::integrateWith(const std::vector<P *> &particles, Step &&) const {
+  // TODO: Integrate velocity and acceleration
+  //   1. Integrate velocity.
+  //   2. Integrate acceleration.
+  //   3. You should not compute position using acceleration. Since some part only update velocity. (e.g. impulse)
+  // Note:
+  //   1. You don't need the simulation function in explicit euler.
+  //   2. You should do this first because it is very simple. Then you can chech your collision is correct or not.
+  //   3. This can be done in 2 lines. (Hint: You can add / multiply all particles at once since it is a large matrix.)
+  for (const auto &p : particles) {
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(p->velocity()) += deltaTime * columns(p->acceleration());
+      columns(p->position()) += deltaTime * columns(p->velocity());
+    });
+  }
+}
+
+template <class P, class Step>
+void ImplicitEuler::integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const {
+  // TODO: Integrate velocity and acceleration
+  //   1. Backup original particles' data.
+  //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
+  //   3. Compute refined Xn+1 using (1.) and (2.).
+  // Note:
+  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
+
+  scratch.reserve(particles, 2);
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(scratch.get<P>(i, ORIGIN_VELOCITY)) = columns(p->velocity());
+      columns(scratch.get<P>(i, ORIGIN_POSITION)) = columns(p->position());
+      columns(p->position()) += deltaTime * columns(p->velocity());
+      columns(p->velocity()) += deltaTime * columns(p->acceleration());
+    });
+  }
+  simulateOneStep();
+
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(p->velocity()) = columns(scratch.get<P>(i, ORIGIN_VELOCITY)) + deltaTime * columns(p->acceleration());
+      columns(p->position()) = columns(scratch.get<P>(i, ORIGIN_POSITION)) + deltaTime * columns(p->velocity());
+    });
+  }
+}
+
+template <class P, class Step>
+void MidpointEuler::integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const {
+  // TODO: Integrate velocity and acceleration
+  //   1. Backup original particles' data.
+  //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
+  //   3. Compute refined Xn+1 using (1.) and (2.).
+  // Note:
+  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
+
+  scratch.reserve(particles, 2);
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(scratch.get<P>(i, ORIGIN_VELOCITY)) = columns(p->velocity());
+      columns(scratch.get<P>(i, ORIGIN_POSITION)) = columns(p->position());
+      columns(p->position()) += deltaTime * columns(p->velocity()) / 2;
+      columns(p->velocity()) += deltaTime * columns(p->acceleration()) / 2;
+    });
+  }
+  simulateOneStep();
+
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(p->velocity()) = columns(scratch.get<P>(i, ORIGIN_VELOCITY)) + deltaTime * columns(p->acceleration());
+      columns(p->position()) =
+          columns(scratch.get<P>(i, ORIGIN_POSITION)) + deltaTime * columns(scratch.get<P>(i, ORIGIN_VELOCITY));
+    });
+  }
+}
+
+template <class P, class Step>
+void RungeKuttaFourth::integrateWith(const std::vector<P *> &particles, Step &&simulateOneStep) const {
+  // TODO: Integrate velocity and acceleration
+  //   1. Backup original particles' data.
+  //   2. Compute k1, k2, k3, k4
+  //   3. Compute refined Xn+1 using (1.) and (2.).
+  // Note:
+  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
+
+  // k1 + 2 * k2 + 2 * k3 is accumulated in place, k4 is added at the end
+  scratch.reserve(particles, 4);
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(scratch.get<P>(i, ORIGIN_VELOCITY)) = columns(p->velocity());
+      columns(scratch.get<P>(i, ORIGIN_POSITION)) = columns(p->position());
+      columns(scratch.get<P>(i, SUM_ACCELERATION)) = deltaTime * columns(p->acceleration());
+      columns(scratch.get<P>(i, SUM_VELOCITY)) = deltaTime * columns(p->velocity());
+      columns(p->velocity()) = columns(p->velocity()) + deltaTime * columns(p->acceleration()) / 2;
+      columns(p->position()) = columns(p->position()) + deltaTime * columns(p->velocity()) / 2;
+    });
+  }
+  simulateOneStep();
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(scratch.get<P>(i, SUM_ACCELERATION)) += 2 * (deltaTime * columns(p->acceleration()));
+      columns(scratch.get<P>(i, SUM_VELOCITY)) += 2 * (deltaTime * columns(p->velocity()));
+      columns(p->velocity()) = columns(scratch.get<P>(i, ORIGIN_VELOCITY)) + deltaTime * columns(p->acceleration()) / 2;
+      columns(p->position()) = columns(scratch.get<P>(i, ORIGIN_POSITION)) + deltaTime * columns(p->velocity()) / 2;
+    });
+  }
+  simulateOneStep();
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(scratch.get<P>(i, SUM_ACCELERATION)) += 2 * (deltaTime * columns(p->acceleration()));
+      columns(scratch.get<P>(i, SUM_VELOCITY)) += 2 * (deltaTime * columns(p->velocity()));
+      columns(p->velocity()) = columns(scratch.get<P>(i, ORIGIN_VELOCITY)) + deltaTime * columns(p->acceleration());
+      columns(p->position()) = columns(scratch.get<P>(i, ORIGIN_POSITION)) + deltaTime * columns(p->velocity());
+    });
+  }
+  simulateOneStep();
+
+  for (int i = 0; i < static_cast<int>(particles.size()); ++i) {
+    P *p = particles[i];
+    forEachActiveRange(*p, [&](auto columns) {
+      columns(p->velocity()) = columns(scratch.get<P>(i, ORIGIN_VELOCITY)) +
+                               (columns(scratch.get<P>(i, SUM_ACCELERATION)) + deltaTime * columns(p->acceleration())) / 6;
+      columns(p->position()) = columns(scratch.get<P>(i, ORIGIN_POSITION)) +
+                               (columns(scratch.get<P>(i, SUM_VELOCITY)) + deltaTime * columns(p->velocity())) / 6;
+    });
+  }
+}
+
+template <class Step>
+void BogackiShampine::advance(const std::vector<Particles *> &particles, Step &&simulateOneStep,
+                              float duration) const {
+  // Below this the step is accepted whatever the error, so that a stiff state cannot stall the simulation
+  constexpr float minStepSize = 1e-7f;
+  int setCount = static_cast<int>(particles.size());
+  scratch.reserve(particles, stageCount);
+  if (_stepSize <= 0.0f) _stepSize = deltaTime;
+
+  float remaining = duration;
+  // Stop on rounding leftovers instead of taking a vanishing step
+  while (remaining > 1e-6f * duration) {
+    float h = std::min(_stepSize, remaining);
+    // k1 is the current velocity and acceleration
+    for (int i = 0; i < setCount; ++i) {
+      Particles *p = particles[i];
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(scratch.get(i, ORIGIN_POSITION)) = columns(p->position());
+        columns(scratch.get(i, ORIGIN_VELOCITY)) = columns(p->velocity());
+        columns(scratch.get(i, ORIGIN_ACCELERATION)) = columns(p->acceleration());
+        columns(p->position()) += (h / 2) * columns(p->velocity());
+        columns(p->velocity()) += (h / 2) * columns(p->acceleration());
+      });
+    }
+    simulateOneStep();
+    for (int i = 0; i < setCount; ++i) {
+      Particles *p = particles[i];
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(scratch.get(i, K2_VELOCITY)) = columns(p->velocity());
+        columns(scratch.get(i, K2_ACCELERATION)) = columns(p->acceleration());
+        columns(p->position()) = columns(scratch.get(i, ORIGIN_POSITION)) + (3 * h / 4) * columns(p->velocity());
+        columns(p->velocity()) = columns(scratch.get(i, ORIGIN_VELOCITY)) + (3 * h / 4) * columns(p->acceleration());
+      });
+    }
+    simulateOneStep();
+    for (int i = 0; i < setCount; ++i) {
+      Particles *p = particles[i];
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(scratch.get(i, K3_VELOCITY)) = columns(p->velocity());
+        columns(scratch.get(i, K3_ACCELERATION)) = columns(p->acceleration());
+        columns(p->position()) = columns(scratch.get(i, ORIGIN_POSITION)) +
+                                 h * (2.0f / 9 * columns(scratch.get(i, ORIGIN_VELOCITY)) +
+                                      1.0f / 3 * columns(scratch.get(i, K2_VELOCITY)) + 4.0f / 9 * columns(p->velocity()));
+        columns(p->velocity()) = columns(scratch.get(i, ORIGIN_VELOCITY)) +
+                                 h * (2.0f / 9 * columns(scratch.get(i, ORIGIN_ACCELERATION)) +
+                                      1.0f / 3 * columns(scratch.get(i, K2_ACCELERATION)) +
+                                      4.0f / 9 * columns(p->acceleration()));
+      });
+    }
+    // k4 is the derivative at the new state, reused as k1 of the next step when accepted
+    simulateOneStep();
+
+    // Third minus embedded second order solution: h * (-5/72 k1 + 1/12 k2 + 1/9 k3 - 1/8 k4)
+    float error = 0.0f;
+    for (int i = 0; i < setCount; ++i) {
+      Particles *p = particles[i];
+      forEachActiveRange(*p, [&](auto columns) {
+        float positionError =
+            (h * (-5.0f / 72 * columns(scratch.get(i, ORIGIN_VELOCITY)) + 1.0f / 12 * columns(scratch.get(i, K2_VELOCITY)) +
+                  1.0f / 9 * columns(scratch.get(i, K3_VELOCITY)) - 1.0f / 8 * columns(p->velocity())))
+                .cwiseAbs()
+                .maxCoeff();
+        float velocityError = (h * (-5.0f / 72 * columns(scratch.get(i, ORIGIN_ACCELERATION)) +
+                                    1.0f / 12 * columns(scratch.get(i, K2_ACCELERATION)) +
+                                    1.0f / 9 * columns(scratch.get(i, K3_ACCELERATION)) -
+                                    1.0f / 8 * columns(p->acceleration())))
+                                  .cwiseAbs()
+                                  .maxCoeff();
+        error = std::max({error, positionError, velocityError});
+      });
+    }
+    float ratio = error / adaptiveTolerance;
+    // Third order method, the error scales with h^3
+    float scale = ratio > 0.0f ? 0.9f * std::pow(ratio, -1.0f / 3) : 5.0f;
+    if (ratio <= 1.0f || h <= minStepSize) {
+      ++_acceptedSteps;
+      remaining -= h;
+      // A step cut short by the end of the interval says nothing about the next one
+      if (h == _stepSize) _stepSize = h * std::clamp(scale, 0.2f, 5.0f);
+    } else {
+      ++_rejectedSteps;
+      for (int i = 0; i < setCount; ++i) {
+        Particles *p = particles[i];
+        forEachActiveRange(*p, [&](auto columns) {
+          columns(p->position()) = columns(scratch.get(i, ORIGIN_POSITION));
+          columns(p->velocity()) = columns(scratch.get(i, ORIGIN_VELOCITY));
+          columns(p->acceleration()) = columns(scratch.get(i, ORIGIN_ACCELERATION));
+        });
+      }
+      _stepSize = std::max(minStepSize, h * std::clamp(scale, 0.2f, 1.0f));
+    }
+  }
+}
+
+template <class Step>
+void ExtendedPositionBasedDynamics::integrateSubsteps(const std::vector<Particles *> &particles,
+                                                     Step &&simulateOneStep, int substeps) const {
+  bool previous = setSpringForceEnabled(cloth, false);
+  for (int i = 0; i < substeps; ++i) {
+    simulateOneStep();
+    advance(particles);
+  }
+  setSpringForceEnabled(cloth, previous);
+}
+
+template <class Step>
+void ProjectiveDynamics::integrateSubsteps(const std::vector<Particles *> &particles, Step &&simulateOneStep,
+                                          int substeps) const {
+  bool previous = setSpringForceEnabled(cloth, false);
+  for (int i = 0; i < substeps; ++i) {
+    simulateOneStep();
+    advance(particles);
+  }
+  setSpringForceEnabled(cloth, previous);
+}
+
+/**
+ * @brief Run substeps of simulateOneStep followed by integration.
+ * The integrator type is resolved once, so every substep calls simulateOneStep without std::function or virtual calls.
+ *
+ * @param integrator The integrator, dispatched on getType().
+ * @param particles A vector of particles to be integrated.
+ * @param simulateOneStep A function that computes next step f(x, t+h)
+ * @param substeps Number of steps, BogackiShampine covers substeps * deltaTime with its own step size instead.
+ */
+template <class Step>
+void integrateSubsteps(const Integrator &integrator, const std::vector<Particles *> &particles, Step &&simulateOneStep,
+                       int substeps) {
+  auto run = [&](const auto &concrete) {
+    for (int i = 0; i < substeps; ++i) {
+      simulateOneStep();
+      concrete.integrateWith(particles, simulateOneStep);
+    }
+  };
+  switch (integrator.getType()) {
+    // Adaptive steps cover the whole interval, the step size is not tied to deltaTime
+    case Integrator::Type::BOGACKI_SHAMPINE:
+      if (substeps > 0) {
+        simulateOneStep();
+        static_cast<const BogackiShampine &>(integrator).advance(particles, simulateOneStep, substeps * deltaTime);
+      }
+      break;
+    case Integrator::Type::EXTENDED_POSITION_BASED:
+      static_cast<const ExtendedPositionBasedDynamics &>(integrator).integrateSubsteps(particles, simulateOneStep,
+                                                                                        substeps);
+      break;
+    case Integrator::Type::PROJECTIVE_DYNAMICS:
+      static_cast<const ProjectiveDynamics &>(integrator).integrateSubsteps(particles, simulateOneStep, substeps);
+      break;
+    case Integrator::Type::EXPLICIT_EULER: run(static_cast<const ExplicitEuler &>(integrator)); break;
+    case Integrator::Type::IMPLICIT_EULER: run(static_cast<const ImplicitEuler &>(integrator)); break;
+    case Integrator::Type::MIDPOINT_EULER: run(static_cast<const MidpointEuler &>(integrator)); break;
+    case Integrator::Type::RUNGE_KUTTA_FOURTH: run(static_cast<const RungeKuttaFourth &>(integrator)); break;
+    case Integrator::Type::BACKWARD_EULER: run(static_cast<const BackwardEuler &>(integrator)); break;
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+#include "utils.h"
+
+/**
+ * @brief A file mapped into memory, read-only or read-write. Errors are printed to stderr.
+ *
+ */
+class MappedFile final {
+ public:
+  MappedFile() noexcept;
+  DELETE_COPY(MappedFile)
+  DELETE_MOVE(MappedFile)
+  /**
+   * @brief Destroy the MappedFile object. Unmap and close the file.
+   *
+   */
+  ~MappedFile();
+  /**
+   * @brief Map an existing file read-only.
+   *
+   * @param filename The file to be mapped.
+   * @return false if the file cannot be opened or mapped.
+   */
+  bool open(const std::filesystem::path& filename);
+  /**
+   * @brief Create or truncate a file of the given size and map it read-write.
+   *
+   * @param filename The file to be created.
+   * @param _size Size of the file in bytes.
+   * @return false if the file cannot be created or mapped.
+   */
+  bool create(const std::filesystem::path& filename, std::size_t _size);
+  /**
+   * @brief Grow or shrink a file opened by create(), the mapping may move.
+   *
+   * @param _size New size of the file in bytes.
+   * @return false if the file cannot be resized, it is closed in that case.
+   */
+  bool resize(std::size_t _size);
+  /**
+   * @brief Unmap and close the file, writes of a read-write mapping are kept.
+   *
+   */
+  void close() noexcept;
+
+  bool isOpen() const { return mapped != nullptr || fileHandle != invalidHandle; }
+  bool isWritable() const { return writable; }
+  const unsigned char* data() const { return mapped; }
+  /**
+   * @brief Get the mapping of a file opened by create(), nullptr for read-only files.
+   *
+   */
+  unsigned char* writableData() { return writable ? mapped : nullptr; }
+  std::size_t size() const { return _size; }
+
+ private:
+  bool map();
+  void unmap() noexcept;
+
+#ifdef _WIN32
+  using Handle = void*;
+  static inline Handle const invalidHandle = reinterpret_cast<Handle>(static_cast<std::intptr_t>(-1));
+  Handle mappingHandle;
+#else
+  using Handle = int;
+  static constexpr Handle invalidHandle = -1;
+#endif
+  Handle fileHandle;
+  unsigned char* mapped;
+  std::size_t _size;
+  bool writable;
+  std::filesystem::path filename;
+};
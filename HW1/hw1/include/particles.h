@@ -1,34 +1,64 @@
 #pragma once
 #include <Eigen/Core>
+#include <utility>
 #include <vector>
 
-class Particles {
+/**
+ * @brief Position, velocity, acceleration and mass of a set of particles, one column per particle.
+ * Width 4 pads xyz with an unused w so that every float column is a 16-byte aligned SIMD register, width 3 packs xyz
+ * for 25% less memory traffic. Only x, y and z are simulated, instantiated in particles.cpp for the layouts below.
+ *
+ * @tparam Scalar float, or double for reference runs.
+ * @tparam Width 3 or 4 rows per column.
+ */
+template <class Scalar, int Width>
+class BasicParticles {
+  static_assert(Width == 3 || Width == 4, "particles store xyz, optionally padded with w");
+
  public:
-  Particles(int size = -1, float mass_ = 0.0f) noexcept;
+  using ScalarType = Scalar;
+  static constexpr int width = Width;
+  using Matrix = Eigen::Matrix<Scalar, Width, Eigen::Dynamic>;
+  using Vector = Eigen::Matrix<Scalar, Width, 1>;
+
+  BasicParticles(int size = -1, Scalar mass_ = Scalar(0)) noexcept;
   void resize(int newSize);
   void setZero();
 
   int getCapacity() const { return static_cast<int>(_position.cols()); }
   // Get all particles.
-  Eigen::Ref<Eigen::Matrix4Xf> position() { return _position; }
-  Eigen::Ref<Eigen::Matrix4Xf> velocity() { return _velocity; }
-  Eigen::Ref<Eigen::Matrix4Xf> acceleration() { return _acceleration; }
-  std::vector<float>& mass() { return _mass; }
+  Eigen::Ref<Matrix> position() { return _position; }
+  Eigen::Ref<Matrix> velocity() { return _velocity; }
+  Eigen::Ref<Matrix> acceleration() { return _acceleration; }
+  std::vector<Scalar>& mass() { return _mass; }
   // Get specific particle by index.
-  Eigen::Ref<Eigen::Vector4f> position(int i) { return _position.col(i); }
-  Eigen::Ref<Eigen::Vector4f> velocity(int i) { return _velocity.col(i); }
-  Eigen::Ref<Eigen::Vector4f> acceleration(int i) { return _acceleration.col(i); }
-  float& mass(int i) { return _mass[i]; }
-  float inverseMass(int i) { return (_mass[i] == 0.0f) ? 0.0f : 1.0f / _mass[i]; }
+  Eigen::Ref<Vector> position(int i) { return _position.col(i); }
+  Eigen::Ref<Vector> velocity(int i) { return _velocity.col(i); }
+  Eigen::Ref<Vector> acceleration(int i) { return _acceleration.col(i); }
+  Scalar& mass(int i) { return _mass[i]; }
+  Scalar inverseMass(int i) { return (_mass[i] == Scalar(0)) ? Scalar(0) : Scalar(1) / _mass[i]; }
+  /**
+   * @brief Particles [first, second) of each range are simulated, the others sleep and are skipped by forces and
+   * integrators. Ranges are increasing and do not touch, all particles are active unless the owner set them.
+   *
+   */
+  const std::vector<std::pair<int, int>>& activeRanges() const { return _activeRanges; }
+  void setActiveRanges(const std::vector<std::pair<int, int>>& ranges) { _activeRanges = ranges; }
 
-  const float* getPositionData() const { return _position.data(); }
-  const float* getVelocityData() const { return _velocity.data(); }
-  const float* getAccelerationData() const { return _acceleration.data(); }
-  const float* getMassData() const { return _mass.data(); }
+  const Scalar* getPositionData() const { return _position.data(); }
+  const Scalar* getVelocityData() const { return _velocity.data(); }
+  const Scalar* getAccelerationData() const { return _acceleration.data(); }
+  const Scalar* getMassData() const { return _mass.data(); }
 
  private:
-  Eigen::Matrix4Xf _position;
-  Eigen::Matrix4Xf _velocity;
-  Eigen::Matrix4Xf _acceleration;
-  std::vector<float> _mass;
+  Matrix _position;
+  Matrix _velocity;
+  Matrix _acceleration;
+  std::vector<Scalar> _mass;
+  std::vector<std::pair<int, int>> _activeRanges;
 };
+
+// The layout used by the simulation, the kernels and the renderer
+using Particles = BasicParticles<float, 4>;
+using PackedParticles = BasicParticles<float, 3>;
+using DoubleParticles = BasicParticles<double, 4>;
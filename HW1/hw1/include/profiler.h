@@ -0,0 +1,127 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+/// @brief Phases timed by ScopedTimer, the first four run on the simulation thread and the others on the render thread.
+enum class ProfilePhase { FORCES, COLLISIONS, INTEGRATION, NORMALS, UPLOAD, DRAW, GUI, COUNT };
+
+/**
+ * @brief Time spent in each phase over the last frames, and optionally every timed scope as a Chrome trace event.
+ * Phase times are exclusive: a scope nested in another one, like the forces evaluated inside the integration, only
+ * counts for itself, so the phases of a thread add up to its busy time. Timers do nothing until it is enabled.
+ *
+ */
+class Profiler final {
+ public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr int phaseCount = static_cast<int>(ProfilePhase::COUNT);
+  // Frames kept for the plots
+  static constexpr int historySize = 240;
+  // Trace events kept at most, 24 MiB, later ones are dropped
+  static constexpr size_t maxTraceEvents = size_t(1) << 20;
+
+  DELETE_COPY(Profiler)
+  DELETE_MOVE(Profiler)
+  /// @brief Get the profiler shared by all threads.
+  static Profiler& getProfiler();
+  static const char* phaseName(ProfilePhase phase);
+
+  bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+  void setEnabled(bool enable) { enabled.store(enable, std::memory_order_relaxed); }
+  /**
+   * @brief Record a finished scope, called by ScopedTimer.
+   *
+   * @param start Start of the scope.
+   * @param duration Time from start to the end of the scope, the length of the trace event.
+   * @param exclusive Duration without the nested scopes, added to the current frame.
+   */
+  void record(ProfilePhase phase, Clock::time_point start, Clock::duration duration, Clock::duration exclusive);
+  /**
+   * @brief Move the phase times recorded since the last call into the history as one frame.
+   * Call once per frame from the thread that reads the history.
+   *
+   */
+  void endFrame();
+  /**
+   * @brief Milliseconds of a phase over the last historySize frames, a ring buffer whose oldest frame is at
+   * historyOffset(). Frames recorded while disabled are zero.
+   *
+   */
+  const float* history(ProfilePhase phase) const { return phaseHistory[static_cast<int>(phase)].data(); }
+  /// @brief Milliseconds between calls of endFrame(), same layout as history().
+  const float* frameHistory() const { return frameTimes.data(); }
+  int historyOffset() const { return nextFrame; }
+  /// @brief Mean of history() or frameHistory() in milliseconds.
+  static float average(const float* history);
+
+  /// @brief Name the calling thread in trace exports.
+  void setThreadName(const std::string& name);
+  /**
+   * @brief Start collecting trace events while enabled, which drops the previous ones, or stop collecting them.
+   *
+   */
+  void setTracing(bool trace);
+  bool isTracing() const { return tracing.load(std::memory_order_relaxed); }
+  size_t traceEventCount() const;
+  /**
+   * @brief Write the collected events as Chrome trace event JSON, which chrome://tracing and Perfetto open.
+   *
+   * @return Whether the file was written.
+   */
+  bool saveTrace(const std::filesystem::path& filename) const;
+
+ private:
+  struct TraceEvent {
+    ProfilePhase phase;
+    int thread;
+    // Nanoseconds since setTracing(true)
+    long long start;
+    long long duration;
+  };
+
+  Profiler();
+  // Small index of the calling thread, assigned on first use
+  int threadIndex();
+
+  std::atomic<bool> enabled;
+  std::atomic<bool> tracing;
+  // Nanoseconds of each phase in the current frame, added to by every thread
+  std::array<std::atomic<long long>, phaseCount> accumulated;
+  std::array<std::array<float, historySize>, phaseCount> phaseHistory;
+  std::array<float, historySize> frameTimes;
+  int nextFrame;
+  Clock::time_point lastFrame;
+  Clock::time_point traceOrigin;
+  mutable std::mutex traceMutex;
+  std::vector<TraceEvent> traceEvents;
+  // Indexed by threadIndex(), empty for unnamed threads
+  std::vector<std::string> threadNames;
+  std::atomic<int> threadCount;
+};
+
+/**
+ * @brief Times its scope as a phase of Profiler::getProfiler(), a no-op while the profiler is disabled.
+ *
+ */
+class ScopedTimer final {
+ public:
+  explicit ScopedTimer(ProfilePhase phase);
+  ~ScopedTimer();
+  DELETE_COPY(ScopedTimer)
+  DELETE_MOVE(ScopedTimer)
+
+ private:
+  ProfilePhase phase;
+  bool isActive;
+  Profiler::Clock::time_point start;
+  // Time of the nested timers, not counted for this one
+  Profiler::Clock::duration nested;
+  ScopedTimer* parent;
+};
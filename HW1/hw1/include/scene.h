@@ -0,0 +1,35 @@
+#pragma once
+#include <filesystem>
+#include <vector>
+
+#include <Eigen/Core>
+
+/**
+ * @brief Scene description loaded from a text file. Each non-empty line is one entry, `#` starts a comment.
+ *
+ *   cloth <particlesPerEdge> <width> <height>
+ *   instance <x> <y> <z>
+ *   sphere <x> <y> <z> <radius>
+ *
+ * Each instance line is a copy of the cloth moved by (x, y, z), all copies are simulated in one batch. Without instance
+ * lines there is a single cloth at the origin.
+ *
+ */
+struct Scene {
+  Scene();
+  /**
+   * @brief Load the scene from a file, any sphere or instance in the file replaces the default ones.
+   *
+   * @param filename The scene file.
+   * @return false if the file cannot be opened or contains invalid entries, error is printed to stderr.
+   */
+  bool load(const std::filesystem::path& filename);
+
+  int particlesPerEdge;
+  float clothWidth;
+  float clothHeight;
+  // One offset per cloth instance, a single one at the origin by default
+  std::vector<Eigen::Vector4f> clothOffsets;
+  std::vector<Eigen::Vector4f> spherePositions;
+  std::vector<float> sphereRadius;
+};
@@ -7,6 +7,15 @@ class Cloth;
 class Spheres;
 
 class Integrator;
+
+/**
+ * @brief Set the acceleration of particles [first, last) to gravity and viscous drag, fixed particles (mass 0) get
+ * none. Works on every layout instantiated in shape.cpp, Shape uses it on its own particles.
+ *
+ */
+template <class Scalar, int Width>
+void applyExternalForce(BasicParticles<Scalar, Width>& particles, int first, int last);
+
 class Shape {
  public:
   explicit Shape(int size, float mass_) noexcept;
@@ -17,10 +26,15 @@ class Shape {
   Eigen::Matrix4f getModelMatrix() const { return modelMatrix; }
   Eigen::Matrix4f getNormalMatrix() const { return normalMatrix; }
   /**
-   * @brief Compute gravity and viscous force.
+   * @brief Compute gravity and viscous force of the active particles.
    *
    */
   void computeExternalForce();
+  /**
+   * @brief Compute gravity and viscous force of particles [first, last).
+   *
+   */
+  void computeExternalForce(int first, int last);
   virtual void collide(Shape* shape) = 0;
   virtual void collide(Cloth*) { return; }
   virtual void collide(Spheres*) { return; }
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cloth.h"
+#include "integrator.h"
+#include "snapshot.h"
+#include "sphere.h"
+#include "trajectorycache.h"
+#include "utils.h"
+
+/**
+ * @brief Runs the simulation of the viewer on its own thread, so that rendering and simulation do not wait on each
+ * other. Fixed steps of deltaTime are taken as real time accumulates, and the state after each batch of steps is
+ * published as a SimulationSnapshot.
+ *
+ */
+class SimulationThread final {
+ public:
+  /**
+   * @brief Publish the initial state, the thread is not started yet.
+   *
+   * @param cloth The cloth, only touched by the simulation thread once started.
+   * @param spheres The spheres, only touched by the simulation thread once started.
+   */
+  SimulationThread(Cloth& cloth, Spheres& spheres);
+  DELETE_COPY(SimulationThread)
+  DELETE_MOVE(SimulationThread)
+  /// @brief Stop the thread.
+  ~SimulationThread();
+  void start();
+  void stop();
+  /**
+   * @brief Hold this to change the configs, the integrator or the particles while the thread is running.
+   * It is released between batches of steps, which are cut to take about as long as a few milliseconds.
+   *
+   */
+  std::unique_lock<std::mutex> lock();
+  /**
+   * @brief Select the integrator, lock() must be held.
+   *
+   */
+  void setIntegrator(const Integrator* newIntegrator) { integrator = newIntegrator; }
+  /**
+   * @brief Append the current state to a trajectory cache, then a frame every simulationPerFrame steps.
+   * nullptr stops recording, lock() must be held.
+   *
+   */
+  void setRecorder(TrajectoryCache* newRecorder);
+  bool isRecording() const { return recorder != nullptr; }
+  /**
+   * @brief Take the latest published snapshot, lock-free. The first call always takes the initial state.
+   *
+   * @return Whether snapshot() changed.
+   */
+  bool updateSnapshot() { return snapshots.update(); }
+  const SimulationSnapshot& snapshot() const { return snapshots.readBuffer(); }
+  /**
+   * @brief Steps per second of real time, measured over the last half second of simulation.
+   *
+   */
+  float stepsPerSecond() const { return _stepsPerSecond.load(std::memory_order_relaxed); }
+  /**
+   * @brief Steps taken since the start, lock() must be held.
+   *
+   */
+  long long stepCount() const { return steps; }
+  /**
+   * @brief Copy the state into the next snapshot and publish it, lock() must be held.
+   * Call after changing the particles, the thread only publishes after it steps.
+   *
+   */
+  void publish();
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  void run();
+  void step(int count);
+
+  Cloth& cloth;
+  Spheres& spheres;
+  std::vector<Particles*> particles;
+  const Integrator* integrator;
+  TrajectoryCache* recorder;
+  int stepsUntilRecord;
+  std::mutex mutex;
+  // Threads waiting in lock(), the simulation thread lets them in before its next batch
+  std::atomic<int> waiting;
+  std::thread thread;
+  std::atomic<bool> stopping;
+  TripleBuffer<SimulationSnapshot> snapshots;
+  long long steps;
+  // Whether the last snapshot has normals
+  bool publishedNormal;
+  std::atomic<float> _stepsPerSecond;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <Eigen/Core>
+#include <array>
+#include <atomic>
+
+#include "utils.h"
+
+/**
+ * @brief Lock-free triple buffer between one producer and one consumer thread.
+ * The producer fills writeBuffer() and publishes it, the consumer takes the latest published buffer with update().
+ * Neither side ever waits, a buffer published twice before the consumer looks is simply replaced.
+ *
+ */
+template <class T>
+class TripleBuffer {
+ public:
+  TripleBuffer() noexcept : shared(1), back(0), front(2) {}
+  DELETE_COPY(TripleBuffer)
+  DELETE_MOVE(TripleBuffer)
+  /**
+   * @brief Get the buffer owned by the producer.
+   *
+   */
+  T& writeBuffer() { return buffers[back]; }
+  /**
+   * @brief Hand writeBuffer() to the consumer, and take back the buffer it is not reading.
+   *
+   */
+  void publish() { back = shared.exchange(back | freshBit, std::memory_order_acq_rel) & indexMask; }
+  /**
+   * @brief Take the latest published buffer, if there is one the consumer has not seen.
+   *
+   * @return Whether readBuffer() changed.
+   */
+  bool update() {
+    if (!(shared.load(std::memory_order_acquire) & freshBit)) return false;
+    front = shared.exchange(front, std::memory_order_acq_rel) & indexMask;
+    return true;
+  }
+  /**
+   * @brief Get the buffer owned by the consumer.
+   *
+   */
+  const T& readBuffer() const { return buffers[front]; }
+
+ private:
+  static constexpr unsigned indexMask = 3;
+  // Set when the middle buffer was published after the consumer's last update
+  static constexpr unsigned freshBit = 4;
+  std::array<T, 3> buffers;
+  // Index of the middle buffer and freshBit
+  std::atomic<unsigned> shared;
+  // Only touched by the producer
+  unsigned back;
+  // Only touched by the consumer
+  unsigned front;
+};
+
+/**
+ * @brief Simulation state needed to draw a frame.
+ *
+ */
+struct SimulationSnapshot {
+  Eigen::Matrix4Xf clothPosition;
+  // Empty when surface drawing was off at the time of the snapshot
+  Eigen::Matrix4Xf clothNormal;
+  Eigen::Matrix4Xf spherePosition;
+  int sphereCount = 0;
+  // Steps simulated since the start
+  long long steps = 0;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+
+/**
+ * @brief Uniform grid over particle positions, stored as a hash table built with a counting sort.
+ * Rebuild it whenever the positions change, the storage is reused between builds.
+ *
+ */
+class SpatialHash {
+ public:
+  SpatialHash() noexcept : _cellSize(1.0f), inverseCellSize(1.0f), tableMask(0) {}
+  /**
+   * @brief Insert every column of positions into the grid.
+   *
+   * @param positions Particle positions, w is ignored.
+   * @param cellSize Edge length of a grid cell.
+   */
+  void build(const Eigen::Ref<const Eigen::Matrix4Xf>& positions, float cellSize);
+  /**
+   * @brief Append the index of every particle whose cell overlaps the box [minCorner, maxCorner].
+   * Each particle is reported at most once, in no particular order.
+   *
+   * @param result Indices are appended to it.
+   */
+  void query(const Eigen::Ref<const Eigen::Vector4f>& minCorner,
+             const Eigen::Ref<const Eigen::Vector4f>& maxCorner,
+             std::vector<int>& result) const;
+  float cellSize() const { return _cellSize; }
+
+ private:
+  std::array<int, 3> cellOf(const float* position) const;
+  uint32_t hashCell(const std::array<int, 3>& cell) const;
+
+  float _cellSize;
+  float inverseCellSize;
+  uint32_t tableMask;
+  // Particles of bucket i are in [bucketStart[i], bucketStart[i + 1])
+  std::vector<int> bucketStart;
+  std::vector<int> sortedIndex;
+  // Cell of each sorted entry, different cells may share a bucket
+  std::vector<std::array<int, 3>> sortedCell;
+  std::vector<uint32_t> particleBucket;
+};
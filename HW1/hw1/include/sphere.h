@@ -1,31 +1,90 @@
 #pragma once
 #include <Eigen/Core>
+#include <utility>
 #include <vector>
 
-#include "buffer.h"
 #include "shape.h"
+#include "snapshot.h"
+#include "spatialhash.h"
 #include "utils.h"
+#ifndef HW1_HEADLESS
+#include "buffer.h"
 #include "vertexarray.h"
+#endif
 
 class Spheres final : public Shape {
  public:
   MOVE_ONLY(Spheres)
   static Spheres& initSpheres();
   void addSphere(const Eigen::Ref<const Eigen::Vector4f>& position, float size);
+#ifndef HW1_HEADLESS
+  /**
+   * @brief Write the sphere positions of a snapshot to the next region of the offset stream, once per snapshot.
+   *
+   */
+  void upload(const SimulationSnapshot& snapshot);
+  /**
+   * @brief Render the spheres of the last upload.
+   *
+   */
   void draw() const;
+#endif
   void collide(Shape* shape) override;
   void collide(Cloth* cloth) override;
+  /**
+   * @brief Sphere-sphere collision, sweep and prune broadphase.
+   *
+   */
   void collide() override;
+  /**
+   * @brief Same as collide() but tests every pair, kept as a reference for benchmarks.
+   *
+   */
+  void collideAllPairs();
+  /**
+   * @brief Remove all spheres, the storage is kept.
+   *
+   */
+  void clear() { sphereCount = 0; }
   float radius(int i) const { return _radius[i]; }
+  int count() const { return sphereCount; }
 
  private:
   Spheres();
+  /**
+   * @brief Sort spheres by the lower end of their interval on the sweep axis.
+   *
+   */
+  void updateSweepOrder();
+  void collidePair(int i, int j);
+  /**
+   * @brief Swept sphere against the cloth triangles over the coming step, the earliest hit of each sphere removes the
+   * approaching velocity. Called by collide(Cloth*) when isUsingContinuousCollision is set.
+   *
+   */
+  void collideContinuous(Cloth* cloth);
 
   int sphereCount;
   std::vector<float> _radius;
+  // Broadphase for collide(Cloth*), rebuilt every call
+  SpatialHash clothHash;
+  std::vector<int> candidates;
+  // Motion of every cloth particle over the coming step, for collideContinuous
+  Eigen::Matrix4Xf clothDisplacement;
+  // Cloth contact normal of each sphere in the last collideContinuous, zero without a contact
+  Eigen::Matrix4Xf contactNormal;
+  // Broadphase for collide(), the order is kept between calls
+  int sweepAxis;
+  std::vector<int> sweepOrder;
+  std::vector<float> sweepKey;
+  std::vector<std::pair<int, int>> sweepPairs;
+#ifndef HW1_HEADLESS
   VertexArray vao;
   ArrayBuffer vbo;
-  ArrayBuffer offsets;
+  StreamArrayBuffer offsets;
+  // Spheres in the last upload
+  int uploadedCount;
   ArrayBuffer sizes;
   ElementArrayBuffer ebo;
+#endif
 };
@@ -1,4 +1,12 @@
 #pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+template <class Scalar, int Width>
+class BasicParticles;
+using Particles = BasicParticles<float, 4>;
 
 class Spring {
  public:
@@ -17,3 +25,44 @@ class Spring {
   float _length;
   Type _springType;
 };
+
+/**
+ * @brief Structure-of-arrays copy of the springs, the layout used by the vectorized force kernel.
+ *
+ */
+class SpringArray {
+ public:
+  /**
+   * @brief Rebuild the arrays from springs, the order is preserved.
+   *
+   * @param springs The springs to be copied.
+   */
+  void assign(const std::vector<Spring>& springs);
+  int size() const { return static_cast<int>(_restLength.size()); }
+  /**
+   * @brief Bytes allocated by the arrays.
+   *
+   */
+  size_t memoryBytes() const;
+  /**
+   * @brief Accumulate spring and damper force of springs [first, last) into particles' acceleration.
+   * Springs in the range must not share particles, the lanes of a vector are scattered without conflict checks.
+   *
+   * @param particles The particles connected by the springs.
+   * @param first Index of the first spring.
+   * @param last One past the last spring.
+   */
+  void accumulateForce(Particles& particles, int first, int last) const;
+  /**
+   * @brief Get the instruction set used by accumulateForce
+   *
+   * @return "AVX-512", "AVX2" or "Scalar"
+   */
+  static const char* kernelName();
+
+ private:
+  std::vector<int32_t> _startIndex;
+  std::vector<int32_t> _endIndex;
+  std::vector<float> _restLength;
+  std::vector<int32_t> _type;
+};
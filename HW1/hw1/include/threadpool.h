@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+class ThreadPool final {
+ public:
+  // Not copyable
+  DELETE_COPY(ThreadPool)
+  // Not movable
+  DELETE_MOVE(ThreadPool)
+  /// @brief Join all workers.
+  ~ThreadPool();
+  /// @brief Get the pool shared by the simulation.
+  static ThreadPool& getPool();
+  /// @return Number of threads, including the calling thread.
+  int size() const { return threadCount; }
+  /**
+   * @brief Change the number of threads. Must not be called inside run().
+   *
+   * @param newSize Number of threads, values less than 1 means using all hardware threads.
+   */
+  void resize(int newSize);
+  /**
+   * @brief Run task(threadIndex) on every thread and wait for all of them. The calling thread is index 0.
+   *
+   * @param task The work to be done, should not call run() recursively.
+   */
+  void run(const std::function<void(int)>& task);
+  /// @brief Wait until every thread of the current run() reaches this point. Only valid inside run().
+  void barrier();
+  /**
+   * @brief Get the static partition of [begin, end) assigned to a thread.
+   *
+   * @return [first, last) of the thread's chunk, may be empty.
+   */
+  std::pair<int, int> range(int begin, int end, int threadIndex) const;
+  /**
+   * @brief Split [begin, end) into size() contiguous chunks and call function(first, last) for each of them.
+   *
+   */
+  template <class Function>
+  void parallelFor(int begin, int end, Function&& function) {
+    if (threadCount == 1 || end - begin < 2) {
+      if (begin < end) function(begin, end);
+      return;
+    }
+    run([&](int threadIndex) {
+      auto [first, last] = range(begin, end, threadIndex);
+      if (first < last) function(first, last);
+    });
+  }
+
+ private:
+  /// @brief Create a single threaded pool, call by getPool method
+  ThreadPool();
+  void workerLoop(int threadIndex, unsigned long long seen);
+  void stopWorkers();
+
+  int threadCount;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::condition_variable finished;
+  const std::function<void(int)>* currentTask;
+  unsigned long long generation;
+  int pending;
+  bool stopping;
+
+  std::atomic<int> barrierCount;
+  std::atomic<int> barrierGeneration;
+};
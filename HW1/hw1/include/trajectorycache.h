@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "mappedfile.h"
+#include "utils.h"
+
+/**
+ * @brief Recorded cloth and sphere positions in a memory-mapped file, any frame can be reconstructed without
+ * simulating. Every keyframeInterval frames a full keyframe is written, the frames between store the difference to
+ * the previous frame quantized to 16 bits with a per-frame scale.
+ * Deltas are taken against the reconstructed previous frame, so the error of a frame stays under tolerance instead of
+ * adding up. A frame that moves too far for the tolerance is written as a keyframe.
+ *
+ */
+class TrajectoryCache final {
+ public:
+  /**
+   * @brief Construct an empty cache, call create() before append().
+   *
+   * @param keyframeInterval Frames between keyframes, bounds the deltas replayed by a random seek.
+   * @param tolerance Largest position error of a reconstructed frame.
+   */
+  explicit TrajectoryCache(int keyframeInterval = 32, float tolerance = 1e-4f) noexcept;
+  DELETE_COPY(TrajectoryCache)
+  DELETE_MOVE(TrajectoryCache)
+  /**
+   * @brief Destroy the TrajectoryCache object. Close the file.
+   *
+   */
+  ~TrajectoryCache();
+  /**
+   * @brief Start a new recording, an existing file is overwritten.
+   *
+   * @param filename The cache file.
+   * @param clothParticles Number of cloth particles per frame.
+   * @param sphereCount Number of spheres per frame.
+   * @return false if the file cannot be created, error is printed to stderr.
+   */
+  bool create(const std::filesystem::path& filename, int clothParticles, int sphereCount);
+  /**
+   * @brief Append a frame, the sizes must match the ones given to create().
+   *
+   * @return false if the sizes do not match or the file cannot grow.
+   */
+  bool append(const Eigen::Ref<const Eigen::Matrix4Xf>& cloth, const Eigen::Ref<const Eigen::Matrix4Xf>& spheres);
+  /**
+   * @brief Reconstruct a frame into the xyz of the positions, w is not touched. Replays from the nearest keyframe,
+   * or from the last reconstructed frame when it is closer.
+   *
+   * @return false if there is no such frame.
+   */
+  bool frame(int index, Eigen::Ref<Eigen::Matrix4Xf> cloth, Eigen::Ref<Eigen::Matrix4Xf> spheres);
+  /**
+   * @brief Truncate the file to the recorded frames and close it.
+   *
+   */
+  void close();
+
+  bool isOpen() const { return file.isOpen(); }
+  int frameCount() const { return static_cast<int>(frameOffsets.size()); }
+  int keyframeCount() const { return keyframes; }
+  int clothParticles() const { return _clothParticles; }
+  int sphereCount() const { return _sphereCount; }
+  /**
+   * @brief Bytes used by the recorded frames, header included.
+   *
+   */
+  std::size_t bytes() const { return used; }
+
+ private:
+  enum class FrameType : uint32_t { KEYFRAME, DELTA };
+  bool reserve(std::size_t extra);
+  void writeHeader();
+  // Apply the frame at offset to decoded
+  void decode(std::size_t offset);
+
+  int keyframeInterval;
+  float tolerance;
+  int _clothParticles;
+  int _sphereCount;
+  MappedFile file;
+  std::size_t used;
+  int keyframes;
+  // Offset of every frame record, and the index of the keyframe it is replayed from
+  std::vector<std::size_t> frameOffsets;
+  std::vector<int> keyframeOf;
+  // xyz of all cloth particles then all spheres, as the decoder will see the last appended frame
+  Eigen::Matrix3Xf encoded;
+  Eigen::Matrix3Xf delta;
+  std::vector<int16_t> quantized;
+  // Last reconstructed frame
+  Eigen::Matrix3Xf decoded;
+  int decodedIndex;
+};
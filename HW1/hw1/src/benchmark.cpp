@@ -0,0 +1,742 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Geometry>
+
+#include "cloth.h"
+#include "configs.h"
+#include "integrator.h"
+#include "scene.h"
+#include "shape.h"
+#include "sphere.h"
+#include "threadpool.h"
+
+namespace {
+std::atomic<long long> allocationCount{0};
+}  // namespace
+
+#if defined(__GLIBC__)
+// Count every heap allocation of the process, Eigen allocates with malloc so counting operator new is not enough.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+void* realloc(void* pointer, size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+}
+#else
+void* operator new(size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+  throw std::bad_alloc();
+}
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+#endif
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double elapsedMicroseconds(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Random spheres in a cube, the cube grows with the count so that the density stays constant.
+void resetSpheres(Spheres& spheres, int count, float radius) {
+  std::mt19937 generator(2022);
+  float halfExtent = 0.5f * 4.0f * radius * std::cbrt(static_cast<float>(count));
+  std::uniform_real_distribution<float> position(-halfExtent, halfExtent);
+  std::uniform_real_distribution<float> velocity(-1.0f, 1.0f);
+  spheres.clear();
+  for (int i = 0; i < count; ++i) {
+    spheres.addSphere(Eigen::Vector4f(position(generator), position(generator), position(generator), 1.0f), radius);
+    spheres.particles().velocity(i) =
+        Eigen::Vector4f(velocity(generator), velocity(generator), velocity(generator), 0.0f);
+  }
+}
+
+// Move the spheres without any force so that consecutive steps are coherent.
+void advance(Spheres& spheres, float timeStep) {
+  int count = spheres.count();
+  spheres.particles().position().leftCols(count) += timeStep * spheres.particles().velocity().leftCols(count);
+}
+
+template <class Collide>
+double timeCollision(Spheres& spheres, int count, int steps, Collide&& collide) {
+  constexpr float radius = 0.05f;
+  resetSpheres(spheres, count, radius);
+  spheres.particles().acceleration().setZero();
+  double total = 0.0;
+  for (int step = 0; step < steps; ++step) {
+    auto start = Clock::now();
+    collide();
+    total += elapsedMicroseconds(start);
+    advance(spheres, 1e-3f);
+  }
+  return total / steps;
+}
+
+void benchmarkSphereCollision() {
+  Spheres& spheres = Spheres::initSpheres();
+  // All pairs is O(n^2), skip it when it would take minutes
+  constexpr int maxAllPairsCount = 10000;
+  std::cout << std::setw(10) << "spheres" << std::setw(18) << "sweep&prune(us)" << std::setw(18) << "all pairs(us)"
+            << std::setw(10) << "speedup" << std::endl;
+  for (int count : {10, 100, 1000, 10000, 100000}) {
+    int steps = count <= 1000 ? 200 : 20;
+    double sweepAndPrune = timeCollision(spheres, count, steps, [&] { spheres.collide(); });
+    std::cout << std::fixed << std::setprecision(2) << std::setw(10) << count << std::setw(18) << sweepAndPrune;
+    if (count <= maxAllPairsCount) {
+      double allPairs = timeCollision(spheres, count, count <= 1000 ? steps : 3, [&] { spheres.collideAllPairs(); });
+      std::cout << std::setw(18) << allPairs << std::setw(10) << allPairs / sweepAndPrune;
+    } else {
+      std::cout << std::setw(18) << "skipped" << std::setw(10) << "-";
+    }
+    std::cout << std::endl;
+  }
+}
+
+// Heap allocations per step of every integrator on the default scene, after a warmup that sizes the scratch storage.
+void benchmarkIntegratorAllocations() {
+  constexpr int warmupSteps = 10;
+  constexpr int steps = 1000;
+  Scene scene;
+  Cloth cloth(scene.particlesPerEdge, scene.clothWidth, scene.clothHeight);
+  Spheres& spheres = Spheres::initSpheres();
+  spheres.clear();
+  for (size_t i = 0; i < scene.spherePositions.size(); ++i) spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
+  auto simulateOneStep = [&]() {
+    cloth.computeExternalForce();
+    spheres.computeExternalForce();
+    cloth.computeSpringForce();
+    spheres.collide(&cloth);
+    spheres.collide();
+  };
+  Particles initialCloth = cloth.particles();
+  Particles initialSpheres = spheres.particles();
+  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  const Integrator* integrators[] = {&explicitEuler, &implicitEuler, &midpointEuler, &rk4, &backwardEuler};
+  const char* names[] = {"explicit", "implicit", "midpoint", "rk4", "backward"};
+
+  std::cout << std::setw(10) << "integrator" << std::setw(20) << "warmup allocs" << std::setw(20) << "integrate allocs"
+            << std::setw(20) << "step allocs" << std::setw(14) << "scratch grows" << std::endl;
+  for (int k = 0; k < 5; ++k) {
+    cloth.particles() = initialCloth;
+    spheres.particles() = initialSpheres;
+    long long before = allocationCount.load();
+    for (int i = 0; i < warmupSteps; ++i) {
+      simulateOneStep();
+      integrators[k]->integrate(particles, simulateOneStep);
+    }
+    long long warmup = allocationCount.load() - before;
+    long long integrateAllocations = 0;
+    before = allocationCount.load();
+    for (int i = 0; i < steps; ++i) {
+      simulateOneStep();
+      long long integrateBefore = allocationCount.load();
+      integrators[k]->integrate(particles, simulateOneStep);
+      integrateAllocations += allocationCount.load() - integrateBefore;
+    }
+    long long stepAllocations = allocationCount.load() - before;
+    std::cout << std::setw(10) << names[k] << std::setw(20) << warmup << std::setw(20) << integrateAllocations
+              << std::setw(20) << stepAllocations << std::setw(14) << integrators[k]->scratchGrowCount() << std::endl;
+  }
+}
+
+// Best of interleaved trials of ns per substep, through the virtual integrate() with std::function and through
+// integrateSubsteps(). Both paths simulate exactly the same states.
+template <class Reset, class Step>
+std::pair<double, double> timeDispatch(const Integrator& integrator, const std::vector<Particles*>& particles,
+                                       Reset&& reset, Step&& simulateOneStep, int steps) {
+  constexpr int trials = 5;
+  double virtualCall = 1e30, templateCall = 1e30;
+  for (int trial = 0; trial < trials; ++trial) {
+    reset();
+    auto start = Clock::now();
+    for (int i = 0; i < steps; ++i) {
+      simulateOneStep();
+      integrator.integrate(particles, simulateOneStep);
+    }
+    virtualCall = std::min(virtualCall, 1e3 * elapsedMicroseconds(start) / steps);
+    reset();
+    start = Clock::now();
+    integrateSubsteps(integrator, particles, simulateOneStep, steps);
+    templateCall = std::min(templateCall, 1e3 * elapsedMicroseconds(start) / steps);
+  }
+  return {virtualCall, templateCall};
+}
+
+// Per substep cost of both dispatch paths on small cloths, where the call overhead is a visible part of a step.
+// The "no-op" rows pass an empty step function to isolate the integrator and dispatch cost.
+void benchmarkIntegratorOverhead() {
+  Scene scene;
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  const Integrator* integrators[] = {&explicitEuler, &implicitEuler, &midpointEuler, &rk4};
+  const char* names[] = {"explicit", "implicit", "midpoint", "rk4"};
+  std::cout << std::setw(10) << "cloth" << std::setw(12) << "integrator" << std::setw(8) << "step" << std::setw(16)
+            << "virtual(ns)" << std::setw(16) << "template(ns)" << std::setw(10) << "speedup" << std::endl;
+  for (int particlesPerEdge : {3, 5, 10, 25}) {
+    int steps = 20000 / particlesPerEdge;
+    Cloth cloth(particlesPerEdge, scene.clothWidth, scene.clothHeight);
+    Spheres& spheres = Spheres::initSpheres();
+    spheres.clear();
+    for (size_t i = 0; i < scene.spherePositions.size(); ++i)
+      spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
+    auto simulateOneStep = [&]() {
+      cloth.computeExternalForce();
+      spheres.computeExternalForce();
+      cloth.computeSpringForce();
+      spheres.collide(&cloth);
+      spheres.collide();
+    };
+    Particles initialCloth = cloth.particles();
+    Particles initialSpheres = spheres.particles();
+    auto reset = [&]() {
+      cloth.particles() = initialCloth;
+      spheres.particles() = initialSpheres;
+    };
+    std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+    auto print = [&](const char* name, const char* step, std::pair<double, double> time) {
+      std::cout << std::fixed << std::setprecision(1) << std::setw(10)
+                << (std::to_string(particlesPerEdge) + "x" + std::to_string(particlesPerEdge)) << std::setw(12)
+                << name << std::setw(8) << step << std::setw(16) << time.first << std::setw(16) << time.second
+                << std::setw(10) << std::setprecision(2) << time.first / time.second << std::endl;
+    };
+    for (int k = 0; k < 4; ++k) {
+      print(names[k], "full", timeDispatch(*integrators[k], particles, reset, simulateOneStep, steps));
+      print(names[k], "no-op", timeDispatch(*integrators[k], particles, reset, [] {}, 10 * steps));
+    }
+  }
+}
+
+// The serial scatter loop Cloth::computeNormal used before, every triangle adds its normal to its 3 corners.
+void scatterNormals(Particles& particles, int particlesPerEdge, Eigen::Matrix4Xf& normals) {
+  normals.setZero();
+  for (int i = 0; i < particlesPerEdge - 1; ++i) {
+    int offset = i * particlesPerEdge;
+    for (int j = 0; j < particlesPerEdge - 1; ++j) {
+      Eigen::Vector4f v1 = particles.position(offset + j) - particles.position(offset + j + particlesPerEdge);
+      Eigen::Vector4f v2 = particles.position(offset + j + 1) - particles.position(offset + j + particlesPerEdge);
+      Eigen::Vector4f n1 = v2.cross3(v1);
+      normals.col(offset + j) += n1;
+      normals.col(offset + j + 1) += n1;
+      normals.col(offset + j + particlesPerEdge) += n1;
+      Eigen::Vector4f v3 =
+          particles.position(offset + j + particlesPerEdge + 1) - particles.position(offset + j + particlesPerEdge);
+      Eigen::Vector4f n2 = v3.cross3(v2);
+      normals.col(offset + j + 1) += n2;
+      normals.col(offset + j + particlesPerEdge) += n2;
+      normals.col(offset + j + particlesPerEdge + 1) += n2;
+    }
+  }
+  normals.colwise().normalize();
+}
+
+// Cloth::computeNormal against the old serial scatter, on a moving cloth and on a cloth at rest.
+void benchmarkNormals() {
+  int hardwareThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  std::cout << std::setw(10) << "cloth" << std::setw(16) << "scatter(us)" << std::setw(16) << "1 thread(us)"
+            << std::setw(16) << (std::to_string(hardwareThreads) + " threads(us)") << std::setw(16) << "at rest(us)"
+            << std::endl;
+  for (int particlesPerEdge : {25, 50, 100, 200, 400}) {
+    int steps = std::max(10, 4000000 / (particlesPerEdge * particlesPerEdge));
+    Cloth cloth(particlesPerEdge);
+    Particles& particles = cloth.particles();
+    Eigen::Matrix4Xf normals(4, particles.getCapacity());
+    // Nudge one particle so that every call sees new positions
+    auto timeMoving = [&](auto&& compute) {
+      auto start = Clock::now();
+      for (int step = 0; step < steps; ++step) {
+        particles.position(particlesPerEdge + 1).y() += 1e-6f;
+        cloth.markPositionsChanged();
+        compute();
+      }
+      return elapsedMicroseconds(start) / steps;
+    };
+    double scatter = timeMoving([&] { scatterNormals(particles, particlesPerEdge, normals); });
+    ThreadPool::getPool().resize(1);
+    double serial = timeMoving([&] { cloth.computeNormal(); });
+    ThreadPool::getPool().resize(hardwareThreads);
+    double parallel = timeMoving([&] { cloth.computeNormal(); });
+    auto start = Clock::now();
+    for (int step = 0; step < steps; ++step) cloth.computeNormal();
+    double atRest = elapsedMicroseconds(start) / steps;
+    ThreadPool::getPool().resize(1);
+    std::cout << std::fixed << std::setprecision(2) << std::setw(10)
+              << (std::to_string(particlesPerEdge) + "x" + std::to_string(particlesPerEdge)) << std::setw(16) << scatter
+              << std::setw(16) << serial << std::setw(16) << parallel << std::setw(16) << atRest << std::endl;
+  }
+}
+
+// Two layers of cloth with free corners dropped onto the four spheres of the default scene, the spheres are put back
+// every step. The lower layer drapes over the spheres and the upper one lands on it, a single layer never gets closer
+// to itself than the contact distance. Self-collision through the spatial hash against testing every pair, all runs
+// must end in bitwise the same state.
+void benchmarkSelfCollision() {
+  // 0.5 s, long enough for the cloth to settle over the spheres
+  constexpr int steps = 5000;
+  // All pairs is O(n^2), skip it when it would take minutes
+  constexpr int maxAllPairsEdge = 25;
+  int hardwareThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  Scene scene;
+  std::cout << std::setw(10) << "layers" << std::setw(10) << "contacts" << std::setw(16) << "all pairs(us)"
+            << std::setw(16) << "1 thread(us)" << std::setw(16) << (std::to_string(hardwareThreads) + " threads(us)")
+            << std::setw(10) << "speedup" << std::setw(8) << "same" << std::endl;
+  for (int particlesPerEdge : {25, 50, 100}) {
+    Cloth cloth(particlesPerEdge, scene.clothWidth, scene.clothHeight,
+                {Eigen::Vector4f(0.0f, 1.6f, 0.0f, 0.0f), Eigen::Vector4f(0.0f, 1.8f, 0.0f, 0.0f)});
+    for (float& mass : cloth.particles().mass()) mass = particleMass;
+    Spheres& spheres = Spheres::initSpheres();
+    spheres.clear();
+    for (size_t i = 0; i < scene.spherePositions.size(); ++i)
+      spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
+    Particles initialCloth = cloth.particles();
+    Particles fixedSpheres = spheres.particles();
+    // Only the cloth is integrated
+    std::vector<Particles*> particles{&cloth.particles()};
+    ExplicitEuler explicitEuler;
+    // Average time of the self-collision call and the final cloth positions
+    auto run = [&](auto&& selfCollide) {
+      cloth.particles() = initialCloth;
+      double total = 0.0;
+      auto simulateOneStep = [&]() {
+        cloth.computeForces();
+        spheres.particles() = fixedSpheres;
+        spheres.collide(&cloth);
+        auto start = Clock::now();
+        selfCollide();
+        total += elapsedMicroseconds(start);
+      };
+      integrateSubsteps(explicitEuler, particles, simulateOneStep, steps);
+      return std::make_pair(total / steps, Eigen::Matrix4Xf(cloth.particles().position()));
+    };
+    ThreadPool::getPool().resize(1);
+    auto [serial, serialState] = run([&] { cloth.collide(); });
+    int contacts = cloth.selfContactCount();
+    ThreadPool::getPool().resize(hardwareThreads);
+    auto [parallel, parallelState] = run([&] { cloth.collide(); });
+    ThreadPool::getPool().resize(1);
+    bool same = serialState == parallelState;
+    std::cout << std::fixed << std::setprecision(2) << std::setw(10)
+              << (std::to_string(particlesPerEdge) + "x" + std::to_string(particlesPerEdge)) << std::setw(10)
+              << contacts;
+    if (particlesPerEdge <= maxAllPairsEdge) {
+      auto [allPairs, allPairsState] = run([&] { cloth.collideAllPairs(); });
+      same = same && serialState == allPairsState;
+      std::cout << std::setw(16) << allPairs << std::setw(16) << serial << std::setw(16) << parallel << std::setw(10)
+                << allPairs / std::min(serial, parallel);
+    } else {
+      std::cout << std::setw(16) << "skipped" << std::setw(16) << serial << std::setw(16) << parallel << std::setw(10)
+                << "-";
+    }
+    std::cout << std::setw(8) << (same ? "yes" : "NO") << std::endl;
+  }
+}
+
+// The four passes of simulateOneStep against the fused force stage, on cloths whose particles do not fit in L2.
+// "forces" only times external + spring forces of the cloth, "step" times the whole simulateOneStep.
+void benchmarkFusedForces() {
+  Scene scene;
+  std::cout << std::setw(10) << "cloth" << std::setw(8) << "MiB" << std::setw(18) << "scalar forces(us)"
+            << std::setw(16) << "SoA forces(us)" << std::setw(18) << "fused forces(us)" << std::setw(18)
+            << "4-pass step(us)" << std::setw(16) << "fused step(us)" << std::setw(10) << "speedup" << std::endl;
+  for (int particlesPerEdge : {128, 256, 512, 1024}) {
+    int steps = std::max(5, 10000000 / (particlesPerEdge * particlesPerEdge));
+    Cloth cloth(particlesPerEdge, scene.clothWidth, scene.clothHeight);
+    Spheres& spheres = Spheres::initSpheres();
+    spheres.clear();
+    for (size_t i = 0; i < scene.spherePositions.size(); ++i)
+      spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
+    auto separateForces = [&]() {
+      cloth.computeExternalForce();
+      cloth.computeSpringForce();
+    };
+    auto fusedForces = [&]() { cloth.computeForces(); };
+    auto separateStep = [&]() {
+      cloth.computeExternalForce();
+      spheres.computeExternalForce();
+      cloth.computeSpringForce();
+      spheres.collide(&cloth);
+      spheres.collide();
+    };
+    auto fusedStep = [&]() {
+      cloth.computeForces();
+      spheres.computeExternalForce();
+      spheres.collide(&cloth);
+      spheres.collide();
+    };
+    auto time = [&](int kernel, auto&& step) {
+      currentSpringKernel = kernel;
+      auto start = Clock::now();
+      for (int i = 0; i < steps; ++i) step();
+      return elapsedMicroseconds(start) / steps;
+    };
+    // Best of interleaved trials. The 4-pass step uses the SoA kernel, the one the fused stage runs per tile.
+    double best[5] = {1e30, 1e30, 1e30, 1e30, 1e30};
+    for (int trial = 0; trial < 3; ++trial) {
+      best[0] = std::min(best[0], time(0, separateForces));
+      best[1] = std::min(best[1], time(1, separateForces));
+      best[2] = std::min(best[2], time(2, fusedForces));
+      best[3] = std::min(best[3], time(1, separateStep));
+      best[4] = std::min(best[4], time(2, fusedStep));
+    }
+    currentSpringKernel = 0;
+    double mebibytes = cloth.particles().getCapacity() * (12 + 1) * sizeof(float) / 1048576.0;
+    std::cout << std::fixed << std::setprecision(2) << std::setw(10)
+              << (std::to_string(particlesPerEdge) + "x" + std::to_string(particlesPerEdge)) << std::setw(8)
+              << mebibytes << std::setw(18) << best[0] << std::setw(16) << best[1] << std::setw(18) << best[2]
+              << std::setw(18) << best[3] << std::setw(16) << best[4] << std::setw(10) << best[3] / best[4]
+              << std::endl;
+  }
+}
+
+// The same random state in every particle layout, w stays 0.
+template <class P>
+P randomParticles(int count) {
+  std::mt19937 generator(2022);
+  std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+  P particles(count, particleMass);
+  for (int i = 0; i < count; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      particles.position(i)[k] = value(generator);
+      particles.velocity(i)[k] = value(generator);
+    }
+  }
+  return particles;
+}
+
+// Best of 3 trials of RK4 with gravity and viscous drag, which like the cloth integrators streams over the whole state.
+template <class P>
+double timeLayout(P& particles, int steps) {
+  RungeKuttaFourth rk4;
+  std::vector<P*> sets{&particles};
+  auto simulateOneStep = [&]() { applyExternalForce(particles, 0, particles.getCapacity()); };
+  simulateOneStep();
+  // Warm up the scratch slots
+  rk4.integrateWith(sets, simulateOneStep);
+  double best = 1e30;
+  for (int trial = 0; trial < 3; ++trial) {
+    auto start = Clock::now();
+    for (int i = 0; i < steps; ++i) rk4.integrateWith(sets, simulateOneStep);
+    best = std::min(best, elapsedMicroseconds(start) / steps);
+  }
+  return best;
+}
+
+template <class P>
+double maxPositionError(P& particles, DoubleParticles& reference) {
+  return (particles.position().template topRows<3>().template cast<double>() - reference.position().topRows<3>())
+      .cwiseAbs()
+      .maxCoeff();
+}
+
+// Padded float4, packed float3 and double4 particles through the same RK4 step, at counts far beyond the caches.
+void benchmarkParticleLayouts() {
+  std::cout << std::setw(10) << "particles" << std::setw(12) << "float4 MiB" << std::setw(14) << "float4(ns)"
+            << std::setw(14) << "float3(ns)" << std::setw(14) << "double4(ns)" << std::setw(16) << "float3 speedup"
+            << std::setw(16) << "float4 error" << std::setw(16) << "float3 error" << std::endl;
+  for (int count : {1 << 16, 1 << 18, 1 << 20, 1 << 22}) {
+    int steps = std::max(3, (1 << 24) / count);
+    auto padded = randomParticles<Particles>(count);
+    auto packed = randomParticles<PackedParticles>(count);
+    auto reference = randomParticles<DoubleParticles>(count);
+    // Nanoseconds per particle and step
+    double perParticle = 1e3 / count;
+    double paddedTime = timeLayout(padded, steps) * perParticle;
+    double packedTime = timeLayout(packed, steps) * perParticle;
+    double referenceTime = timeLayout(reference, steps) * perParticle;
+    // State, mass and the 4 scratch slots of RK4
+    double mebibytes = count * (7 * 4 + 1) * sizeof(float) / 1048576.0;
+    std::cout << std::fixed << std::setprecision(2) << std::setw(10) << count << std::setw(12) << mebibytes
+              << std::setw(14) << paddedTime << std::setw(14) << packedTime << std::setw(14) << referenceTime
+              << std::setw(16) << paddedTime / packedTime << std::scientific << std::setprecision(2) << std::setw(16)
+              << maxPositionError(padded, reference) << std::setw(16) << maxPositionError(packed, reference)
+              << std::defaultfloat << std::endl;
+  }
+}
+
+// Options of the suite case, set from the command line
+struct SuiteOptions {
+  int warmupSteps = 20;
+  int steps = 20;
+  int trials = 5;
+  std::string jsonFile;
+  std::string csvFile;
+} suiteOptions;
+
+// Phases of one simulation step, timed separately by the suite
+enum Phase { EXTERNAL_FORCE, SPRING_FORCE, CLOTH_COLLISION, SPHERE_COLLISION, INTEGRATE, NORMALS, PHASE_COUNT };
+constexpr const char* phaseNames[PHASE_COUNT] = {"computeExternalForce", "computeSpringForce", "collideCloth",
+                                                 "collideSpheres",       "integrate",          "computeNormal"};
+
+struct SuiteResult {
+  const char* integrator;
+  int particlesPerEdge;
+  int sphereCount;
+  // False if the cloth blew up, its timings are not comparable then
+  bool isFinite;
+  // Microseconds per step of each trial
+  std::array<std::vector<double>, PHASE_COUNT> trials;
+};
+
+struct TrialStatistics {
+  double min, median, max;
+};
+
+TrialStatistics statistics(std::vector<double> trials) {
+  std::sort(trials.begin(), trials.end());
+  return {trials.front(), trials[trials.size() / 2], trials.back()};
+}
+
+// count spheres of radius spacing / 3 on a grid above the cloth, 4 gives the default scene
+void placeSpheres(Spheres& spheres, int count) {
+  int perRow = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+  float spacing = 3.0f / perRow;
+  spheres.clear();
+  for (int i = 0; i < count; ++i) {
+    float x = -1.5f + spacing * (i % perRow + 0.5f);
+    float z = -1.5f + spacing * (i / perRow + 0.5f);
+    spheres.addSphere(Eigen::Vector4f(x, 1.0f, z, 1.0f), spacing / 3.0f);
+  }
+}
+
+SuiteResult runSuiteCase(const Integrator& integrator, const char* name, int particlesPerEdge, int sphereCount) {
+  Cloth cloth(particlesPerEdge);
+  Spheres& spheres = Spheres::initSpheres();
+  placeSpheres(spheres, sphereCount);
+  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+  std::array<double, PHASE_COUNT> elapsed{};
+  auto timed = [&](Phase phase, auto&& run) {
+    auto start = Clock::now();
+    run();
+    elapsed[phase] += elapsedMicroseconds(start);
+  };
+  // Same as the viewer, with the cloth forces split so that each one is timed on its own
+  auto simulateOneStep = [&]() {
+    timed(EXTERNAL_FORCE, [&] {
+      cloth.computeExternalForce();
+      spheres.computeExternalForce();
+    });
+    timed(SPRING_FORCE, [&] { cloth.computeSpringForce(); });
+    timed(CLOTH_COLLISION, [&] { spheres.collide(&cloth); });
+    timed(SPHERE_COLLISION, [&] { spheres.collide(); });
+  };
+  auto step = [&]() {
+    timed(INTEGRATE, [&] { integrateSubsteps(integrator, particles, simulateOneStep, 1); });
+    cloth.markPositionsChanged();
+    timed(NORMALS, [&] { cloth.computeNormal(); });
+  };
+
+  for (int i = 0; i < suiteOptions.warmupSteps; ++i) step();
+  SuiteResult result{name, particlesPerEdge, sphereCount, true, {}};
+  for (int trial = 0; trial < suiteOptions.trials; ++trial) {
+    elapsed.fill(0.0);
+    for (int i = 0; i < suiteOptions.steps; ++i) step();
+    // The forces and collisions ran inside integrate, only the integrator itself is left
+    for (int phase = 0; phase < INTEGRATE; ++phase) elapsed[INTEGRATE] -= elapsed[phase];
+    for (int phase = 0; phase < PHASE_COUNT; ++phase)
+      result.trials[phase].push_back(elapsed[phase] / suiteOptions.steps);
+  }
+  result.isFinite = cloth.particles().position().allFinite();
+  return result;
+}
+
+void writeSuiteJson(std::ofstream& file, const std::vector<SuiteResult>& results) {
+  file << std::fixed << std::setprecision(3) << "{\n"
+       << "  \"benchmark\": \"suite\",\n"
+       << "  \"unit\": \"microseconds per step\",\n"
+       << "  \"threads\": " << ThreadPool::getPool().size() << ",\n"
+       << "  \"deltaTime\": " << std::defaultfloat << deltaTime << std::fixed << ",\n"
+       << "  \"warmupSteps\": " << suiteOptions.warmupSteps << ",\n"
+       << "  \"stepsPerTrial\": " << suiteOptions.steps << ",\n"
+       << "  \"trials\": " << suiteOptions.trials << ",\n"
+       << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const SuiteResult& result = results[i];
+    file << "    {\"integrator\": \"" << result.integrator << "\", \"particlesPerEdge\": " << result.particlesPerEdge
+         << ", \"particles\": " << result.particlesPerEdge * result.particlesPerEdge
+         << ", \"spheres\": " << result.sphereCount << ", \"finite\": " << (result.isFinite ? "true" : "false")
+         << ", \"phases\": {";
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+      TrialStatistics stats = statistics(result.trials[phase]);
+      file << (phase > 0 ? ", " : "") << "\"" << phaseNames[phase] << "\": {\"min\": " << stats.min
+           << ", \"median\": " << stats.median << ", \"max\": " << stats.max << "}";
+    }
+    file << "}}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  file << "  ]\n}" << std::endl;
+}
+
+// One row per configuration and phase
+void writeSuiteCsv(std::ofstream& file, const std::vector<SuiteResult>& results) {
+  file << "integrator,particlesPerEdge,particles,spheres,finite,phase,min_us,median_us,max_us\n" << std::fixed
+       << std::setprecision(3);
+  for (const SuiteResult& result : results) {
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+      TrialStatistics stats = statistics(result.trials[phase]);
+      file << result.integrator << "," << result.particlesPerEdge << ","
+           << result.particlesPerEdge * result.particlesPerEdge << "," << result.sphereCount << ","
+           << (result.isFinite ? "true" : "false") << "," << phaseNames[phase] << "," << stats.min << ","
+           << stats.median << "," << stats.max << "\n";
+    }
+  }
+  file.flush();
+}
+
+// Every phase of the simulation step for the explicit integrators x cloth resolutions x sphere counts, the standing
+// baseline to compare builds against. Medians are printed, --json and --csv also write min and max over the trials.
+void benchmarkSuite() {
+  // Fail before the sweep rather than after it
+  std::ofstream json, csv;
+  if (!suiteOptions.jsonFile.empty()) json.open(suiteOptions.jsonFile, std::ios::trunc);
+  if (!suiteOptions.csvFile.empty()) csv.open(suiteOptions.csvFile, std::ios::trunc);
+  if ((!suiteOptions.jsonFile.empty() && !json) || (!suiteOptions.csvFile.empty() && !csv)) {
+    std::cerr << "Cannot open the suite output files" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  const std::pair<const Integrator*, const char*> integrators[] = {
+      {&explicitEuler, "explicit"}, {&implicitEuler, "implicit"}, {&midpointEuler, "midpoint"}, {&rk4, "rk4"}};
+  std::cout << std::setw(10) << "integrator" << std::setw(10) << "cloth" << std::setw(9) << "spheres"
+            << std::setw(11) << "external" << std::setw(11) << "spring" << std::setw(11) << "cloth col"
+            << std::setw(11) << "sphere col" << std::setw(11) << "integrate" << std::setw(11) << "normals"
+            << std::setw(11) << "total(us)" << std::endl;
+  std::vector<SuiteResult> results;
+  for (const auto& [integrator, name] : integrators) {
+    for (int particlesPerEdge : {25, 50, 100, 200}) {
+      for (int sphereCount : {1, 4, 16, 64}) {
+        const SuiteResult& result =
+            results.emplace_back(runSuiteCase(*integrator, name, particlesPerEdge, sphereCount));
+        std::cout << std::fixed << std::setprecision(2) << std::setw(10) << name << std::setw(10)
+                  << (std::to_string(particlesPerEdge) + "x" + std::to_string(particlesPerEdge)) << std::setw(9)
+                  << sphereCount;
+        double total = 0.0;
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+          double median = statistics(result.trials[phase]).median;
+          total += median;
+          std::cout << std::setw(11) << median;
+        }
+        std::cout << std::setw(11) << total << (result.isFinite ? "" : "  (blew up)") << std::endl;
+      }
+    }
+  }
+  if (json.is_open()) writeSuiteJson(json, results);
+  if (csv.is_open()) writeSuiteCsv(csv, results);
+  if ((json.is_open() && !json) || (csv.is_open() && !csv)) {
+    std::cerr << "Cannot write the suite output files" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+struct BenchmarkCase {
+  const char* name;
+  const char* description;
+  void (*run)();
+};
+
+const BenchmarkCase benchmarkCases[] = {
+    {"sphere-sphere", "Spheres::collide() sweep and prune vs all pairs, 10 to 100k spheres", benchmarkSphereCollision},
+    {"integrator-overhead", "Virtual integrate() vs integrateSubsteps() per substep on 3x3 to 25x25 cloths",
+     benchmarkIntegratorOverhead},
+    {"allocations", "Heap allocations of each integrator over 1000 steps after warmup", benchmarkIntegratorAllocations},
+    {"fused-forces", "Four-pass simulateOneStep vs the fused force stage on 128x128 to 1024x1024 cloths",
+     benchmarkFusedForces},
+    {"normals", "Cloth::computeNormal vs the old serial scatter on 25x25 to 400x400 cloths", benchmarkNormals},
+    {"self-collision", "Cloth::collide() spatial hash vs all pairs, two cloth layers dropped onto the default spheres",
+     benchmarkSelfCollision},
+    {"particle-layouts", "RK4 on padded float4, packed float3 and double4 particles, 64k to 4M particles",
+     benchmarkParticleLayouts},
+    {"suite", "Every step phase, 4 integrators x 25x25 to 200x200 cloths x 1 to 64 spheres, see --json and --csv",
+     benchmarkSuite},
+};
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<const BenchmarkCase*> selected;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--list") == 0 || std::strcmp(argv[i], "--help") == 0) {
+      std::cout << "Usage: " << argv[0] << " [case ...] [suite options], runs every case when none is given\n";
+      for (const auto& benchmarkCase : benchmarkCases)
+        std::cout << "  " << std::left << std::setw(21) << benchmarkCase.name << benchmarkCase.description << "\n";
+      std::cout << "Suite options:\n"
+                << "  --json FILE          Write min / median / max per phase as JSON\n"
+                << "  --csv FILE           Write the same as CSV, one row per configuration and phase\n"
+                << "  --warmup N           Untimed steps per configuration (default " << suiteOptions.warmupSteps
+                << ")\n"
+                << "  --steps N            Steps per trial (default " << suiteOptions.steps << ")\n"
+                << "  --trials N           Trials per configuration (default " << suiteOptions.trials << ")\n";
+      return EXIT_SUCCESS;
+    }
+    std::string arg = argv[i];
+    if (arg == "--json" || arg == "--csv" || arg == "--warmup" || arg == "--steps" || arg == "--trials") {
+      if (i + 1 >= argc) {
+        std::cerr << arg << " needs a value" << std::endl;
+        return EXIT_FAILURE;
+      }
+      std::string value = argv[++i];
+      if (arg == "--json") suiteOptions.jsonFile = value;
+      if (arg == "--csv") suiteOptions.csvFile = value;
+      if (arg == "--warmup") suiteOptions.warmupSteps = std::max(0, std::atoi(value.c_str()));
+      if (arg == "--steps") suiteOptions.steps = std::max(1, std::atoi(value.c_str()));
+      if (arg == "--trials") suiteOptions.trials = std::max(1, std::atoi(value.c_str()));
+      continue;
+    }
+    bool found = false;
+    for (const auto& benchmarkCase : benchmarkCases) {
+      if (argv[i] == std::string(benchmarkCase.name)) {
+        selected.push_back(&benchmarkCase);
+        found = true;
+      }
+    }
+    if (!found) {
+      std::cerr << "Unknown benchmark " << argv[i] << ", see --list" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (selected.empty()) {
+    for (const auto& benchmarkCase : benchmarkCases) selected.push_back(&benchmarkCase);
+  }
+  for (const auto* benchmarkCase : selected) {
+    std::cout << "== " << benchmarkCase->name << ": " << benchmarkCase->description << std::endl;
+    benchmarkCase->run();
+  }
+  return EXIT_SUCCESS;
+}
@@ -1,5 +1,7 @@
 #include "buffer.h"
 
+#include <cstring>
+
 Buffer::Buffer() noexcept : _handle(0), _size(0) { glGenBuffers(1, &_handle); }
 
 Buffer::~Buffer() { glDeleteBuffers(1, &_handle); }
@@ -34,3 +36,69 @@ void UniformBuffer::bindUniformBlockIndex(GLuint index) const noexcept {
   glBindBufferBase(GL_UNIFORM_BUFFER, index, _handle);
   glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
+
+StreamArrayBuffer::StreamArrayBuffer() noexcept : regionSize(0), current(0), mapped(nullptr), fences{} {}
+
+StreamArrayBuffer::~StreamArrayBuffer() { release(); }
+
+void StreamArrayBuffer::release() noexcept {
+  for (GLsync& fence : fences) {
+    if (fence != nullptr) glDeleteSync(fence);
+    fence = nullptr;
+  }
+  if (mapped != nullptr) {
+    bind();
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    mapped = nullptr;
+  }
+}
+
+void StreamArrayBuffer::allocateRegions(GLsizeiptr _regionSize) noexcept {
+  release();
+  regionSize = (_regionSize + regionAlignment - 1) / regionAlignment * regionAlignment;
+  current = 0;
+  _size = regionCount * regionSize;
+  if (GLAD_GL_VERSION_4_4) {
+    // Immutable storage, so a new handle is needed
+    glDeleteBuffers(1, &_handle);
+    glGenBuffers(1, &_handle);
+    bind();
+    constexpr GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, _size, nullptr, flags);
+    mapped = static_cast<char*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, _size, flags));
+  } else {
+    bind();
+    glBufferData(GL_ARRAY_BUFFER, _size, nullptr, GL_STREAM_DRAW);
+  }
+}
+
+GLintptr StreamArrayBuffer::nextRegion() noexcept {
+  if (mapped != nullptr) {
+    if (fences[current] != nullptr) glDeleteSync(fences[current]);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    current = (current + 1) % regionCount;
+    if (fences[current] != nullptr) {
+      // Usually signaled long ago, only waits when the GPU is regionCount frames behind
+      while (glClientWaitSync(fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) continue;
+      glDeleteSync(fences[current]);
+      fences[current] = nullptr;
+    }
+  } else {
+    current = (current + 1) % regionCount;
+    if (current == 0) {
+      // Orphan the storage, the driver keeps the old one alive until draws reading it are done
+      bind();
+      glBufferData(GL_ARRAY_BUFFER, _size, nullptr, GL_STREAM_DRAW);
+    }
+  }
+  return regionOffset();
+}
+
+void StreamArrayBuffer::write(GLintptr offset, GLsizeiptr size_, const void* data) const noexcept {
+  if (mapped != nullptr) {
+    std::memcpy(mapped + regionOffset() + offset, data, size_);
+  } else {
+    bind();
+    glBufferSubData(GL_ARRAY_BUFFER, regionOffset() + offset, size_, data);
+  }
+}
@@ -0,0 +1,104 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+// Triangles per leaf
+constexpr int leafSize = 4;
+
+bool overlaps(const Eigen::Vector4f& minA, const Eigen::Vector4f& maxA, const Eigen::Ref<const Eigen::Vector4f>& minB,
+              const Eigen::Ref<const Eigen::Vector4f>& maxB) {
+  return (minA.head<3>().array() <= maxB.head<3>().array()).all() &&
+         (minB.head<3>().array() <= maxA.head<3>().array()).all();
+}
+}  // namespace
+
+void TriangleBVH::build(const std::vector<std::array<int, 3>>& triangles,
+                        const Eigen::Ref<const Eigen::Matrix4Xf>& positions) {
+  _triangles = triangles;
+  int count = static_cast<int>(_triangles.size());
+  Eigen::Matrix4Xf centroids(4, count);
+  for (int i = 0; i < count; ++i) {
+    const auto& [a, b, c] = _triangles[i];
+    centroids.col(i) = (positions.col(a) + positions.col(b) + positions.col(c)) / 3.0f;
+  }
+  order.resize(count);
+  std::iota(order.begin(), order.end(), 0);
+  nodes.clear();
+  nodes.reserve(2 * std::max(1, count / leafSize) + 1);
+  if (count > 0) buildNode(0, count, centroids);
+  // Boxes of the current positions, until the first refit
+  refit(positions, Eigen::Matrix4Xf::Zero(4, positions.cols()));
+}
+
+int TriangleBVH::buildNode(int first, int last, const Eigen::Matrix4Xf& centroids) {
+  int index = static_cast<int>(nodes.size());
+  nodes.push_back(Node{Eigen::Vector4f::Zero(), Eigen::Vector4f::Zero(), first, last - first});
+  if (last - first <= leafSize) return index;
+
+  Eigen::Vector4f low = centroids.col(order[first]), high = low;
+  for (int i = first + 1; i < last; ++i) {
+    low = low.cwiseMin(centroids.col(order[i]));
+    high = high.cwiseMax(centroids.col(order[i]));
+  }
+  int axis;
+  (high - low).head<3>().maxCoeff(&axis);
+  int middle = (first + last) / 2;
+  // Ties are broken by index, so the tree does not depend on the std::nth_element implementation
+  std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+    float keyA = centroids(axis, a), keyB = centroids(axis, b);
+    return keyA < keyB || (keyA == keyB && a < b);
+  });
+  buildNode(first, middle, centroids);
+  int right = buildNode(middle, last, centroids);
+  nodes[index].first = right;
+  nodes[index].count = 0;
+  return index;
+}
+
+void TriangleBVH::refit(const Eigen::Ref<const Eigen::Matrix4Xf>& positions,
+                        const Eigen::Ref<const Eigen::Matrix4Xf>& displacement) {
+  // Children come after their parent, so a reverse sweep sees both children first
+  for (int index = static_cast<int>(nodes.size()) - 1; index >= 0; --index) {
+    Node& node = nodes[index];
+    if (node.count == 0) {
+      const Node& left = nodes[index + 1];
+      const Node& right = nodes[node.first];
+      node.minCorner = left.minCorner.cwiseMin(right.minCorner);
+      node.maxCorner = left.maxCorner.cwiseMax(right.maxCorner);
+      continue;
+    }
+    node.minCorner.setConstant(std::numeric_limits<float>::max());
+    node.maxCorner.setConstant(std::numeric_limits<float>::lowest());
+    for (int i = node.first; i < node.first + node.count; ++i) {
+      for (int vertex : _triangles[order[i]]) {
+        Eigen::Vector4f start = positions.col(vertex);
+        Eigen::Vector4f end = start + displacement.col(vertex);
+        node.minCorner = node.minCorner.cwiseMin(start).cwiseMin(end);
+        node.maxCorner = node.maxCorner.cwiseMax(start).cwiseMax(end);
+      }
+    }
+  }
+}
+
+void TriangleBVH::query(const Eigen::Ref<const Eigen::Vector4f>& minCorner,
+                        const Eigen::Ref<const Eigen::Vector4f>& maxCorner,
+                        std::vector<int>& result) const {
+  if (nodes.empty()) return;
+  stack.clear();
+  stack.emplace_back(0);
+  while (!stack.empty()) {
+    int index = stack.back();
+    stack.pop_back();
+    const Node& node = nodes[index];
+    if (!overlaps(node.minCorner, node.maxCorner, minCorner, maxCorner)) continue;
+    if (node.count > 0) {
+      for (int i = node.first; i < node.first + node.count; ++i) result.emplace_back(order[i]);
+    } else {
+      stack.emplace_back(node.first);
+      stack.emplace_back(index + 1);
+    }
+  }
+}
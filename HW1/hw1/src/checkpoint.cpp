@@ -0,0 +1,212 @@
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "cloth.h"
+#include "configs.h"
+#include "mappedfile.h"
+#include "sphere.h"
+
+namespace {
+constexpr char checkpointMagic[8] = {'H', 'W', '1', 'C', 'K', 'P', 'T', '\0'};
+constexpr std::size_t sectionAlignment = 16;
+
+// On-disk spring, independent of the layout of Spring
+struct CheckpointSpring {
+  int32_t start;
+  int32_t end;
+  float restLength;
+  int32_t type;
+};
+
+std::size_t alignSection(std::size_t offset) { return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment; }
+
+// Byte offsets of every section, the last one is the expected file size
+struct Layout {
+  explicit Layout(const CheckpointHeader& header) {
+    std::size_t clothParticles =
+        static_cast<std::size_t>(header.particlesPerEdge) * header.particlesPerEdge * header.instanceCount;
+    std::size_t spheres = header.sphereCount;
+    clothState = alignSection(sizeof(CheckpointHeader));
+    clothMass = alignSection(clothState + 3 * clothParticles * 4 * sizeof(float));
+    springs = alignSection(clothMass + clothParticles * sizeof(float));
+    sphereState = alignSection(springs + header.springCount * sizeof(CheckpointSpring));
+    sphereMass = alignSection(sphereState + 3 * spheres * 4 * sizeof(float));
+    sphereRadius = sphereMass + spheres * sizeof(float);
+    fileSize = sphereRadius + spheres * sizeof(float);
+  }
+  std::size_t clothState, clothMass, springs, sphereState, sphereMass, sphereRadius, fileSize;
+};
+
+std::vector<CheckpointSpring> packSprings(const std::vector<Spring>& springs) {
+  std::vector<CheckpointSpring> packed(springs.size());
+  for (size_t i = 0; i < springs.size(); ++i) {
+    packed[i] = {static_cast<int32_t>(springs[i].startParticleIndex()),
+                 static_cast<int32_t>(springs[i].endParticleIndex()), springs[i].length(),
+                 static_cast<int32_t>(springs[i].type())};
+  }
+  return packed;
+}
+
+bool isValidHeader(const CheckpointHeader& header, const std::filesystem::path& filename) {
+  if (std::memcmp(header.magic, checkpointMagic, sizeof(checkpointMagic)) != 0) {
+    std::cerr << "Not a checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  if (header.version != CheckpointHeader::currentVersion || header.headerSize != sizeof(CheckpointHeader)) {
+    std::cerr << "Unsupported checkpoint version " << header.version << ": " << filename.string() << std::endl;
+    return false;
+  }
+  if (header.particlesPerEdge < 3 || header.instanceCount < 1 || header.springCount < 0 || header.sphereCount < 0) {
+    std::cerr << "Corrupted checkpoint header: " << filename.string() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Write zeros up to the next section
+void pad(std::ofstream& file) {
+  static constexpr char zeros[sectionAlignment] = {};
+  auto offset = static_cast<std::size_t>(file.tellp());
+  file.write(zeros, alignSection(offset) - offset);
+}
+
+template <class T>
+void writeArray(std::ofstream& file, const T* data, std::size_t count) {
+  file.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+}
+}  // namespace
+
+bool saveCheckpoint(const std::filesystem::path& filename, Cloth& cloth, Spheres& spheres, int64_t steps) {
+  std::vector<CheckpointSpring> springs = packSprings(cloth.springs());
+  int clothParticles = cloth.particles().getCapacity();
+  int sphereCount = spheres.count();
+
+  CheckpointHeader header{};
+  std::memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+  header.version = CheckpointHeader::currentVersion;
+  header.headerSize = sizeof(CheckpointHeader);
+  header.particlesPerEdge = cloth.particlesPerEdge();
+  header.instanceCount = cloth.instanceCount();
+  header.clothWidth = cloth.width();
+  header.clothHeight = cloth.height();
+  header.springCount = static_cast<int32_t>(springs.size());
+  header.sphereCount = sphereCount;
+  header.deltaTime = deltaTime;
+  header.springCoef = springCoef;
+  header.damperCoef = damperCoef;
+  header.viscousCoef = viscousCoef;
+  std::copy(springStiffness.begin(), springStiffness.end(), header.stiffness);
+  header.steps = steps;
+
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cerr << "Cannot open checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  Particles& clothState = cloth.particles();
+  Particles& sphereState = spheres.particles();
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  pad(file);
+  writeArray(file, clothState.getPositionData(), 4 * clothParticles);
+  writeArray(file, clothState.getVelocityData(), 4 * clothParticles);
+  writeArray(file, clothState.getAccelerationData(), 4 * clothParticles);
+  pad(file);
+  writeArray(file, clothState.getMassData(), clothParticles);
+  pad(file);
+  writeArray(file, springs.data(), springs.size());
+  pad(file);
+  writeArray(file, sphereState.getPositionData(), 4 * sphereCount);
+  writeArray(file, sphereState.getVelocityData(), 4 * sphereCount);
+  writeArray(file, sphereState.getAccelerationData(), 4 * sphereCount);
+  pad(file);
+  writeArray(file, sphereState.getMassData(), sphereCount);
+  for (int i = 0; i < sphereCount; ++i) {
+    float radius = spheres.radius(i);
+    writeArray(file, &radius, 1);
+  }
+  if (!file) {
+    std::cerr << "Cannot write checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool readCheckpointHeader(const std::filesystem::path& filename, CheckpointHeader& header) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    std::cerr << "Cannot open checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    std::cerr << "Truncated checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  return isValidHeader(header, filename);
+}
+
+bool loadCheckpoint(const std::filesystem::path& filename, Cloth& cloth, Spheres& spheres, CheckpointHeader* header_) {
+  MappedFile file;
+  if (!file.open(filename)) return false;
+  CheckpointHeader header;
+  if (file.size() < sizeof(header)) {
+    std::cerr << "Truncated checkpoint file: " << filename.string() << std::endl;
+    return false;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (!isValidHeader(header, filename)) return false;
+  Layout layout(header);
+  if (file.size() != layout.fileSize) {
+    std::cerr << "Checkpoint size does not match its header: " << filename.string() << std::endl;
+    return false;
+  }
+  if (header.particlesPerEdge != cloth.particlesPerEdge() || header.instanceCount != cloth.instanceCount()) {
+    std::cerr << "Checkpoint cloth has " << header.instanceCount << " x " << header.particlesPerEdge
+              << " particles per edge, expected " << cloth.instanceCount() << " x " << cloth.particlesPerEdge() << ": "
+              << filename.string() << std::endl;
+    return false;
+  }
+  std::vector<CheckpointSpring> springs = packSprings(cloth.springs());
+  if (springs.size() != static_cast<std::size_t>(header.springCount) ||
+      std::memcmp(springs.data(), file.data() + layout.springs, springs.size() * sizeof(CheckpointSpring)) != 0) {
+    std::cerr << "Checkpoint springs do not match the cloth: " << filename.string() << std::endl;
+    return false;
+  }
+
+  // The mapping is page aligned and every section 16-byte aligned
+  const auto* clothData = reinterpret_cast<const float*>(file.data() + layout.clothState);
+  int clothParticles = cloth.particles().getCapacity();
+  using StateMap = Eigen::Map<const Eigen::Matrix4Xf, Eigen::Aligned16>;
+  Particles& clothState = cloth.particles();
+  clothState.position() = StateMap(clothData, 4, clothParticles);
+  clothState.velocity() = StateMap(clothData + 4 * clothParticles, 4, clothParticles);
+  clothState.acceleration() = StateMap(clothData + 8 * clothParticles, 4, clothParticles);
+  const auto* clothMass = reinterpret_cast<const float*>(file.data() + layout.clothMass);
+  std::copy(clothMass, clothMass + clothParticles, clothState.mass().begin());
+  cloth.wakeAll();
+  cloth.markPositionsChanged();
+
+  const auto* sphereData = reinterpret_cast<const float*>(file.data() + layout.sphereState);
+  const auto* sphereMass = reinterpret_cast<const float*>(file.data() + layout.sphereMass);
+  const auto* sphereRadius = reinterpret_cast<const float*>(file.data() + layout.sphereRadius);
+  int sphereCount = header.sphereCount;
+  spheres.clear();
+  for (int i = 0; i < sphereCount; ++i) spheres.addSphere(StateMap(sphereData, 4, sphereCount).col(i), sphereRadius[i]);
+  Particles& sphereState = spheres.particles();
+  sphereState.velocity().leftCols(sphereCount) = StateMap(sphereData + 4 * sphereCount, 4, sphereCount);
+  sphereState.acceleration().leftCols(sphereCount) = StateMap(sphereData + 8 * sphereCount, 4, sphereCount);
+  std::copy(sphereMass, sphereMass + sphereCount, sphereState.mass().begin());
+
+  deltaTime = header.deltaTime;
+  if (deltaTime > 0.0f) simulationPerFrame = std::max(1, speedMultiplier * static_cast<int>(baseSpeed / deltaTime));
+  springCoef = header.springCoef;
+  damperCoef = header.damperCoef;
+  viscousCoef = header.viscousCoef;
+  std::copy(header.stiffness, header.stiffness + 3, springStiffness.begin());
+  if (header_ != nullptr) *header_ = header;
+  return true;
+}
@@ -1,17 +1,86 @@
 #include "cloth.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
 #include <Eigen/Geometry>
 
 #include "configs.h"
 #include "sphere.h"
+#include "threadpool.h"
 
-Cloth::Cloth() : Shape(particlesPerEdge * particlesPerEdge, particleMass) {
-  initializeVertex();
+namespace {
+inline void applySpringForce(Particles& particles, const Spring& spring) {
+  // TODO: Compute spring force and damper force for each spring.
+  //   1. Read the start and end index from spring
+  //   2. Use particles.position(i) to get particle i's position.
+  //   3. Modify particles' acceleration a = F / m;
+  // Note:
+  //   1. Use particles.inverseMass(i) to get 1 / m can deal with m == 0. Which will returns 0.
+  // Hint:
+  //   1. Use a.norm() to get length of a.
+  //   2. Use a.normalize() to normalize a inplace.
+  //          a.normalized() will create a new vector.
+  //   3. Use a.dot(b) to get dot product of a and b.
+  float deltaL =
+      (particles.position(spring.startParticleIndex()) - particles.position(spring.endParticleIndex())).norm() - spring.length();
+  Eigen::Vector4f vectorL = (particles.position(spring.startParticleIndex()) - particles.position(spring.endParticleIndex())).normalized();
+  float stiffness = springCoef * springStiffness[static_cast<int>(spring.type())];
+  Eigen::Vector4f springForce = -(stiffness * deltaL) * vectorL; // based on start particle
+
+  float deltaV = (particles.velocity(spring.startParticleIndex()) - particles.velocity(spring.endParticleIndex())).dot(vectorL);
+  Eigen::Vector4f damperForce = -(damperCoef * deltaV) * vectorL;  // based on start particle
+
+  particles.acceleration(spring.startParticleIndex()) +=
+      (springForce + damperForce) * particles.inverseMass(spring.startParticleIndex());
+  particles.acceleration(spring.endParticleIndex()) +=
+      -(springForce + damperForce) * particles.inverseMass(spring.endParticleIndex());
+}
+}  // namespace
+
+Cloth::Cloth(int particlesPerEdge, float width, float height, const std::vector<Eigen::Vector4f>& instanceOffsets) :
+    Shape(particlesPerEdge * particlesPerEdge * static_cast<int>(instanceOffsets.size()), particleMass),
+    _particlesPerEdge(particlesPerEdge),
+    _instanceCount(static_cast<int>(instanceOffsets.size())),
+    _width(width),
+    _height(height),
+    normals(4, particlesPerEdge * particlesPerEdge * static_cast<int>(instanceOffsets.size())),
+    positionGeneration(0),
+    normalGeneration(-1),
+    _springForceEnabled(true),
+    tileRows(0),
+    islandSleeping(_instanceCount * islandsPerInstance(), 0),
+    wakeRequested(islandSleeping.size(), 0),
+    islandQuiet(islandSleeping.size(), 0),
+    islandDisturbed(islandSleeping.size(), 0),
+    quietTime(islandSleeping.size(), 0.0f),
+    sleepingIslands(0),
+    particleSleeping(normals.cols(), 0),
+    awakeParticles(static_cast<int>(normals.cols())) {
+  initializeVertex(instanceOffsets);
   initializeSpring();
 }
 
+#ifndef HW1_HEADLESS
+void Cloth::upload(const SimulationSnapshot& snapshot) {
+  GLsizeiptr positionSize = snapshot.clothPosition.size() * sizeof(GLfloat);
+  GLintptr offset = vertexStream.nextRegion();
+  vertexStream.write(0, positionSize, snapshot.clothPosition.data());
+  hasUploadedNormal = snapshot.clothNormal.cols() > 0;
+  if (hasUploadedNormal) vertexStream.write(positionSize, positionSize, snapshot.clothNormal.data());
+
+  vao.bind();
+  vertexStream.bind();
+  vao.setAttributePointer(0, 4, 4, offset / sizeof(GLfloat));
+  vao.setAttributePointer(1, 4, 4, (offset + positionSize) / sizeof(GLfloat));
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 void Cloth::draw(DrawType type) const {
+  if (type == DrawType::FULL && !hasUploadedNormal) return;
   vao.bind();
-  positionBuffer.load(0, 4 * particlesPerEdge * particlesPerEdge * sizeof(GLfloat), _particles.getPositionData());
   const ElementArrayBuffer* currentEBO = nullptr;
   switch (type) {
     case DrawType::PARTICLE: [[fallthrough]];
@@ -25,61 +94,71 @@ void Cloth::draw(DrawType type) const {
   if (type == DrawType::FULL)
     glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr);
   else if (type == DrawType::PARTICLE)
-    glDrawArrays(GL_POINTS, 0, particlesPerEdge * particlesPerEdge);
+    glDrawArrays(GL_POINTS, 0, _particles.getCapacity());
   else
     glDrawElements(GL_LINES, indexCount, GL_UNSIGNED_INT, nullptr);
   glBindVertexArray(0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
+#endif
 
-void Cloth::initializeVertex() {
-  float wStep = 2.0f * clothWidth / (particlesPerEdge - 1);
-  float hStep = 2.0f * clothHeight / (particlesPerEdge - 1);
+void Cloth::initializeVertex(const std::vector<Eigen::Vector4f>& instanceOffsets) {
+  float wStep = 2.0f * _width / (_particlesPerEdge - 1);
+  float hStep = 2.0f * _height / (_particlesPerEdge - 1);
 
   int current = 0;
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      _particles.position(current++) = Eigen::Vector4f(-clothWidth + j * wStep, 0, -clothHeight + i * hStep, 1);
+  for (const Eigen::Vector4f& offset : instanceOffsets) {
+    for (int i = 0; i < _particlesPerEdge; ++i) {
+      for (int j = 0; j < _particlesPerEdge; ++j) {
+        _particles.position(current++) = Eigen::Vector4f(-_width + j * wStep, 0, -_height + i * hStep, 1) + offset;
+      }
     }
   }
-  // Four corners will not move
-  _particles.mass(0) = 0.0f;
-  _particles.mass(particlesPerEdge - 1) = 0.0f;
-  _particles.mass(particlesPerEdge * (particlesPerEdge - 1)) = 0.0f;
-  _particles.mass(particlesPerEdge * particlesPerEdge - 1) = 0.0f;
-
-  std::vector<GLuint> indices;
-  indices.reserve((particlesPerEdge - 1) * (2 * particlesPerEdge + 1));
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    int offset = i * (particlesPerEdge);
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      indices.emplace_back(offset + j);
-      indices.emplace_back(offset + j + particlesPerEdge);
-      indices.emplace_back(offset + j + 1);
+  for (int k = 0; k < _instanceCount; ++k) {
+    int first = instanceRange(k).first;
+    // Four corners will not move
+    _particles.mass(first) = 0.0f;
+    _particles.mass(first + _particlesPerEdge - 1) = 0.0f;
+    _particles.mass(first + _particlesPerEdge * (_particlesPerEdge - 1)) = 0.0f;
+    _particles.mass(first + _particlesPerEdge * _particlesPerEdge - 1) = 0.0f;
+  }
 
-      indices.emplace_back(offset + j + 1);
-      indices.emplace_back(offset + j + particlesPerEdge);
-      indices.emplace_back(offset + j + particlesPerEdge + 1);
+  _triangles.clear();
+  _triangles.reserve(_instanceCount * (_particlesPerEdge - 1) * (_particlesPerEdge - 1) * 2);
+  for (int k = 0; k < _instanceCount; ++k) {
+    for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+      int offset = instanceRange(k).first + i * (_particlesPerEdge);
+      for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+        _triangles.push_back({offset + j, offset + j + _particlesPerEdge, offset + j + 1});
+        _triangles.push_back({offset + j + 1, offset + j + _particlesPerEdge, offset + j + _particlesPerEdge + 1});
+      }
     }
   }
+  _triangleBVH.build(_triangles, _particles.position());
+
+#ifndef HW1_HEADLESS
+  std::vector<GLuint> indices;
+  indices.reserve(_triangles.size() * 3);
+  for (const auto& triangle : _triangles) indices.insert(indices.end(), triangle.begin(), triangle.end());
 
-  int vboSize = particlesPerEdge * particlesPerEdge * sizeof(GLfloat);
-  positionBuffer.allocate_load(vboSize * 4, _particles.getPositionData());
-  normalBuffer.allocate(particlesPerEdge * particlesPerEdge * sizeof(float) * 4);
+  GLsizeiptr vboSize = _particles.getCapacity() * sizeof(GLfloat) * 4;
+  vertexStream.allocateRegions(2 * vboSize);
+  vertexStream.write(0, vboSize, _particles.getPositionData());
+  hasUploadedNormal = false;
 
   ebo.allocate_load(indices.size() * sizeof(GLuint), indices.data());
 
   vao.bind();
-  positionBuffer.bind();
+  vertexStream.bind();
   vao.enable(0);
   vao.setAttributePointer(0, 4, 4, 0);
-  normalBuffer.bind();
   vao.enable(1);
-  vao.setAttributePointer(1, 4, 4, 0);
+  vao.setAttributePointer(1, 4, 4, vboSize / sizeof(GLfloat));
 
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
 }
 
 void Cloth::initializeSpring() {
@@ -89,60 +168,74 @@ void Cloth::initializeSpring() {
   // Note:
   //   1. The particles index:
   //   ===============================================
-  //   0 1 2 3 ... particlesPerEdge
-  //   particlesPerEdge + 1 ....
-  //   ... ... particlesPerEdge * particlesPerEdge - 1
+  //   0 1 2 3 ... _particlesPerEdge
+  //   _particlesPerEdge + 1 ....
+  //   ... ... _particlesPerEdge * _particlesPerEdge - 1
   //   ===============================================
   // Here is a simple example which connects the horizontal structrual springs.
 
   // STRUCTURAL
   float structrualLength = (_particles.position(0) - _particles.position(1)).norm();
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      int index = i * particlesPerEdge + j;
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+      int index = i * _particlesPerEdge + j;
       _springs.emplace_back(index, index + 1, structrualLength, Spring::Type::STRUCTURAL);
     }
   }
 
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge, structrualLength, Spring::Type::STRUCTURAL);
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      int index = i * _particlesPerEdge + j;
+      _springs.emplace_back(index, index + _particlesPerEdge, structrualLength, Spring::Type::STRUCTURAL);
     }
   }
 
   // SHEAR
-  float shearLength = (_particles.position(0) - _particles.position(particlesPerEdge + 1)).norm();
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge + 1, shearLength, Spring::Type::SHEAR);
+  float shearLength = (_particles.position(0) - _particles.position(_particlesPerEdge + 1)).norm();
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+      int index = i * _particlesPerEdge + j;
+      _springs.emplace_back(index, index + _particlesPerEdge + 1, shearLength, Spring::Type::SHEAR);
     }
   }
 
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    for (int j = 1; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge - 1, shearLength, Spring::Type::SHEAR);
+  for (int i = 0; i < _particlesPerEdge - 1; ++i) {
+    for (int j = 1; j < _particlesPerEdge; ++j) {
+      int index = i * _particlesPerEdge + j;
+      _springs.emplace_back(index, index + _particlesPerEdge - 1, shearLength, Spring::Type::SHEAR);
     }
   }
 
   // BEND
   float bendLength = (_particles.position(0) - _particles.position(2)).norm();
-  for (int i = 0; i < particlesPerEdge; ++i) {
-    for (int j = 0; j < particlesPerEdge - 2; ++j) {
-      int index = i * particlesPerEdge + j;
+  for (int i = 0; i < _particlesPerEdge; ++i) {
+    for (int j = 0; j < _particlesPerEdge - 2; ++j) {
+      int index = i * _particlesPerEdge + j;
       _springs.emplace_back(index, index + 2, bendLength, Spring::Type::BEND);
     }
   }
 
-  for (int i = 0; i < particlesPerEdge - 2; ++i) {
-    for (int j = 0; j < particlesPerEdge; ++j) {
-      int index = i * particlesPerEdge + j;
-      _springs.emplace_back(index, index + particlesPerEdge*2, bendLength, Spring::Type::BEND);
+  for (int i = 0; i < _particlesPerEdge - 2; ++i) {
+    for (int j = 0; j < _particlesPerEdge; ++j) {
+      int index = i * _particlesPerEdge + j;
+      _springs.emplace_back(index, index + _particlesPerEdge*2, bendLength, Spring::Type::BEND);
     }
   }
+  // Same springs for the other instances, coloring then puts springs of all instances in the same groups
+  int instanceSprings = static_cast<int>(_springs.size());
+  _springs.reserve(_instanceCount * instanceSprings);
+  for (int k = 1; k < _instanceCount; ++k) {
+    unsigned int first = instanceRange(k).first;
+    for (int s = 0; s < instanceSprings; ++s) {
+      const Spring& spring = _springs[s];
+      _springs.emplace_back(spring.startParticleIndex() + first, spring.endParticleIndex() + first, spring.length(),
+                            spring.type());
+    }
+  }
+  colorSprings();
+  tileSprings();
 
+#ifndef HW1_HEADLESS
   std::vector<GLuint> structrualIndices, shearIndices, bendIndices;
   for (const auto& spring : _springs) {
     switch (spring.type()) {
@@ -163,59 +256,427 @@ void Cloth::initializeSpring() {
   structuralSpring.allocate_load(structrualIndices.size() * sizeof(GLuint), structrualIndices.data());
   shearSpring.allocate_load(shearIndices.size() * sizeof(GLuint), shearIndices.data());
   bendSpring.allocate_load(bendIndices.size() * sizeof(GLuint), bendIndices.data());
+#endif
 }
 void Cloth::computeSpringForce() {
-  // TODO: Compute spring force and damper force for each spring.
-  //   1. Read the start and end index from spring
-  //   2. Use _particles.position(i) to get particle i's position.
-  //   3. Modify particles' acceleration a = F / m;
-  // Note:
-  //   1. Use _particles.inverseMass(i) to get 1 / m can deal with m == 0. Which will returns 0.
-  // Hint:
-  //   1. Use a.norm() to get length of a.
-  //   2. Use a.normalize() to normalize a inplace.
-  //          a.normalized() will create a new vector.
-  //   3. Use a.dot(b) to get dot product of a and b.
-  for (const auto& spring : _springs) {
-    float deltaL =
-        (_particles.position(spring.startParticleIndex()) - _particles.position(spring.endParticleIndex())).norm() - spring.length();
-    Eigen::Vector4f vectorL = (_particles.position(spring.startParticleIndex()) - _particles.position(spring.endParticleIndex())).normalized();
-    Eigen::Vector4f springForce = -(springCoef * deltaL) * vectorL; // based on start particle
+  if (!_springForceEnabled) return;
+  ThreadPool& pool = ThreadPool::getPool();
+  int colorCount = static_cast<int>(_springColorOffsets.size()) - 1;
+  bool useSpringArray = currentSpringKernel == 1;
+  auto accumulate = [&](int first, int last) {
+    if (useSpringArray) {
+      _springArray.accumulateForce(_particles, first, last);
+    } else {
+      for (int i = first; i < last; ++i) applySpringForce(_particles, _springs[i]);
+    }
+  };
+  // With every island awake this is each color in turn, i.e. the springs in storage order
+  const auto& activeRanges = _particles.activeRanges();
+  if (pool.size() == 1) {
+    for (int color = 0; color < colorCount; ++color) {
+      for (const auto& [first, last] : activeRanges) {
+        auto [firstSpring, lastSpring] = springRange(color, first, last);
+        accumulate(firstSpring, lastSpring);
+      }
+    }
+  } else {
+    pool.run([&](int threadIndex) {
+      for (int color = 0; color < colorCount; ++color) {
+        for (const auto& [first, last] : activeRanges) {
+          auto [firstSpring, lastSpring] = springRange(color, first, last);
+          auto [threadFirst, threadLast] = pool.range(firstSpring, lastSpring, threadIndex);
+          accumulate(threadFirst, threadLast);
+        }
+        pool.barrier();
+      }
+    });
+  }
+  // Springs crossing into sleeping rows pulled on both ends, the sleeping end does not move
+  for (const auto& [first, last] : sleepingHalo) _particles.acceleration().middleCols(first, last - first).setZero();
+}
+
+void Cloth::computeForces() {
+  if (currentSpringKernel != 2 || !_springForceEnabled || sleepingIslands > 0) {
+    computeExternalForce();
+    computeSpringForce();
+    return;
+  }
+  int tileCount = static_cast<int>(tileRunOffsets.size()) / 2;
+  int particleCount = _particles.getCapacity();
+  auto accumulateRuns = [this](int firstRun, int lastRun) {
+    for (int run = firstRun; run < lastRun; ++run)
+      tileSpringArray.accumulateForce(_particles, tileRuns[run].first, tileRuns[run].second);
+  };
+  // Tile t holds particles [first, last) and the springs between them
+  auto computeTile = [&](int t) {
+    int first = t * tileRows * _particlesPerEdge;
+    int last = std::min(particleCount, first + tileRows * _particlesPerEdge);
+    computeExternalForce(first, last);
+    accumulateRuns(tileRunOffsets[2 * t], tileRunOffsets[2 * t + 1]);
+  };
+  // Springs from the last rows of tile t to the first rows of tile t + 1, tiles have at least 4 rows and springs span
+  // at most 2 rows, so these never share particles with the ones of another tile
+  auto computeBoundary = [&](int t) { accumulateRuns(tileRunOffsets[2 * t + 1], tileRunOffsets[2 * t + 2]); };
+  ThreadPool& pool = ThreadPool::getPool();
+  if (pool.size() == 1) {
+    for (int t = 0; t < tileCount; ++t) computeTile(t);
+    for (int t = 0; t < tileCount; ++t) computeBoundary(t);
+    return;
+  }
+  pool.run([&](int threadIndex) {
+    auto [first, last] = pool.range(0, tileCount, threadIndex);
+    for (int t = first; t < last; ++t) computeTile(t);
+    pool.barrier();
+    for (int t = first; t < last; ++t) computeBoundary(t);
+  });
+}
+
+void Cloth::tileSprings() {
+  // About 4096 particles, i.e. 200 KiB of position, velocity, acceleration and mass, fits in L2
+  constexpr int tileParticles = 4096;
+  tileRows = std::max(4, tileParticles / _particlesPerEdge);
+  // Instances are stacked rows of the pool, springs never cross them
+  int rows = _instanceCount * _particlesPerEdge;
+  int tileCount = (rows + tileRows - 1) / tileRows;
+  auto tileOf = [this](unsigned int particle) { return static_cast<int>(particle) / _particlesPerEdge / tileRows; };
+  // Group 2t for springs inside tile t and 2t + 1 for springs crossing into tile t + 1
+  struct TiledSpring {
+    int group;
+    int color;
+    int index;
+  };
+  std::vector<TiledSpring> order;
+  order.reserve(_springs.size());
+  int colorCount = static_cast<int>(_springColorOffsets.size()) - 1;
+  for (int color = 0; color < colorCount; ++color) {
+    for (int i = _springColorOffsets[color]; i < _springColorOffsets[color + 1]; ++i) {
+      int tile = tileOf(_springs[i].startParticleIndex());
+      order.push_back({2 * tile + (tileOf(_springs[i].endParticleIndex()) != tile ? 1 : 0), color, i});
+    }
+  }
+  // By start particle inside a color, so that a tile is swept in memory order
+  std::sort(order.begin(), order.end(), [this](const TiledSpring& a, const TiledSpring& b) {
+    if (a.group != b.group) return a.group < b.group;
+    if (a.color != b.color) return a.color < b.color;
+    return _springs[a.index].startParticleIndex() < _springs[b.index].startParticleIndex();
+  });
+
+  std::vector<Spring> sorted;
+  sorted.reserve(_springs.size());
+  std::vector<int> runGroups;
+  tileRuns.clear();
+  for (size_t i = 0; i < order.size(); ++i) {
+    sorted.push_back(_springs[order[i].index]);
+    if (i == 0 || order[i].group != order[i - 1].group || order[i].color != order[i - 1].color) {
+      tileRuns.emplace_back(static_cast<int>(i), static_cast<int>(i));
+      runGroups.push_back(order[i].group);
+    }
+    ++tileRuns.back().second;
+  }
+  tileRunOffsets.resize(2 * tileCount + 1);
+  for (int group = 0; group <= 2 * tileCount; ++group) {
+    tileRunOffsets[group] =
+        static_cast<int>(std::lower_bound(runGroups.begin(), runGroups.end(), group) - runGroups.begin());
+  }
+  tileSpringArray.assign(sorted);
+}
 
-    float deltaV = (_particles.velocity(spring.startParticleIndex()) - _particles.velocity(spring.endParticleIndex())).dot(vectorL);
-    Eigen::Vector4f damperForce = -(damperCoef * deltaV) * vectorL;  // based on start particle
+size_t Cloth::springMemoryBytes() const {
+  return _springs.capacity() * sizeof(Spring) + _springArray.memoryBytes() + tileSpringArray.memoryBytes() +
+         tileRuns.capacity() * sizeof(std::pair<int, int>) +
+         (_springColorOffsets.capacity() + springRowOffsets.capacity() + tileRunOffsets.capacity()) * sizeof(int);
+}
 
-    _particles.acceleration(spring.startParticleIndex()) +=
-        (springForce + damperForce) * _particles.inverseMass(spring.startParticleIndex());
-    _particles.acceleration(spring.endParticleIndex()) +=
-        -(springForce + damperForce) * _particles.inverseMass(spring.endParticleIndex());
+void Cloth::colorSprings() {
+  // Each particle has at most 12 springs, so greedy coloring needs at most 23 colors.
+  std::vector<uint32_t> usedColors(_particles.getCapacity(), 0);
+  std::vector<int> colors(_springs.size());
+  int colorCount = 0;
+  for (size_t i = 0; i < _springs.size(); ++i) {
+    uint32_t& start = usedColors[_springs[i].startParticleIndex()];
+    uint32_t& end = usedColors[_springs[i].endParticleIndex()];
+    uint32_t used = start | end;
+    int color = 0;
+    while (used & (1u << color)) ++color;
+    start |= 1u << color;
+    end |= 1u << color;
+    colors[i] = color;
+    colorCount = std::max(colorCount, color + 1);
+  }
+
+  std::vector<Spring> sorted;
+  sorted.reserve(_springs.size());
+  _springColorOffsets.assign(colorCount + 1, 0);
+  for (int color = 0; color < colorCount; ++color) {
+    _springColorOffsets[color] = static_cast<int>(sorted.size());
+    for (size_t i = 0; i < _springs.size(); ++i) {
+      if (colors[i] == color) sorted.push_back(_springs[i]);
+    }
+  }
+  _springColorOffsets[colorCount] = static_cast<int>(sorted.size());
+  _springs = std::move(sorted);
+  // Springs of a color share no particle, so their order does not change the forces. Sorted by start particle, the
+  // springs of any band of rows are contiguous.
+  for (int color = 0; color < colorCount; ++color) {
+    std::sort(_springs.begin() + _springColorOffsets[color], _springs.begin() + _springColorOffsets[color + 1],
+              [](const Spring& a, const Spring& b) { return a.startParticleIndex() < b.startParticleIndex(); });
+  }
+  _springArray.assign(_springs);
+
+  int rows = _instanceCount * _particlesPerEdge;
+  springRowOffsets.resize(colorCount * (rows + 1));
+  for (int color = 0; color < colorCount; ++color) {
+    auto begin = _springs.begin() + _springColorOffsets[color];
+    auto end = _springs.begin() + _springColorOffsets[color + 1];
+    for (int row = 0; row <= rows; ++row) {
+      auto first = std::partition_point(begin, end, [&](const Spring& spring) {
+        return static_cast<int>(spring.startParticleIndex()) / _particlesPerEdge < row;
+      });
+      springRowOffsets[color * (rows + 1) + row] = static_cast<int>(first - _springs.begin());
+    }
+  }
+}
+
+std::pair<int, int> Cloth::islandRange(int i) const {
+  int islands = islandsPerInstance();
+  int first = instanceRange(i / islands).first + i % islands * islandRows * _particlesPerEdge;
+  int last = i % islands == islands - 1 ? instanceRange(i / islands).second : first + islandRows * _particlesPerEdge;
+  return {first, last};
+}
+
+void Cloth::updateSleeping(int steps) {
+  int islands = islandsPerInstance();
+  int islandCount = static_cast<int>(islandSleeping.size());
+  int reach = springReachRows * _particlesPerEdge;
+  float thresholdSquared = sleepVelocity * sleepVelocity;
+  if (isSleepingEnabled) {
+    // Speeds of the awake islands, first all of them so that a neighbor disturbs an island whatever their order
+    std::fill(islandDisturbed.begin(), islandDisturbed.end(), 0);
+    for (int i = 0; i < islandCount; ++i) {
+      if (islandSleeping[i]) continue;
+      auto [first, last] = islandRange(i);
+      // Kinetic energy per unit mass, rounding noise of far away islands stays well below it
+      Eigen::RowVectorXf speedSquared = _particles.velocity().middleCols(first, last - first).colwise().squaredNorm();
+      islandQuiet[i] = speedSquared.mean() < thresholdSquared && speedSquared.maxCoeff() < 16.0f * thresholdSquared;
+      // The rows joined by springs to the island before and after it in the same instance
+      if (i % islands > 0 && speedSquared.head(reach).maxCoeff() >= 16.0f * thresholdSquared)
+        islandDisturbed[i - 1] = 1;
+      if (i % islands < islands - 1 && speedSquared.tail(reach).maxCoeff() >= 16.0f * thresholdSquared)
+        islandDisturbed[i + 1] = 1;
+    }
+  }
+  bool changed = false;
+  for (int i = 0; i < islandCount; ++i) {
+    if (!isSleepingEnabled || wakeRequested[i] || (islandSleeping[i] && islandDisturbed[i])) {
+      wakeRequested[i] = 0;
+      quietTime[i] = 0.0f;
+      if (islandSleeping[i]) {
+        islandSleeping[i] = 0;
+        --sleepingIslands;
+        changed = true;
+      }
+      continue;
+    }
+    if (islandSleeping[i]) continue;
+    quietTime[i] = islandQuiet[i] && !islandDisturbed[i] ? quietTime[i] + steps * deltaTime : 0.0f;
+    if (quietTime[i] < sleepDelay) continue;
+    // Woken islands start from rest, and the acceleration is not read while asleep
+    auto [first, last] = islandRange(i);
+    _particles.velocity().middleCols(first, last - first).setZero();
+    _particles.acceleration().middleCols(first, last - first).setZero();
+    islandSleeping[i] = 1;
+    ++sleepingIslands;
+    changed = true;
+  }
+  if (changed) updateActiveRanges();
+}
+
+void Cloth::wakeAll() {
+  std::fill(islandSleeping.begin(), islandSleeping.end(), 0);
+  std::fill(wakeRequested.begin(), wakeRequested.end(), 0);
+  std::fill(quietTime.begin(), quietTime.end(), 0.0f);
+  sleepingIslands = 0;
+  updateActiveRanges();
+}
+
+void Cloth::updateActiveRanges() {
+  std::vector<std::pair<int, int>> ranges;
+  for (int i = 0; i < static_cast<int>(islandSleeping.size()); ++i) {
+    auto [first, last] = islandRange(i);
+    std::fill(particleSleeping.begin() + first, particleSleeping.begin() + last, islandSleeping[i]);
+    if (islandSleeping[i]) continue;
+    // Neighboring awake islands are merged, so each range is swept in one go
+    if (!ranges.empty() && ranges.back().second == first) {
+      ranges.back().second = last;
+    } else {
+      ranges.emplace_back(first, last);
+    }
+  }
+  _particles.setActiveRanges(ranges);
+
+  // Sleeping islands have at least springReachRows rows, so the halo of a range never reaches another range
+  int size = _particlesPerEdge * _particlesPerEdge;
+  int reach = springReachRows * _particlesPerEdge;
+  awakeParticles = 0;
+  sleepingHalo.clear();
+  for (const auto& [first, last] : ranges) {
+    awakeParticles += last - first;
+    if (first % size != 0) sleepingHalo.emplace_back(first - reach, first);
+    if (last % size != 0) sleepingHalo.emplace_back(last, last + reach);
   }
 }
 
 void Cloth::collide(Shape* shape) { shape->collide(this); }
 void Cloth::collide(Spheres* sphere) { sphere->collide(this); }
 
-void Cloth::computeNormal() {
-  static Eigen::Matrix<float, 4, particlesPerEdge * particlesPerEdge> normals;
-  normals.setZero();
-  for (int i = 0; i < particlesPerEdge - 1; ++i) {
-    int offset = i * (particlesPerEdge);
-    for (int j = 0; j < particlesPerEdge - 1; ++j) {
-      Eigen::Vector4f v1 = _particles.position(offset + j) - _particles.position(offset + j + particlesPerEdge);
-      Eigen::Vector4f v2 = _particles.position(offset + j + 1) - _particles.position(offset + j + particlesPerEdge);
+float Cloth::selfCollisionThickness() const {
+  return 2.0f * std::min(_width, _height) / (_particlesPerEdge - 1);
+}
+
+bool Cloth::isSelfContact(int i, int j, float thickness) {
+  // Distance first, it rejects almost every candidate
+  if ((_particles.position(i) - _particles.position(j)).squaredNorm() >= thickness * thickness) return false;
+  // Fixed or sleeping particles cannot be moved apart
+  if ((_particles.mass(i) == 0.0f || isSleeping(i)) && (_particles.mass(j) == 0.0f || isSleeping(j))) return false;
+  int size = _particlesPerEdge * _particlesPerEdge;
+  if (i / size != j / size) return true;
+  int local_i = i % size, local_j = j % size;
+  return std::abs(local_i / _particlesPerEdge - local_j / _particlesPerEdge) > 2 ||
+         std::abs(local_i % _particlesPerEdge - local_j % _particlesPerEdge) > 2;
+}
+
+void Cloth::collide() {
+  float thickness = selfCollisionThickness();
+  // Cells twice the query extent, so each query overlaps at most 2 * 2 * 2 cells
+  selfCollisionHash.build(_particles.position(), 2.0f * thickness);
+
+  ThreadPool& pool = ThreadPool::getPool();
+  threadCandidates.resize(pool.size());
+  threadContacts.resize(pool.size());
+  for (auto& contacts : threadContacts) contacts.clear();
+  // Contacts of particles [first, last), sorted by pair. Only awake particles query, so a sleeping particle is paired
+  // from the awake side whatever the order.
+  auto detect = [&](int threadIndex, int first, int last) {
+    std::vector<int>& candidates = threadCandidates[threadIndex];
+    std::vector<std::pair<int, int>>& contacts = threadContacts[threadIndex];
+    Eigen::Vector4f extent(thickness, thickness, thickness, 0.0f);
+    for (int i = first; i < last; ++i) {
+      candidates.clear();
+      selfCollisionHash.query(_particles.position(i) - extent, _particles.position(i) + extent, candidates);
+      auto firstContact = contacts.end() - contacts.begin();
+      for (int j : candidates) {
+        if ((j > i || isSleeping(j)) && isSelfContact(i, j, thickness))
+          contacts.emplace_back(std::min(i, j), std::max(i, j));
+      }
+      // Same order as testing every pair
+      std::sort(contacts.begin() + firstContact, contacts.end());
+    }
+  };
+  const auto& activeRanges = _particles.activeRanges();
+  if (pool.size() == 1) {
+    for (const auto& [first, last] : activeRanges) detect(0, first, last);
+  } else {
+    pool.run([&](int threadIndex) {
+      for (const auto& [first, last] : activeRanges) {
+        auto [threadFirst, threadLast] = pool.range(first, last, threadIndex);
+        detect(threadIndex, threadFirst, threadLast);
+      }
+    });
+  }
+  // Threads own increasing ranges of particles, so this is the same order as testing every pair. Pairs with a sleeping
+  // particle or split active ranges break that, and are sorted again.
+  selfContacts.clear();
+  for (const auto& contacts : threadContacts) selfContacts.insert(selfContacts.end(), contacts.begin(), contacts.end());
+  if (sleepingIslands > 0) std::sort(selfContacts.begin(), selfContacts.end());
+  resolveSelfContacts(thickness);
+}
+
+void Cloth::collideAllPairs() {
+  int particleCount = _particles.getCapacity();
+  float thickness = selfCollisionThickness();
+  selfContacts.clear();
+  for (int i = 0; i < particleCount; i++) {
+    for (int j = i + 1; j < particleCount; j++) {
+      if (isSelfContact(i, j, thickness)) selfContacts.emplace_back(i, j);
+    }
+  }
+  resolveSelfContacts(thickness);
+}
+
+void Cloth::resolveSelfContacts(float thickness) {
+  if (selfContacts.empty()) return;
+  int particleCount = _particles.getCapacity();
+  contactPositionDelta.setZero(4, particleCount);
+  contactVelocityDelta.setZero(4, particleCount);
+  contactCount.assign(particleCount, 0);
+  for (const auto& [i, j] : selfContacts) {
+    Eigen::Vector4f difference = _particles.position(i) - _particles.position(j);
+    float distance = difference.norm();
+    Eigen::Vector4f normalVec = distance > 0.0f ? Eigen::Vector4f(difference / distance) : difference;
+    // Split by inverse mass, a fixed or sleeping particle does not move. The sleeping one wakes for the next step.
+    float inverseMass_i = isSleeping(i) ? 0.0f : _particles.inverseMass(i);
+    float inverseMass_j = isSleeping(j) ? 0.0f : _particles.inverseMass(j);
+    if (isSleeping(i)) wake(i);
+    if (isSleeping(j)) wake(j);
+    float inverseMassSum = inverseMass_i + inverseMass_j;
+    Eigen::Vector4f correction = (thickness - distance) / inverseMassSum * normalVec;
+    contactPositionDelta.col(i) += inverseMass_i * correction;
+    contactPositionDelta.col(j) -= inverseMass_j * correction;
+    // Inelastic, only the approaching normal velocity is removed
+    float normalVelocity = (_particles.velocity(i) - _particles.velocity(j)).dot(normalVec);
+    if (normalVelocity < 0.0f) {
+      Eigen::Vector4f impulse = -normalVelocity / inverseMassSum * normalVec;
+      contactVelocityDelta.col(i) += inverseMass_i * impulse;
+      contactVelocityDelta.col(j) -= inverseMass_j * impulse;
+    }
+    ++contactCount[i];
+    ++contactCount[j];
+  }
+  // Averaging keeps a particle with many contacts from being pushed too far
+  for (int i = 0; i < particleCount; ++i) {
+    if (contactCount[i] == 0) continue;
+    float weight = 1.0f / static_cast<float>(contactCount[i]);
+    _particles.position(i) += weight * contactPositionDelta.col(i);
+    _particles.velocity(i) += weight * contactVelocityDelta.col(i);
+  }
+}
+
+bool Cloth::computeNormal() {
+  if (normalGeneration == positionGeneration) return false;
+  normalGeneration = positionGeneration;
+
+  // Row i of quads adds to rows i and i + 1 of particles
+  auto addQuadRow = [this](int i) {
+    // Last row of an instance, the next row belongs to the next instance
+    if (i % _particlesPerEdge == _particlesPerEdge - 1) return;
+    int offset = i * (_particlesPerEdge);
+    for (int j = 0; j < _particlesPerEdge - 1; ++j) {
+      // cross3 is vectorized on Vector4f, w of the differences is 0
+      Eigen::Vector4f v1 = _particles.position(offset + j) - _particles.position(offset + j + _particlesPerEdge);
+      Eigen::Vector4f v2 = _particles.position(offset + j + 1) - _particles.position(offset + j + _particlesPerEdge);
       Eigen::Vector4f n1 = v2.cross3(v1);
       normals.col(offset + j) += n1;
       normals.col(offset + j + 1) += n1;
-      normals.col(offset + j + particlesPerEdge) += n1;
+      normals.col(offset + j + _particlesPerEdge) += n1;
 
       Eigen::Vector4f v3 =
-          _particles.position(offset + j + particlesPerEdge + 1) - _particles.position(offset + j + particlesPerEdge);
+          _particles.position(offset + j + _particlesPerEdge + 1) - _particles.position(offset + j + _particlesPerEdge);
       Eigen::Vector4f n2 = v3.cross3(v2);
       normals.col(offset + j + 1) += n2;
-      normals.col(offset + j + particlesPerEdge) += n2;
-      normals.col(offset + j + particlesPerEdge + 1) += n2;
+      normals.col(offset + j + _particlesPerEdge) += n2;
+      normals.col(offset + j + _particlesPerEdge + 1) += n2;
     }
+  };
+  ThreadPool& pool = ThreadPool::getPool();
+  normals.setZero();
+  int quadRows = _instanceCount * _particlesPerEdge - 1;
+  for (int parity = 0; parity < 2; ++parity) {
+    pool.parallelFor(0, (quadRows - parity + 1) / 2, [&](int first, int last) {
+      for (int k = first; k < last; ++k) addQuadRow(2 * k + parity);
+    });
   }
-  normals.colwise().normalize();
-  normalBuffer.load(0, particlesPerEdge * particlesPerEdge * sizeof(float) * 4, normals.data());
+  pool.parallelFor(0, static_cast<int>(normals.cols()), [this](int first, int last) {
+    normals.middleCols(first, last - first).colwise().normalize();
+  });
+  return true;
 }
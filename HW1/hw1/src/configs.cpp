@@ -8,10 +8,22 @@ int speedMultiplier = 1;
 
 float deltaTime = 1e-4f;
 int simulationPerFrame = static_cast<int>(baseSpeed / deltaTime);
+int simulationThreads = 1;
+float simulationStepsPerSecond = 0.0f;
+int activeClothParticles = 0;
+int clothParticleCount = 0;
 
 float springCoef = 25000.0f;
 float damperCoef = 750.0f;
+std::array<float, 3> springStiffness = {1.0f, 1.0f, 1.0f};
 float viscousCoef = 3.4e-4f;
+float adaptiveTolerance = 1e-4f;
+int constraintIterations = 10;
+bool isSelfColliding = false;
+bool isUsingContinuousCollision = false;
+bool isSleepingEnabled = false;
+float sleepVelocity = 1e-2f;
+float sleepDelay = 0.5f;
 
 Eigen::Vector4f sphereColor = Eigen::Vector4f(0.28f, 0.65f, 0.8f, 1.0f);
 Eigen::Vector4f clothColor = Eigen::Vector4f(0.88f, 0.17f, 0.17f, 1.0f);
@@ -25,5 +37,15 @@ bool isDrawingBendSprings = false;
 bool isDrawingCloth = false;
 bool isPaused = true;
 bool isStateSwitched = false;
+bool isSavingCheckpoint = false;
+bool isLoadingCheckpoint = false;
+bool isRecordingTrajectory = false;
+bool isPlayingTrajectory = false;
+int timelineFrame = -1;
+int recordedFrames = 0;
+bool isProfiling = false;
+bool isTracing = false;
+bool isSavingTrace = false;
 
 int currentIntegrator = 0;
+int currentSpringKernel = 0;
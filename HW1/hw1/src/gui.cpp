@@ -1,7 +1,13 @@
 #include "gui.h"
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
+#include <cstdio>
 
 #include "configs.h"
+#include "profiler.h"
+#include "spring.h"
+#include "threadpool.h"
 
 namespace {
 void renderColorPanel() {
@@ -46,6 +52,65 @@ void renderDrawingTypes() {
   ImGui::Checkbox("Surface", &isDrawingCloth);
 }
 
+void renderTimeline() {
+  // Recording always continues from the simulation
+  if (ImGui::Checkbox("Record trajectory", &isRecordingTrajectory) && isRecordingTrajectory) timelineFrame = -1;
+  ImGui::SameLine();
+  ImGui::Text("%d frames", recordedFrames);
+  if (recordedFrames == 0 || isRecordingTrajectory) return;
+  int frame = std::max(timelineFrame, 0);
+  if (ImGui::SliderInt("Frame", &frame, 0, recordedFrames - 1)) {
+    timelineFrame = frame;
+    isPlayingTrajectory = false;
+  }
+  if (ImGui::Button(isPlayingTrajectory ? "Pause playback" : "Play")) {
+    if (!isPlayingTrajectory && (timelineFrame < 0 || timelineFrame >= recordedFrames - 1)) timelineFrame = 0;
+    isPlayingTrajectory = !isPlayingTrajectory;
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Back to simulation")) {
+    timelineFrame = -1;
+    isPlayingTrajectory = false;
+  }
+}
+
+void plotPhase(const char* label, const float* history, float frameTime) {
+  const Profiler& profiler = Profiler::getProfiler();
+  float average = Profiler::average(history);
+  char overlay[64];
+  std::snprintf(overlay, sizeof(overlay), "%.3f ms (%.0f%% of a frame)", average,
+                frameTime > 0.0f ? 100.0f * average / frameTime : 0.0f);
+  ImGui::PlotLines(label, history, Profiler::historySize, profiler.historyOffset(), overlay, 0.0f, FLT_MAX,
+                   ImVec2(0.0f, 40.0f));
+}
+
+void renderProfilerPanel() {
+  if (!isProfiling) return;
+  const Profiler& profiler = Profiler::getProfiler();
+  ImGui::SetNextWindowSize(ImVec2(450.0f, 520.0f), ImGuiCond_Once);
+  ImGui::SetNextWindowCollapsed(0, ImGuiCond_Once);
+  ImGui::SetNextWindowPos(ImVec2(520.0f, 50.0f), ImGuiCond_Once);
+  ImGui::SetNextWindowBgAlpha(0.6f);
+  if (ImGui::Begin("Profiler", &isProfiling)) {
+    // Milliseconds per displayed frame over the last Profiler::historySize frames
+    float frameTime = Profiler::average(profiler.frameHistory());
+    plotPhase("Frame", profiler.frameHistory(), frameTime);
+    ImGui::Text("%s", "Simulation thread");
+    for (auto phase :
+         {ProfilePhase::FORCES, ProfilePhase::COLLISIONS, ProfilePhase::INTEGRATION, ProfilePhase::NORMALS})
+      plotPhase(Profiler::phaseName(phase), profiler.history(phase), frameTime);
+    ImGui::Text("%s", "Render thread");
+    for (auto phase : {ProfilePhase::UPLOAD, ProfilePhase::DRAW, ProfilePhase::GUI})
+      plotPhase(Profiler::phaseName(phase), profiler.history(phase), frameTime);
+    ImGui::Checkbox("Record trace", &isTracing);
+    ImGui::SameLine();
+    isSavingTrace = ImGui::Button("Save trace");
+    ImGui::SameLine();
+    ImGui::Text("%zu events", profiler.traceEventCount());
+  }
+  ImGui::End();
+}
+
 void renderMainPanel() {
   ImGui::SetNextWindowSize(ImVec2(450.0f, 350.0f), ImGuiCond_Once);
   ImGui::SetNextWindowCollapsed(0, ImGuiCond_Once);
@@ -63,12 +128,20 @@ void renderMainPanel() {
       simulationPerFrame = speedMultiplier * static_cast<int>(baseSpeed / deltaTime);
       simulationPerFrame = std::max(1, simulationPerFrame);
     }
+    if (ImGui::InputInt("simulationThreads", &simulationThreads)) {
+      simulationThreads = std::clamp(simulationThreads, 1, 256);
+      ThreadPool::getPool().resize(simulationThreads);
+    }
     if (ImGui::InputFloat("springCoef", &springCoef, 1e2f, 1e3f, "%.0f")) {
       springCoef = std::max(0.0f, springCoef);
     }
     if (ImGui::InputFloat("damperCoef", &damperCoef, 1.0f, 1e2f, "%.0f")) {
       damperCoef = std::max(0.0f, damperCoef);
     }
+    // Structural, shear and bend
+    if (ImGui::InputFloat3("springStiffness", springStiffness.data(), "%.2f")) {
+      for (float& stiffness : springStiffness) stiffness = std::max(0.0f, stiffness);
+    }
 
     ImGui::Text("%s", "---------------------- Integrator ----------------------");
     ImGui::RadioButton("Explicit Euler", &currentIntegrator, 0);
@@ -77,13 +150,53 @@ void renderMainPanel() {
     ImGui::RadioButton("Midpoint Euler", &currentIntegrator, 2);
     ImGui::SameLine();
     ImGui::RadioButton("Runge Kutta Fourth", &currentIntegrator, 3);
+    ImGui::SameLine();
+    ImGui::RadioButton("XPBD", &currentIntegrator, 6);
+    ImGui::RadioButton("Backward Euler (CG)", &currentIntegrator, 4);
+    ImGui::SameLine();
+    ImGui::RadioButton("Bogacki Shampine", &currentIntegrator, 5);
+    ImGui::RadioButton("Projective Dynamics", &currentIntegrator, 7);
+    if (currentIntegrator == 5 && ImGui::InputFloat("tolerance", &adaptiveTolerance, 1e-5f, 1e-4f, "%.1e")) {
+      adaptiveTolerance = std::max(1e-8f, adaptiveTolerance);
+    }
+    if ((currentIntegrator == 6 || currentIntegrator == 7) && ImGui::InputInt("iterations", &constraintIterations)) {
+      constraintIterations = std::clamp(constraintIterations, 1, 1000);
+    }
+    ImGui::Checkbox("Self collision", &isSelfColliding);
+    ImGui::SameLine();
+    ImGui::Checkbox("Continuous collision", &isUsingContinuousCollision);
+    ImGui::Checkbox("Sleep settled cloth", &isSleepingEnabled);
+    if (isSleepingEnabled && ImGui::InputFloat("sleepVelocity", &sleepVelocity, 1e-3f, 1e-2f, "%.3f")) {
+      sleepVelocity = std::max(0.0f, sleepVelocity);
+    }
+
+    ImGui::Text("%s", "--------------------- Spring kernel --------------------");
+    ImGui::RadioButton("Scalar", &currentSpringKernel, 0);
+    ImGui::SameLine();
+    ImGui::RadioButton(SpringArray::kernelName(), &currentSpringKernel, 1);
+    ImGui::SameLine();
+    ImGui::RadioButton("Fused", &currentSpringKernel, 2);
 
     ImGui::Text("%s", "-------------------- Drawing Config --------------------");
     renderColorPanel();
     renderDrawingTypes();
+    ImGui::Text("%s", "---------------------- Trajectory ----------------------");
+    renderTimeline();
     ImGui::Text("%s", "-------------------- Miscellaneous ---------------------");
-    if ((isStateSwitched = ImGui::Button(isPaused ? "Start" : "Stop"))) isPaused = !isPaused;
+    if ((isStateSwitched = ImGui::Button(isPaused ? "Start" : "Stop"))) {
+      isPaused = !isPaused;
+      timelineFrame = -1;
+    }
+    ImGui::SameLine();
+    isSavingCheckpoint = ImGui::Button("Save checkpoint");
+    ImGui::SameLine();
+    isLoadingCheckpoint = ImGui::Button("Load checkpoint");
     ImGui::Text("Current framerate: %.0f", ImGui::GetIO().Framerate);
+    ImGui::SameLine();
+    ImGui::Checkbox("Profiler", &isProfiling);
+    ImGui::Text("Simulation: %.0f steps/s (%.2fx real time)", simulationStepsPerSecond,
+                simulationStepsPerSecond * deltaTime);
+    if (isSleepingEnabled) ImGui::Text("Active particles: %d of %d", activeClothParticles, clothParticleCount);
   }
   ImGui::End();
 }
@@ -111,6 +224,7 @@ void GUI::render() {
   ImGui_ImplGlfw_NewFrame();
   ImGui::NewFrame();
   renderMainPanel();
+  renderProfilerPanel();
   ImGui::Render();
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
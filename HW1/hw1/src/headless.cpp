@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "checkpoint.h"
+#include "cloth.h"
+#include "configs.h"
+#include "integrator.h"
+#include "profiler.h"
+#include "scene.h"
+#include "sphere.h"
+#include "threadpool.h"
+#include "trajectorycache.h"
+
+namespace {
+struct Options {
+  int steps = 10000;
+  int integrator = 0;
+  int particlesPerEdge = 0;
+  int instances = 0;
+  Scene scene;
+  std::string loadFile;
+  std::string saveFile;
+  std::string recordFile;
+  int recordEvery = 40;
+  std::string traceFile;
+};
+
+void printUsage(const char* program) {
+  std::cerr << "Usage: " << program << " [options]\n"
+            << "  --steps N            Number of simulation steps (default 10000)\n"
+            << "  --scene FILE         Scene file (default: built-in scene, same as assets/scene.txt)\n"
+            << "  --size N             Override cloth particles per edge\n"
+            << "  --instances N        Simulate N copies of the cloth and spheres side by side in one batch\n"
+            << "  --integrator NAME    explicit | implicit | midpoint | rk4 | backward | adaptive | xpbd | pd\n"
+            << "                       (default explicit)\n"
+            << "  --threads N          Simulation threads, 0 uses all hardware threads (default 1)\n"
+            << "  --spring-kernel NAME scalar | simd | fused (default scalar)\n"
+            << "  --self-collision on|off\n"
+            << "                       Cloth self-collision (default off)\n"
+            << "  --ccd on|off         Swept sphere against cloth triangles (default off)\n"
+            << "  --sleep on|off       Stop simulating cloth regions once they settle (default off)\n"
+            << "  --sleep-velocity V   Speed below which a cloth region counts as settled (default " << sleepVelocity
+            << ")\n"
+            << "  --dt SECONDS         Simulation time step (default " << deltaTime << ")\n"
+            << "  --spring COEF        Spring coefficient (default " << springCoef << ")\n"
+            << "  --damper COEF        Damper coefficient (default " << damperCoef << ")\n"
+            << "  --stiffness S,H,B    Structural, shear and bend stiffness relative to --spring (default 1,1,1)\n"
+            << "  --tolerance TOL      Local error tolerance of adaptive (default " << adaptiveTolerance << ")\n"
+            << "  --iterations N       Constraint iterations per step of xpbd and pd (default " << constraintIterations << ")\n"
+            << "  --load FILE          Resume from a checkpoint, its cloth, spheres, --dt and coefficients replace the options\n"
+            << "  --save FILE          Write a checkpoint after the last step\n"
+            << "  --record FILE        Record the trajectory to a cache file\n"
+            << "  --record-every N     Steps between recorded frames and sleep checks (default 40)\n"
+            << "  --trace FILE         Write the forces, collisions and integration as Chrome trace JSON\n";
+}
+
+int parseIntegrator(const std::string& name) {
+  if (name == "explicit") return 0;
+  if (name == "implicit") return 1;
+  if (name == "midpoint") return 2;
+  if (name == "rk4") return 3;
+  if (name == "backward") return 4;
+  if (name == "adaptive") return 5;
+  if (name == "xpbd") return 6;
+  if (name == "pd") return 7;
+  return -1;
+}
+
+Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value for " << arg << std::endl;
+      printUsage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    std::string value = argv[++i];
+    if (arg == "--steps") {
+      options.steps = std::max(0, std::atoi(value.c_str()));
+    } else if (arg == "--scene") {
+      if (!options.scene.load(value)) exit(EXIT_FAILURE);
+    } else if (arg == "--size") {
+      options.particlesPerEdge = std::atoi(value.c_str());
+      if (options.particlesPerEdge < 3) {
+        std::cerr << "Cloth needs at least 3 particles per edge" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    } else if (arg == "--instances") {
+      options.instances = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--integrator") {
+      options.integrator = parseIntegrator(value);
+      if (options.integrator < 0) {
+        std::cerr << "Unknown integrator " << value << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    } else if (arg == "--threads") {
+      simulationThreads = std::atoi(value.c_str());
+      if (simulationThreads < 1) simulationThreads = static_cast<int>(std::thread::hardware_concurrency());
+      simulationThreads = std::max(1, simulationThreads);
+    } else if (arg == "--spring-kernel") {
+      if (value == "scalar") {
+        currentSpringKernel = 0;
+      } else if (value == "simd") {
+        currentSpringKernel = 1;
+      } else if (value == "fused") {
+        currentSpringKernel = 2;
+      } else {
+        std::cerr << "Unknown spring kernel " << value << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    } else if (arg == "--self-collision") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--self-collision takes on or off" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      isSelfColliding = value == "on";
+    } else if (arg == "--ccd") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--ccd takes on or off" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      isUsingContinuousCollision = value == "on";
+    } else if (arg == "--sleep") {
+      if (value != "on" && value != "off") {
+        std::cerr << "--sleep takes on or off" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      isSleepingEnabled = value == "on";
+    } else if (arg == "--sleep-velocity") {
+      sleepVelocity = std::max(0.0f, std::strtof(value.c_str(), nullptr));
+    } else if (arg == "--dt") {
+      deltaTime = std::max(0.0f, std::strtof(value.c_str(), nullptr));
+    } else if (arg == "--spring") {
+      springCoef = std::max(0.0f, std::strtof(value.c_str(), nullptr));
+    } else if (arg == "--damper") {
+      damperCoef = std::max(0.0f, std::strtof(value.c_str(), nullptr));
+    } else if (arg == "--stiffness") {
+      const char* next = value.c_str();
+      for (float& stiffness : springStiffness) {
+        char* end = nullptr;
+        stiffness = std::max(0.0f, std::strtof(next, &end));
+        if (end == next) {
+          std::cerr << "--stiffness takes three comma separated numbers" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        next = *end == ',' ? end + 1 : end;
+      }
+    } else if (arg == "--tolerance") {
+      adaptiveTolerance = std::max(1e-8f, std::strtof(value.c_str(), nullptr));
+    } else if (arg == "--iterations") {
+      constraintIterations = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--load") {
+      options.loadFile = value;
+    } else if (arg == "--save") {
+      options.saveFile = value;
+    } else if (arg == "--record") {
+      options.recordFile = value;
+    } else if (arg == "--record-every") {
+      options.recordEvery = std::max(1, std::atoi(value.c_str()));
+    } else if (arg == "--trace") {
+      options.traceFile = value;
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      printUsage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (options.particlesPerEdge > 0) options.scene.particlesPerEdge = options.particlesPerEdge;
+  if (options.instances > 0) {
+    // Copies along x with a gap of half a cloth width, each with its own spheres
+    Scene& scene = options.scene;
+    std::vector<Eigen::Vector4f> spherePositions;
+    std::vector<float> sphereRadius;
+    scene.clothOffsets.clear();
+    for (int k = 0; k < options.instances; ++k) {
+      Eigen::Vector4f offset(2.5f * scene.clothWidth * k, 0.0f, 0.0f, 0.0f);
+      scene.clothOffsets.push_back(offset);
+      for (size_t i = 0; i < scene.spherePositions.size(); ++i) {
+        spherePositions.push_back(scene.spherePositions[i] + offset);
+        sphereRadius.push_back(scene.sphereRadius[i]);
+      }
+    }
+    scene.spherePositions = std::move(spherePositions);
+    scene.sphereRadius = std::move(sphereRadius);
+  }
+  if (!options.loadFile.empty()) {
+    // The cloth is created with the size of the checkpoint
+    CheckpointHeader header;
+    if (!readCheckpointHeader(options.loadFile, header)) exit(EXIT_FAILURE);
+    options.scene.particlesPerEdge = header.particlesPerEdge;
+    // Positions come from the checkpoint, only the number of instances matters
+    options.scene.clothOffsets.assign(header.instanceCount, Eigen::Vector4f::Zero());
+    options.scene.clothWidth = header.clothWidth;
+    options.scene.clothHeight = header.clothHeight;
+  }
+  return options;
+}
+
+// Sum of all components, easy to eyeball between runs.
+double checksum(const Eigen::Ref<const Eigen::Matrix4Xf>& m) { return m.cast<double>().sum(); }
+
+// FNV-1a over the raw bytes, changes on any bitwise difference.
+uint64_t bitwiseHash(const Eigen::Ref<const Eigen::Matrix4Xf>& m) {
+  uint64_t hash = 14695981039346656037ull;
+  const auto* bytes = reinterpret_cast<const unsigned char*>(m.data());
+  for (size_t i = 0; i < m.size() * sizeof(float); ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void printState(const char* name, Particles& particles) {
+  std::cout << name << " position sum: " << checksum(particles.position())
+            << " velocity sum: " << checksum(particles.velocity()) << " hash: " << std::hex
+            << bitwiseHash(particles.position()) << std::dec << std::endl;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options = parseOptions(argc, argv);
+  ThreadPool::getPool().resize(simulationThreads);
+
+  const Scene& scene = options.scene;
+  Cloth cloth(scene.particlesPerEdge, scene.clothWidth, scene.clothHeight, scene.clothOffsets);
+  Spheres& spheres = Spheres::initSpheres();
+  for (size_t i = 0; i < scene.spherePositions.size(); ++i) spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
+  // Steps taken before this run
+  int64_t initialSteps = 0;
+  if (!options.loadFile.empty()) {
+    CheckpointHeader header;
+    auto loadStart = std::chrono::steady_clock::now();
+    if (!loadCheckpoint(options.loadFile, cloth, spheres, &header)) return EXIT_FAILURE;
+    auto loadEnd = std::chrono::steady_clock::now();
+    initialSteps = header.steps;
+    std::cout << "Resumed from " << options.loadFile << " at step " << initialSteps << " in "
+              << std::chrono::duration<double, std::milli>(loadEnd - loadStart).count() << " ms" << std::endl;
+  }
+  // Same as the viewer
+  auto simulateOneStep = [&]() {
+    {
+      ScopedTimer timer(ProfilePhase::FORCES);
+      cloth.computeForces();
+      spheres.computeExternalForce();
+    }
+    ScopedTimer timer(ProfilePhase::COLLISIONS);
+    spheres.collide(&cloth);
+    spheres.collide();
+    if (isSelfColliding) cloth.collide();
+  };
+
+  ExplicitEuler explicitEuler;
+  ImplicitEuler implicitEuler;
+  MidpointEuler midpointEuler;
+  RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  BogackiShampine bogackiShampine;
+  ExtendedPositionBasedDynamics xpbd(cloth);
+  ProjectiveDynamics projectiveDynamics(cloth);
+  const Integrator* integrators[] = {&explicitEuler, &implicitEuler,   &midpointEuler, &rk4,
+                                     &backwardEuler, &bogackiShampine, &xpbd,          &projectiveDynamics};
+  const char* integratorNames[] = {"Explicit Euler",      "Implicit Euler",
+                                   "Midpoint Euler",      "Runge Kutta Fourth",
+                                   "Backward Euler (CG)", "Bogacki Shampine (adaptive)",
+                                   "XPBD",                "Projective Dynamics"};
+  const Integrator* integrator = integrators[options.integrator];
+
+  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
+  int particleCount = cloth.particles().getCapacity() + spheres.count();
+  // position, velocity, acceleration and mass
+  size_t particleBytes = (cloth.particles().getCapacity() + spheres.particles().getCapacity()) * (12 + 1) * sizeof(float);
+  size_t springBytes = cloth.springMemoryBytes();
+
+  std::cout << "Integrator: " << integratorNames[options.integrator] << "\n"
+            << "Particles: " << particleCount << " (cloth " << cloth.instanceCount() << " x " << cloth.particlesPerEdge()
+            << "x" << cloth.particlesPerEdge() << ", spheres " << spheres.count() << ")\n"
+            << "Springs: " << cloth.springs().size() << ", kernel: "
+            << (currentSpringKernel == 1   ? SpringArray::kernelName()
+                : currentSpringKernel == 2 ? "Fused with external forces (SoA tiles)"
+                                           : "Scalar (AoS)")
+            << "\n"
+            << "Memory: " << (particleBytes + springBytes) / 1024 << " KiB (particles " << particleBytes / 1024
+            << " KiB, springs " << springBytes / 1024 << " KiB)\n"
+            << "Threads: " << ThreadPool::getPool().size() << "\n"
+            << "Steps: " << options.steps << ", deltaTime: " << deltaTime << std::endl;
+
+  TrajectoryCache trajectory;
+  if (!options.recordFile.empty() &&
+      !trajectory.create(options.recordFile, cloth.particles().getCapacity(), spheres.count()))
+    return EXIT_FAILURE;
+  // Encoding and writing frames is timed on its own, so that recording does not change steps/sec
+  std::chrono::steady_clock::duration recordTime{};
+  auto record = [&]() {
+    auto recordStart = std::chrono::steady_clock::now();
+    trajectory.append(cloth.particles().position(), spheres.particles().position().leftCols(spheres.count()));
+    recordTime += std::chrono::steady_clock::now() - recordStart;
+  };
+
+  // One trace event per call, sleeping is decided at the end of it
+  auto simulate = [&](int steps) {
+    {
+      ScopedTimer timer(ProfilePhase::INTEGRATION);
+      integrateSubsteps(*integrator, particles, simulateOneStep, steps);
+    }
+    if (isSleepingEnabled) cloth.updateSleeping(steps);
+  };
+
+  Profiler& profiler = Profiler::getProfiler();
+  if (!options.traceFile.empty()) {
+    profiler.setEnabled(true);
+    profiler.setThreadName("Simulation");
+    profiler.setTracing(true);
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (trajectory.isOpen() || isSleepingEnabled) {
+    // Batches of recordEvery steps, the adaptive integrator ends a step at the end of every batch. Tracing does not
+    // change them, the forces and collisions of every step are traced on their own.
+    if (trajectory.isOpen()) record();
+    for (int done = 0; done < options.steps; done += options.recordEvery) {
+      simulate(std::min(options.recordEvery, options.steps - done));
+      if (trajectory.isOpen()) record();
+    }
+  } else {
+    simulate(options.steps);
+  }
+  auto simulated = std::chrono::steady_clock::now() - start - recordTime;
+
+  double seconds = std::chrono::duration<double>(simulated).count();
+  double nanoseconds = std::chrono::duration<double, std::nano>(simulated).count();
+  std::cout << std::fixed << std::setprecision(3) << "Elapsed: " << seconds << " s\n"
+            << "Steps/sec: " << (seconds > 0 ? options.steps / seconds : 0.0) << "\n"
+            << "ns/particle-step: "
+            << (options.steps > 0 ? nanoseconds / (static_cast<double>(options.steps) * particleCount) : 0.0)
+            << std::endl;
+  std::cout << std::setprecision(6);
+  if (integrator == &bogackiShampine) {
+    std::cout << "Adaptive steps: " << bogackiShampine.acceptedSteps() << " accepted, "
+              << bogackiShampine.rejectedSteps() << " rejected, next step size: " << bogackiShampine.stepSize()
+              << std::endl;
+  }
+  if (integrator == &xpbd) {
+    std::cout << "Constraint iterations: " << constraintIterations << ", max strain: " << xpbd.maxStrain()
+              << std::endl;
+  }
+  if (integrator == &projectiveDynamics) {
+    std::cout << "Local / global iterations: " << constraintIterations
+              << ", factorizations: " << projectiveDynamics.factorizationCount() << std::endl;
+  }
+  if (integrator == &backwardEuler) {
+    std::cout << "CG iterations (last step): " << backwardEuler.iterations() << ", residual: " << backwardEuler.error()
+              << std::endl;
+  }
+  if (isSelfColliding) {
+    std::cout << "Self-collision thickness: " << cloth.selfCollisionThickness()
+              << ", contacts (last step): " << cloth.selfContactCount() << std::endl;
+  }
+  if (isSleepingEnabled) {
+    std::cout << "Active particles: " << cloth.activeParticleCount() << " of " << cloth.particles().getCapacity()
+              << std::endl;
+  }
+  printState("Cloth", cloth.particles());
+  printState("Spheres", spheres.particles());
+  if (trajectory.isOpen()) {
+    size_t rawBytes = static_cast<size_t>(trajectory.frameCount()) * (particleCount * 3 * sizeof(float));
+    std::cout << "Recorded " << trajectory.frameCount() << " frames (" << trajectory.keyframeCount()
+              << " keyframes) to " << options.recordFile << ": " << trajectory.bytes() / 1024 << " KiB, "
+              << rawBytes / 1024 << " KiB as float xyz, "
+              << std::chrono::duration<double, std::milli>(recordTime).count() << " ms not included in steps/sec"
+              << std::endl;
+    trajectory.close();
+  }
+  if (!options.traceFile.empty()) {
+    // The whole run as one frame
+    profiler.endFrame();
+    int frame = (profiler.historyOffset() + Profiler::historySize - 1) % Profiler::historySize;
+    std::cout << "Phase times (ms):";
+    for (auto phase : {ProfilePhase::FORCES, ProfilePhase::COLLISIONS, ProfilePhase::INTEGRATION})
+      std::cout << " " << Profiler::phaseName(phase) << " " << profiler.history(phase)[frame];
+    std::cout << std::endl;
+    if (!profiler.saveTrace(options.traceFile)) return EXIT_FAILURE;
+    std::cout << "Trace of " << profiler.traceEventCount() << " events written to " << options.traceFile << std::endl;
+  }
+  if (!options.saveFile.empty()) {
+    if (!saveCheckpoint(options.saveFile, cloth, spheres, initialSteps + options.steps)) return EXIT_FAILURE;
+    std::cout << "Checkpoint written to " << options.saveFile << " at step " << initialSteps + options.steps
+              << std::endl;
+  }
+  return 0;
+}
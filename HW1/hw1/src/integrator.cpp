@@ -1,197 +1,467 @@
 #include "integrator.h"
 
+#include <algorithm>
+#include <cmath>
+
+#include "cloth.h"
 #include "configs.h"
+#include "threadpool.h"
 
-struct tempState {
-  Eigen::Matrix4Xf acceleration;
-  Eigen::Matrix4Xf velocity;
-  Eigen::Matrix4Xf position;
-};
-
-void ExplicitEuler::integrate(const std::vector<Particles *> &particles, std::function<void(void)>) const {
-  // TODO: Integrate velocity and acceleration
-  //   1. Integrate velocity.
-  //   2. Integrate acceleration.
-  //   3. You should not compute position using acceleration. Since some part only update velocity. (e.g. impulse)
-  // Note:
-  //   1. You don't need the simulation function in explicit euler.
-  //   2. You should do this first because it is very simple. Then you can chech your collision is correct or not.
-  //   3. This can be done in 2 lines. (Hint: You can add / multiply all particles at once since it is a large matrix.)
-  for (const auto &p : particles) {
-    p->velocity() += deltaTime * p->acceleration();
-    p->position() += deltaTime * p->velocity(); 
+bool setSpringForceEnabled(Cloth &cloth, bool enabled) {
+  bool previous = cloth.springForceEnabled();
+  cloth.springForceEnabled() = enabled;
+  return previous;
+}
+
+template <class P>
+void IntegratorScratch::reserve(const std::vector<P *> &particles, int slots) {
+  Slots<typename P::Matrix> &layout = std::get<Slots<typename P::Matrix>>(layouts);
+  int setCount = static_cast<int>(particles.size());
+  if (slots != layout.slotsPerSet || static_cast<int>(layout.columns.size()) < setCount) {
+    layout.slotsPerSet = slots;
+    layout.columns.resize(setCount);
+    layout.storage.resize(static_cast<size_t>(setCount) * slots);
+    ++_growCount;
+  }
+  for (int i = 0; i < setCount; ++i) {
+    layout.columns[i] = particles[i]->getCapacity();
+    for (int j = 0; j < slots; ++j) {
+      typename P::Matrix &matrix = layout.storage[i * slots + j];
+      if (matrix.cols() < layout.columns[i]) {
+        matrix.resize(P::width, layout.columns[i]);
+        ++_growCount;
+      }
+    }
   }
 }
 
-void ImplicitEuler::integrate(const std::vector<Particles *> &particles,
-                              std::function<void(void)> simulateOneStep) const {
-  // TODO: Integrate velocity and acceleration
-  //   1. Backup original particles' data.
-  //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
-  //   3. Compute refined Xn+1 using (1.) and (2.).
-  // Note:
-  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
+template void IntegratorScratch::reserve(const std::vector<Particles *> &, int);
+template void IntegratorScratch::reserve(const std::vector<PackedParticles *> &, int);
+template void IntegratorScratch::reserve(const std::vector<DoubleParticles *> &, int);
 
-  std::vector<tempState> origin;
-  for (const auto &p : particles) {
-    tempState o;
-    o.velocity = p->velocity();
-    o.position = p->position();
-    Eigen::Matrix4Xf euler_velocity = deltaTime * p->acceleration();
-    Eigen::Matrix4Xf euler_position = deltaTime * p->velocity();
-    p->velocity() += euler_velocity ;
-    p->position() += euler_position ;
-    origin.push_back(o);
-  }
-  simulateOneStep();
-
-  int i = 0;
-  for (const auto &p : particles) {
-    p->velocity() = origin[i].velocity + deltaTime * p->acceleration();
-    p->position() = origin[i].position + deltaTime * p->velocity();
-    i++;
+void BackwardEuler::buildPattern() const {
+  const std::vector<Spring> &springs = cloth.springs();
+  int particleCount = cloth.particles().getCapacity();
+  int dimension = 3 * particleCount;
+
+  std::vector<Eigen::Triplet<float>> pattern;
+  pattern.reserve(9 * (particleCount + 2 * springs.size()));
+  auto addBlock = [&pattern](int row, int column) {
+    for (int c = 0; c < 3; ++c)
+      for (int r = 0; r < 3; ++r) pattern.emplace_back(3 * row + r, 3 * column + c, 0.0f);
+  };
+  for (int i = 0; i < particleCount; ++i) addBlock(i, i);
+  for (const auto &spring : springs) {
+    addBlock(spring.startParticleIndex(), spring.endParticleIndex());
+    addBlock(spring.endParticleIndex(), spring.startParticleIndex());
   }
+  systemMatrix.resize(dimension, dimension);
+  systemMatrix.setFromTriplets(pattern.begin(), pattern.end());
+  systemMatrix.makeCompressed();
+
+  // Blocks are dense, so the 3 rows of a block are adjacent in each of its columns
+  auto blockOffset = [this](int row, int column, int *offset) {
+    for (int c = 0; c < 3; ++c) {
+      const int *begin = systemMatrix.innerIndexPtr() + systemMatrix.outerIndexPtr()[3 * column + c];
+      const int *end = systemMatrix.innerIndexPtr() + systemMatrix.outerIndexPtr()[3 * column + c + 1];
+      offset[c] = static_cast<int>(std::lower_bound(begin, end, 3 * row) - systemMatrix.innerIndexPtr());
+    }
+  };
+  diagonalOffset.resize(3 * particleCount);
+  for (int i = 0; i < particleCount; ++i) blockOffset(i, i, &diagonalOffset[3 * i]);
+  springOffset.resize(6 * springs.size());
+  for (size_t i = 0; i < springs.size(); ++i) {
+    blockOffset(springs[i].startParticleIndex(), springs[i].endParticleIndex(), &springOffset[6 * i]);
+    blockOffset(springs[i].endParticleIndex(), springs[i].startParticleIndex(), &springOffset[6 * i + 3]);
+  }
+
+  rightHandSide.resize(dimension);
+  deltaVelocity.setZero(dimension);
+  inverseDiagonal.resize(dimension);
+  residual.resize(dimension);
+  direction.resize(dimension);
+  preconditioned.resize(dimension);
+  product.resize(dimension);
+  patternParticles = particleCount;
+  patternSprings = static_cast<int>(springs.size());
 }
 
-void MidpointEuler::integrate(const std::vector<Particles *> &particles,
-                              std::function<void(void)> simulateOneStep) const {
-  // TODO: Integrate velocity and acceleration
-  //   1. Backup original particles' data.
-  //   2. Integrate velocity and acceleration using explicit euler to get Xn+1.
-  //   3. Compute refined Xn+1 using (1.) and (2.).
-  // Note:
-  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
+void BackwardEuler::solveCloth(Particles &particles) const {
+  const std::vector<Spring> &springs = cloth.springs();
+  if (patternParticles != particles.getCapacity() || patternSprings != static_cast<int>(springs.size())) buildPattern();
+  int particleCount = patternParticles;
+  float h = deltaTime;
+  float *values = systemMatrix.valuePtr();
+  auto addBlock = [values](const int *offset, const Eigen::Matrix3f &block) {
+    for (int c = 0; c < 3; ++c)
+      for (int r = 0; r < 3; ++r) values[offset[c] + r] += block(r, c);
+  };
 
-  std::vector<tempState> v;
-  for (const auto &p : particles) {
-    tempState t;
-    t.velocity = p->velocity();
-    t.position = p->position();
-    v.push_back(t);
-    Eigen::Matrix4Xf euler_velocity = deltaTime * p->acceleration();
-    Eigen::Matrix4Xf euler_position = deltaTime * p->velocity();
-    p->velocity() += euler_velocity / 2;
-    p->position() += euler_position / 2;
-  }
-  simulateOneStep();
-
-  int i = 0;
+  // M and h * f, fixed particles (mass 0) get an identity row so that their velocity change is 0
+  std::fill(values, values + systemMatrix.nonZeros(), 0.0f);
+  for (int i = 0; i < particleCount; ++i) {
+    float mass = particles.mass(i);
+    addBlock(&diagonalOffset[3 * i], Eigen::Matrix3f::Identity() * (mass == 0.0f ? 1.0f : mass));
+    rightHandSide.segment<3>(3 * i) = h * mass * particles.acceleration(i).head<3>();
+  }
+
+  // Each spring adds J = -h * df/dv - h^2 * df/dx to the diagonal blocks and -J to the off-diagonal ones,
+  // and h^2 * df/dx * v to the right hand side. Sleeping particles have no force and are fixed, so their rows are M.
+  auto addSpring = [&](int s) {
+    int start = springs[s].startParticleIndex();
+    int end = springs[s].endParticleIndex();
+    Eigen::Vector3f difference = (particles.position(start) - particles.position(end)).head<3>();
+    float length = difference.norm();
+    if (length == 0.0f) return;
+    Eigen::Vector3f direction = difference / length;
+    Eigen::Matrix3f outer = direction * direction.transpose();
+    float stiffness = springCoef * springStiffness[static_cast<int>(springs[s].type())];
+    // Drop the transverse term of compressed springs, it is indefinite and CG needs a positive definite matrix
+    float transverse = std::max(0.0f, 1.0f - springs[s].length() / length);
+    Eigen::Matrix3f forceJacobian = -stiffness * (outer + transverse * (Eigen::Matrix3f::Identity() - outer));
+    Eigen::Matrix3f block = (h * damperCoef) * outer - (h * h) * forceJacobian;
+
+    Eigen::Vector3f relativeVelocity = (particles.velocity(start) - particles.velocity(end)).head<3>();
+    Eigen::Vector3f velocityTerm = (h * h) * (forceJacobian * relativeVelocity);
+    bool startFree = particles.mass(start) != 0.0f && !cloth.isSleeping(start);
+    bool endFree = particles.mass(end) != 0.0f && !cloth.isSleeping(end);
+    if (startFree) {
+      addBlock(&diagonalOffset[3 * start], block);
+      rightHandSide.segment<3>(3 * start) += velocityTerm;
+    }
+    if (endFree) {
+      addBlock(&diagonalOffset[3 * end], block);
+      rightHandSide.segment<3>(3 * end) -= velocityTerm;
+    }
+    if (startFree && endFree) {
+      addBlock(&springOffset[6 * s], -block);
+      addBlock(&springOffset[6 * s + 3], -block);
+    }
+  };
+  // With every island awake this is every spring in storage order
+  const std::vector<int> &colorOffsets = cloth.springColorOffsets();
+  for (int color = 0; color + 1 < static_cast<int>(colorOffsets.size()); ++color) {
+    for (const auto &[first, last] : particles.activeRanges()) {
+      auto [firstSpring, lastSpring] = cloth.springRange(color, first, last);
+      for (int s = firstSpring; s < lastSpring; ++s) addSpring(s);
+    }
+  }
+  // The initial guess of sleeping rows is already their solution
+  int next = 0;
+  for (const auto &[first, last] : particles.activeRanges()) {
+    deltaVelocity.segment(3 * next, 3 * (first - next)).setZero();
+    next = last;
+  }
+  deltaVelocity.segment(3 * next, 3 * (particleCount - next)).setZero();
+
+  conjugateGradient();
+
+  for (const auto &[first, last] : particles.activeRanges()) {
+    for (int i = first; i < last; ++i) particles.velocity(i).head<3>() += deltaVelocity.segment<3>(3 * i);
+  }
+  forEachActiveRange(particles,
+                     [&](auto columns) { columns(particles.position()) += deltaTime * columns(particles.velocity()); });
+}
+
+void BackwardEuler::conjugateGradient() const {
+  constexpr float tolerance = 1e-4f;
+  constexpr int maxIterations = 200;
+  const float *values = systemMatrix.valuePtr();
+  for (int i = 0; i < patternParticles; ++i) {
+    for (int c = 0; c < 3; ++c) inverseDiagonal[3 * i + c] = 1.0f / values[diagonalOffset[3 * i + c] + c];
+  }
+  float rightHandSideNorm = rightHandSide.squaredNorm();
+  if (rightHandSideNorm == 0.0f) {
+    deltaVelocity.setZero();
+    _iterations = 0;
+    _error = 0.0f;
+    return;
+  }
+  float threshold = tolerance * tolerance * rightHandSideNorm;
+
+  product.noalias() = systemMatrix * deltaVelocity;
+  residual = rightHandSide - product;
+  preconditioned = inverseDiagonal.cwiseProduct(residual);
+  direction = preconditioned;
+  float residualDotPreconditioned = residual.dot(preconditioned);
+  int iteration = 0;
+  for (; iteration < maxIterations && residual.squaredNorm() > threshold; ++iteration) {
+    product.noalias() = systemMatrix * direction;
+    float alpha = residualDotPreconditioned / direction.dot(product);
+    deltaVelocity += alpha * direction;
+    residual -= alpha * product;
+    preconditioned = inverseDiagonal.cwiseProduct(residual);
+    float previous = residualDotPreconditioned;
+    residualDotPreconditioned = residual.dot(preconditioned);
+    direction = preconditioned + (residualDotPreconditioned / previous) * direction;
+  }
+  _iterations = iteration;
+  _error = std::sqrt(residual.squaredNorm() / rightHandSideNorm);
+}
+
+void BackwardEuler::advance(const std::vector<Particles *> &particles) const {
   for (const auto &p : particles) {
-    p->velocity() = v[i].velocity + deltaTime * p->acceleration();
-    p->position() = v[i].position + deltaTime * v[i].velocity; 
-    i++;
+    if (p == &cloth.particles()) {
+      solveCloth(*p);
+    } else {
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(p->velocity()) += deltaTime * columns(p->acceleration());
+        columns(p->position()) += deltaTime * columns(p->velocity());
+      });
+    }
   }
 }
 
-void RungeKuttaFourth::integrate(const std::vector<Particles *> &particles,
-                                 std::function<void(void)> simulateOneStep) const {
-  // TODO: Integrate velocity and acceleration
-  //   1. Backup original particles' data.
-  //   2. Compute k1, k2, k3, k4
-  //   3. Compute refined Xn+1 using (1.) and (2.).
-  // Note:
-  //   1. Use simulateOneStep with modified position and velocity to get Xn+1.
-
-    /*std::vector<tempState> origin, vk1, vk2, vk3, vk4;
-    for (const auto &p : particles) {
-    tempState o, k1, k2;
-    o.velocity = p->velocity();
-    o.position = p->position();
-    k1.acceleration = deltaTime * p->acceleration();
-    k1.velocity = deltaTime * p->velocity();
-    p->velocity() = p->velocity() + deltaTime * p->acceleration() / 2;
-    p->position() = p->position() + deltaTime * p->velocity() / 2;
-    k2.velocity = deltaTime * p->velocity();
-
-    origin.push_back(o);
-    vk1.push_back(k1);
-    vk2.push_back(k2);
+void ExtendedPositionBasedDynamics::projectSprings(Particles &particles, int first, int last) const {
+  const std::vector<Spring> &springs = cloth.springs();
+  const Eigen::Matrix4Xf &previous = previousPosition;
+  float h = deltaTime;
+  for (int s = first; s < last; ++s) {
+    int start = springs[s].startParticleIndex();
+    int end = springs[s].endParticleIndex();
+    // Sleeping particles at the edge of an active range do not move
+    float startWeight = cloth.isSleeping(start) ? 0.0f : particles.inverseMass(start);
+    float endWeight = cloth.isSleeping(end) ? 0.0f : particles.inverseMass(end);
+    float stiffness = springCoef * springStiffness[static_cast<int>(springs[s].type())];
+    if (startWeight + endWeight == 0.0f || stiffness == 0.0f) continue;
+    Eigen::Vector3f difference = (particles.position(start) - particles.position(end)).head<3>();
+    float length = difference.norm();
+    if (length == 0.0f) continue;
+    Eigen::Vector3f direction = difference / length;
+    // alpha~ = compliance / h^2 and gamma = alpha~ * beta~ / h with beta~ = h^2 * damperCoef
+    float compliance = 1.0f / (stiffness * h * h);
+    float damping = damperCoef / (stiffness * h);
+    float relativeMotion =
+        direction.dot((particles.position(start) - previous.col(start) - particles.position(end) + previous.col(end))
+                          .head<3>());
+    float deltaLambda = (-(length - springs[s].length()) - compliance * lambda[s] - damping * relativeMotion) /
+                        ((1.0f + damping) * (startWeight + endWeight) + compliance);
+    lambda[s] += deltaLambda;
+    particles.position(start).head<3>() += (startWeight * deltaLambda) * direction;
+    particles.position(end).head<3>() -= (endWeight * deltaLambda) * direction;
+  }
+}
+
+void ExtendedPositionBasedDynamics::solveCloth(Particles &particles) const {
+  const std::vector<int> &colorOffsets = cloth.springColorOffsets();
+  int colorCount = static_cast<int>(colorOffsets.size()) - 1;
+  const auto &activeRanges = particles.activeRanges();
+  lambda.assign(cloth.springs().size(), 0.0f);
+  // Fixed particles have zero acceleration, so their velocity and position do not change. Sleeping ones are skipped.
+  previousPosition.resize(4, particles.getCapacity());
+  forEachActiveRange(particles, [&](auto columns) {
+    columns(previousPosition) = columns(particles.position());
+    columns(particles.velocity()) += deltaTime * columns(particles.acceleration());
+    columns(particles.position()) += deltaTime * columns(particles.velocity());
+  });
+
+  ThreadPool &pool = ThreadPool::getPool();
+  if (pool.size() == 1) {
+    for (int iteration = 0; iteration < constraintIterations; ++iteration) {
+      for (int color = 0; color < colorCount; ++color) {
+        for (const auto &[first, last] : activeRanges) {
+          auto [firstSpring, lastSpring] = cloth.springRange(color, first, last);
+          projectSprings(particles, firstSpring, lastSpring);
+        }
+      }
     }
-    simulateOneStep();
-    int i =  0;
-    for (const auto &p : particles) {
-    tempState k3;
-    vk2[i].acceleration = deltaTime * p->acceleration();
-    p->velocity() = origin[i].velocity + vk2[i].acceleration / 2;
-    p->position() = origin[i].position + vk2[i].velocity / 2;
-    i++;
-    k3.velocity = deltaTime * p->velocity();
-    vk3.push_back(k3);
+  } else {
+    pool.run([&](int threadIndex) {
+      for (int iteration = 0; iteration < constraintIterations; ++iteration) {
+        for (int color = 0; color < colorCount; ++color) {
+          for (const auto &[first, last] : activeRanges) {
+            auto [firstSpring, lastSpring] = cloth.springRange(color, first, last);
+            auto [threadFirst, threadLast] = pool.range(firstSpring, lastSpring, threadIndex);
+            projectSprings(particles, threadFirst, threadLast);
+          }
+          pool.barrier();
+        }
+      }
+    });
+  }
+  forEachActiveRange(particles, [&](auto columns) {
+    columns(particles.velocity()) = (columns(particles.position()) - columns(previousPosition)) / deltaTime;
+  });
+}
+
+void ExtendedPositionBasedDynamics::advance(const std::vector<Particles *> &particles) const {
+  // Only needed through integrate(), integrateSubsteps turns the spring forces off
+  if (cloth.springForceEnabled()) cloth.computeExternalForce();
+  for (const auto &p : particles) {
+    if (p == &cloth.particles()) {
+      solveCloth(*p);
+    } else {
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(p->velocity()) += deltaTime * columns(p->acceleration());
+        columns(p->position()) += deltaTime * columns(p->velocity());
+      });
     }
-    simulateOneStep();
-    i = 0;
-    for (const auto &p : particles) {
-    tempState k4;
-    vk3[i].acceleration = deltaTime * p->acceleration();
-    p->velocity() = origin[i].velocity + vk3[i].acceleration;
-    p->position() = origin[i].position + vk3[i].velocity;
-    i++;
-    k4.velocity = deltaTime * p->velocity();
-    vk4.push_back(k4);
+  }
+}
+
+float ExtendedPositionBasedDynamics::maxStrain() const {
+  Particles &particles = cloth.particles();
+  float strain = 0.0f;
+  for (const auto &spring : cloth.springs()) {
+    float length = (particles.position(spring.startParticleIndex()) - particles.position(spring.endParticleIndex())).norm();
+    strain = std::max(strain, std::abs(length - spring.length()) / spring.length());
+  }
+  return strain;
+}
+
+ProjectiveDynamics::ProjectiveDynamics(Cloth &cloth) :
+    cloth(cloth),
+    factoredSpringCoef(0.0f),
+    factoredDamperCoef(0.0f),
+    factoredDeltaTime(0.0f),
+    factoredStiffness{},
+    factoredSprings(-1),
+    _factorizationCount(0) {}
+
+void ProjectiveDynamics::factorize() const {
+  const std::vector<Spring> &springs = cloth.springs();
+  const std::array<float, 3> &stiffness = springStiffness;
+  Particles &particles = cloth.particles();
+  if (factoredSprings == static_cast<int>(springs.size()) && factoredSpringCoef == springCoef &&
+      factoredDamperCoef == damperCoef && factoredDeltaTime == deltaTime && factoredStiffness == stiffness &&
+      factoredRanges == particles.activeRanges())
+    return;
+
+  // Fixed and sleeping particles are not unknowns
+  particleRow.assign(particles.getCapacity(), -1);
+  rowParticle.clear();
+  for (const auto &[first, last] : particles.activeRanges()) {
+    for (int i = first; i < last; ++i) {
+      if (particles.mass(i) == 0.0f) continue;
+      particleRow[i] = static_cast<int>(rowParticle.size());
+      rowParticle.push_back(i);
     }
-    simulateOneStep();
-
-    i = 0;
-    for (const auto &p : particles) {
-      vk4[i].acceleration = deltaTime * p->acceleration();
-
-      p->velocity() = origin[i].velocity +
-          (vk1[i].acceleration + 2 * vk2[i].acceleration + 2 * vk3[i].acceleration + vk4[i].acceleration) / 6;
-      p->position() =
-          origin[i].position + (vk1[i].velocity + 2 * vk2[i].velocity + 2 * vk3[i].velocity + vk4[i].velocity) / 6;
-      i++;
-    }*/
-
-    std::vector<tempState> origin, vk1, vk2, vk3, vk4;
-    for (const auto &p : particles) {
-      tempState o, k1;
-      o.velocity = p->velocity();
-      o.position = p->position();
-      k1.acceleration = deltaTime * p->acceleration();
-      k1.velocity = deltaTime * p->velocity();
-      p->velocity() = p->velocity() + deltaTime * p->acceleration() / 2;
-      p->position() = p->position() + deltaTime * p->velocity() / 2;
- 
-      origin.push_back(o);
-      vk1.push_back(k1);
+  }
+  int rows = static_cast<int>(rowParticle.size());
+  float inverseSquaredStep = 1.0f / (deltaTime * deltaTime);
+  springWeight.resize(springs.size());
+  std::vector<Eigen::Triplet<float>> triplets;
+  triplets.reserve(rows + 4 * springs.size());
+  for (int r = 0; r < rows; ++r) triplets.emplace_back(r, r, particles.mass(rowParticle[r]) * inverseSquaredStep);
+  // Laplacian of the springs weighted by stiffness and damping, springs to fixed particles only add to the diagonal
+  float damping = damperCoef / deltaTime;
+  for (size_t s = 0; s < springs.size(); ++s) {
+    springWeight[s] = springCoef * stiffness[static_cast<int>(springs[s].type())];
+    float weight = springWeight[s] + damping;
+    int start = particleRow[springs[s].startParticleIndex()];
+    int end = particleRow[springs[s].endParticleIndex()];
+    if (start >= 0) triplets.emplace_back(start, start, weight);
+    if (end >= 0) triplets.emplace_back(end, end, weight);
+    if (start >= 0 && end >= 0) {
+      triplets.emplace_back(start, end, -weight);
+      triplets.emplace_back(end, start, -weight);
+    }
+  }
+  Eigen::SparseMatrix<float> systemMatrix(rows, rows);
+  systemMatrix.setFromTriplets(triplets.begin(), triplets.end());
+  solver.compute(systemMatrix);
+
+  prediction.resize(rows, 3);
+  rightHandSide.resize(rows, 3);
+  solution.resize(rows, 3);
+  factoredSpringCoef = springCoef;
+  factoredDamperCoef = damperCoef;
+  factoredDeltaTime = deltaTime;
+  factoredStiffness = stiffness;
+  factoredSprings = static_cast<int>(springs.size());
+  factoredRanges = particles.activeRanges();
+  ++_factorizationCount;
+}
+
+void ProjectiveDynamics::accumulateProjections(Particles &particles, int first, int last) const {
+  const std::vector<Spring> &springs = cloth.springs();
+  float damping = damperCoef / deltaTime;
+  for (int s = first; s < last; ++s) {
+    int start = springs[s].startParticleIndex();
+    int end = springs[s].endParticleIndex();
+    int startRow = particleRow[start];
+    int endRow = particleRow[end];
+    Eigen::Vector3f difference = (particles.position(start) - particles.position(end)).head<3>();
+    float length = difference.norm();
+    // Closest point of the constraint set |difference| = rest length
+    Eigen::Vector3f projection =
+        length > 0.0f ? Eigen::Vector3f(difference * (springs[s].length() / length)) : Eigen::Vector3f::Zero();
+    Eigen::Vector3f force = springWeight[s] * (projection - difference);
+    // The damper only resists the motion of the step along the spring, fixed ends do not move
+    if (damping > 0.0f && length > 0.0f) {
+      Eigen::Vector3f motion = Eigen::Vector3f::Zero();
+      if (startRow >= 0) motion += (particles.position(start) - previousPosition.col(start)).head<3>();
+      if (endRow >= 0) motion -= (particles.position(end) - previousPosition.col(end)).head<3>();
+      force -= (damping * difference.dot(motion) / (length * length)) * difference;
     }
-    simulateOneStep();
-    int i = 0;
-    for (const auto &p : particles) {
-      tempState k2;
-      k2.acceleration = deltaTime * p->acceleration();
-      k2.velocity = deltaTime * p->velocity();
-      p->velocity() = origin[i].velocity + deltaTime * p->acceleration() / 2;
-      p->position() = origin[i].position + deltaTime * p->velocity() / 2;
-
-      i++;
-      vk2.push_back(k2);
+    if (startRow >= 0) rightHandSide.row(startRow) += force.transpose();
+    if (endRow >= 0) rightHandSide.row(endRow) -= force.transpose();
+  }
+}
+
+void ProjectiveDynamics::solveCloth(Particles &particles) const {
+  factorize();
+  // Nothing to solve when every island sleeps
+  if (rowParticle.empty() || solver.info() != Eigen::Success) return;
+  const std::vector<int> &colorOffsets = cloth.springColorOffsets();
+  const auto &activeRanges = particles.activeRanges();
+  int colorCount = static_cast<int>(colorOffsets.size()) - 1;
+  int rows = static_cast<int>(rowParticle.size());
+  float inverseSquaredStep = 1.0f / (deltaTime * deltaTime);
+
+  // The inertial prediction s = x + h * v + h^2 * a is also the initial guess
+  previousPosition.resize(4, particles.getCapacity());
+  forEachActiveRange(particles, [&](auto columns) {
+    columns(previousPosition) = columns(particles.position());
+    columns(particles.velocity()) += deltaTime * columns(particles.acceleration());
+    columns(particles.position()) += deltaTime * columns(particles.velocity());
+  });
+  for (int r = 0; r < rows; ++r) prediction.row(r) = particles.position(rowParticle[r]).head<3>().transpose();
+
+  ThreadPool &pool = ThreadPool::getPool();
+  for (int iteration = 0; iteration < constraintIterations; ++iteration) {
+    for (int r = 0; r < rows; ++r) {
+      rightHandSide.row(r) = (particles.mass(rowParticle[r]) * inverseSquaredStep) *
+                             (prediction.row(r) - particles.position(rowParticle[r]).head<3>().transpose());
     }
-    simulateOneStep();
-    i = 0;
-    for (const auto &p : particles) {
-      tempState k3;
-      k3.acceleration = deltaTime * p->acceleration();
-      k3.velocity = deltaTime * p->velocity();
-      p->velocity() = origin[i].velocity + deltaTime * p->acceleration();
-      p->position() = origin[i].position + deltaTime * p->velocity();
-      i++;
-      vk3.push_back(k3);
+    if (pool.size() == 1) {
+      for (int color = 0; color < colorCount; ++color) {
+        for (const auto &[first, last] : activeRanges) {
+          auto [firstSpring, lastSpring] = cloth.springRange(color, first, last);
+          accumulateProjections(particles, firstSpring, lastSpring);
+        }
+      }
+    } else {
+      pool.run([&](int threadIndex) {
+        for (int color = 0; color < colorCount; ++color) {
+          for (const auto &[first, last] : activeRanges) {
+            auto [firstSpring, lastSpring] = cloth.springRange(color, first, last);
+            auto [threadFirst, threadLast] = pool.range(firstSpring, lastSpring, threadIndex);
+            accumulateProjections(particles, threadFirst, threadLast);
+          }
+          pool.barrier();
+        }
+      });
     }
-    simulateOneStep();
-
-    i = 0;
-    for (const auto &p : particles) {
-      tempState k4;
-      k4.acceleration = deltaTime * p->acceleration();
-      k4.velocity = deltaTime * p->velocity();
-
-      p->velocity() =
-          origin[i].velocity +
-                      (vk1[i].acceleration + 2 * vk2[i].acceleration + 2 * vk3[i].acceleration + k4.acceleration) / 6;
-      p->position() =
-          origin[i].position + (vk1[i].velocity + 2 * vk2[i].velocity + 2 * vk3[i].velocity + k4.velocity) / 6;
-      i++;
-      vk4.push_back(k4);
+    solution = solver.solve(rightHandSide);
+    for (int r = 0; r < rows; ++r) particles.position(rowParticle[r]).head<3>() += solution.row(r).transpose();
+  }
+  forEachActiveRange(particles, [&](auto columns) {
+    columns(particles.velocity()) = (columns(particles.position()) - columns(previousPosition)) / deltaTime;
+  });
+}
+
+void ProjectiveDynamics::advance(const std::vector<Particles *> &particles) const {
+  // Only needed through integrate(), integrateSubsteps turns the spring forces off
+  if (cloth.springForceEnabled()) cloth.computeExternalForce();
+  for (const auto &p : particles) {
+    if (p == &cloth.particles()) {
+      solveCloth(*p);
+    } else {
+      forEachActiveRange(*p, [&](auto columns) {
+        columns(p->velocity()) += deltaTime * columns(p->acceleration());
+        columns(p->position()) += deltaTime * columns(p->velocity());
+      });
     }
+  }
 }
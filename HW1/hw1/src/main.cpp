@@ -1,6 +1,5 @@
 #include <algorithm>
 #include <cassert>
-#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -16,6 +15,12 @@
 int alignSize = 256;
 bool isWindowSizeChanged = true;
 bool mouseBinded = false;
+// Written and read by the checkpoint buttons, in the working directory
+constexpr char checkpointFile[] = "checkpoint.bin";
+// Recorded trajectory, in the working directory
+constexpr char trajectoryFile[] = "trajectory.bin";
+// Written by the profiler's Save trace button, in the working directory
+constexpr char traceFile[] = "trace.json";
 
 int uboAlign(int i) { return ((i + 1 * (alignSize - 1)) / alignSize) * alignSize; }
 
@@ -45,7 +50,10 @@ void framebufferSizeCallback(GLFWwindow*, int width, int height) {
   isWindowSizeChanged = true;
 }
 
-int main() {
+int main(int argc, char** argv) {
+  // Optional scene file as the first argument
+  Scene scene;
+  if (!scene.load(argc > 1 ? std::filesystem::path(argv[1]) : findPath("scene.txt"))) return EXIT_FAILURE;
   // Initialize OpenGL context.
   OpenGLContext& context = OpenGLContext::getContext();
   GLFWwindow* window = context.createWindow("HW1", 1280, 720, GLFW_OPENGL_CORE_PROFILE);
@@ -100,7 +108,7 @@ int main() {
     particleRenderer.uniformBlockBinding("camera", 1);
   }
   // Create softbody
-  Cloth cloth;
+  Cloth cloth(scene.particlesPerEdge, scene.clothWidth, scene.clothHeight, scene.clothOffsets);
   cloth.computeNormal();
   UniformBuffer meshUBO;
   int meshOffset = uboAlign(32 * sizeof(GLfloat));
@@ -109,10 +117,7 @@ int main() {
   meshUBO.load(16 * sizeof(GLfloat), 16 * sizeof(GLfloat), cloth.getNormalMatrix().data());
 
   Spheres& spheres = Spheres::initSpheres();
-  spheres.addSphere(Eigen::Vector4f(-0.75, 1, -0.75, 1), 0.5f);
-  spheres.addSphere(Eigen::Vector4f(0.75, 1, -0.75, 1), 0.5f);
-  spheres.addSphere(Eigen::Vector4f(-0.75, 1, 0.75, 1), 0.5f);
-  spheres.addSphere(Eigen::Vector4f(0.75, 1, 0.75, 1), 0.5f);
+  for (size_t i = 0; i < scene.spherePositions.size(); ++i) spheres.addSphere(scene.spherePositions[i], scene.sphereRadius[i]);
   meshUBO.load(meshOffset, 16 * sizeof(GLfloat), spheres.getModelMatrix().data());
   meshUBO.load(meshOffset + 16 * sizeof(GLfloat), 16 * sizeof(GLfloat), spheres.getNormalMatrix().data());
 
@@ -122,25 +127,30 @@ int main() {
   cameraUBO.load(0, 16 * sizeof(GLfloat), camera.viewProjectionMatrix().data());
   cameraUBO.load(16 * sizeof(GLfloat), 4 * sizeof(GLfloat), camera.position().data());
   cameraUBO.bindUniformBlockIndex(1, 0, uboAlign(20 * sizeof(GLfloat)));
-  // Do one step simulation, used in some implicit methods
-  std::function<void(void)> simulateOneStep = [&]() {
-    cloth.computeExternalForce();
-    spheres.computeExternalForce();
-    cloth.computeSpringForce();
-    spheres.collide(&cloth);
-    spheres.collide();
-  };
-
   ExplicitEuler explicitEuler;
   ImplicitEuler implicitEuler;
   MidpointEuler midpointEuler;
   RungeKuttaFourth rk4;
+  BackwardEuler backwardEuler(cloth);
+  BogackiShampine bogackiShampine;
+  ExtendedPositionBasedDynamics xpbd(cloth);
+  ProjectiveDynamics projectiveDynamics(cloth);
   Integrator* integrator = &explicitEuler;
 
-  std::vector<Particles*> particles{&cloth.particles(), &spheres.particles()};
   // Backup initial state
   Particles initialCloth = cloth.particles();
   Particles initialSpheres = spheres.particles();
+  TrajectoryCache trajectory;
+  // Simulation state while the timeline shows a recorded frame
+  Particles liveCloth, liveSpheres;
+  bool isTimelineActive = false;
+  int shownFrame = -1;
+  // Cloth and spheres are only touched under simulation.lock() from here on
+  SimulationThread simulation(cloth, spheres);
+  simulation.setIntegrator(integrator);
+  simulation.start();
+  Profiler& profiler = Profiler::getProfiler();
+  profiler.setThreadName("Render");
 
   while (!glfwWindowShouldClose(window)) {
     // Polling events.
@@ -156,56 +166,137 @@ int main() {
       cameraUBO.load(0, 16 * sizeof(GLfloat), camera.viewProjectionMatrix().data());
       cameraUBO.load(16 * sizeof(GLfloat), 4 * sizeof(GLfloat), camera.position().data());
     }
-    // Check which integrator is selected in GUI.
-    switch (currentIntegrator) {
-      case 0: integrator = &explicitEuler; break;
-      case 1: integrator = &implicitEuler; break;
-      case 2: integrator = &midpointEuler; break;
-      case 3: integrator = &rk4; break;
-      default: break;
+    // Take the latest state finished by the simulation thread
+    if (simulation.updateSnapshot()) {
+      ScopedTimer timer(ProfilePhase::UPLOAD);
+      // Uploaded once, shared by every draw type
+      cloth.upload(simulation.snapshot());
+      spheres.upload(simulation.snapshot());
+    }
+
+    {
+      // Only the time to submit the draw calls, the GPU runs them later
+      ScopedTimer timer(ProfilePhase::DRAW);
+      particleRenderer.use();
+      if (isClothColorChange) particleRenderer.setUniform("color", clothColor);
+      meshUBO.bindUniformBlockIndex(0, 0, meshOffset);
+      if (isDrawingParticles) cloth.draw(Cloth::DrawType::PARTICLE);
+      if (isDrawingStructuralSprings) cloth.draw(Cloth::DrawType::STRUCTURAL);
+      if (isDrawingShearSprings) cloth.draw(Cloth::DrawType::SHEAR);
+      if (isDrawingBendSprings) cloth.draw(Cloth::DrawType::BEND);
+      if (isDrawingCloth) {
+        glDisable(GL_CULL_FACE);
+        particleRenderer.setUniform("isSurface", 1);
+        cloth.draw(Cloth::DrawType::FULL);
+        glEnable(GL_CULL_FACE);
+      } else {
+        particleRenderer.setUniform("isSurface", 0);
+      }
+      sphereRenderer.use();
+      if (isSphereColorChange) sphereRenderer.setUniform("color", sphereColor);
+      meshUBO.bindUniformBlockIndex(0, meshOffset, meshOffset);
+      spheres.draw();
     }
 
-    if (!isPaused) {
+    {
+      // GUI changes configs read by the simulation thread
+      auto guard = simulation.lock();
+      simulationStepsPerSecond = simulation.stepsPerSecond();
+      activeClothParticles = cloth.activeParticleCount();
+      clothParticleCount = cloth.particles().getCapacity();
+      {
+        ScopedTimer timer(ProfilePhase::GUI);
+        gui.render();
+      }
+      profiler.setEnabled(isProfiling);
+      profiler.setTracing(isProfiling && isTracing);
+      if (isSavingTrace) {
+        profiler.saveTrace(traceFile);
+        isSavingTrace = false;
+      }
+      // Check which integrator is selected in GUI.
+      switch (currentIntegrator) {
+        case 0: integrator = &explicitEuler; break;
+        case 1: integrator = &implicitEuler; break;
+        case 2: integrator = &midpointEuler; break;
+        case 3: integrator = &rk4; break;
+        case 4: integrator = &backwardEuler; break;
+        case 5: integrator = &bogackiShampine; break;
+        case 6: integrator = &xpbd; break;
+        case 7: integrator = &projectiveDynamics; break;
+        default: break;
+      }
+      simulation.setIntegrator(integrator);
+      if (isSavingCheckpoint) saveCheckpoint(checkpointFile, cloth, spheres, simulation.stepCount());
+      // Also the state restored by Start from now on
+      if (isLoadingCheckpoint && loadCheckpoint(checkpointFile, cloth, spheres)) {
+        initialCloth = cloth.particles();
+        initialSpheres = spheres.particles();
+        // The loaded state replaces the one kept by the timeline
+        isTimelineActive = false;
+        timelineFrame = -1;
+        simulation.publish();
+      }
+      // Show a recorded frame, playback advances one frame per displayed frame without simulating
+      bool canShowFrame = trajectory.clothParticles() == cloth.particles().getCapacity() &&
+                          trajectory.sphereCount() == spheres.count();
+      if (timelineFrame >= 0 && timelineFrame < trajectory.frameCount() && canShowFrame) {
+        if (!isTimelineActive) {
+          liveCloth = cloth.particles();
+          liveSpheres = spheres.particles();
+          isTimelineActive = true;
+          isPaused = true;
+          shownFrame = -1;
+        }
+        if (isPlayingTrajectory && shownFrame == timelineFrame) {
+          if (timelineFrame + 1 < trajectory.frameCount())
+            ++timelineFrame;
+          else
+            isPlayingTrajectory = false;
+        }
+        if (timelineFrame != shownFrame) {
+          trajectory.frame(timelineFrame, cloth.particles().position(),
+                           spheres.particles().position().leftCols(spheres.count()));
+          cloth.markPositionsChanged();
+          shownFrame = timelineFrame;
+          simulation.publish();
+        }
+      } else {
+        timelineFrame = -1;
+        isPlayingTrajectory = false;
+        if (isTimelineActive) {
+          cloth.particles() = liveCloth;
+          cloth.markPositionsChanged();
+          spheres.particles() = liveSpheres;
+          isTimelineActive = false;
+          simulation.publish();
+        }
+      }
+      if (isRecordingTrajectory != simulation.isRecording()) {
+        if (!isRecordingTrajectory) {
+          simulation.setRecorder(nullptr);
+        } else if (trajectory.create(trajectoryFile, cloth.particles().getCapacity(), spheres.count())) {
+          simulation.setRecorder(&trajectory);
+        } else {
+          isRecordingTrajectory = false;
+        }
+      }
+      recordedFrames = trajectory.frameCount();
       // Stop -> Start: Restore initial state
-      if (isStateSwitched) {
+      if (!isPaused && isStateSwitched) {
         cloth.particles() = initialCloth;
+        cloth.wakeAll();
+        cloth.markPositionsChanged();
         spheres.particles() = initialSpheres;
       }
-      // Simulate one step and then integrate it.
-      for (int i = 0; i < simulationPerFrame; i++) {
-        simulateOneStep();
-        integrator->integrate(particles, simulateOneStep);
-      }
-    }
-
-    particleRenderer.use();
-    if (isClothColorChange) particleRenderer.setUniform("color", clothColor);
-    meshUBO.bindUniformBlockIndex(0, 0, meshOffset);
-    if (isDrawingParticles) cloth.draw(Cloth::DrawType::PARTICLE);
-    if (isDrawingStructuralSprings) cloth.draw(Cloth::DrawType::STRUCTURAL);
-    if (isDrawingShearSprings) cloth.draw(Cloth::DrawType::SHEAR);
-    if (isDrawingBendSprings) cloth.draw(Cloth::DrawType::BEND);
-    if (isDrawingCloth) {
-      glDisable(GL_CULL_FACE);
-      // This is very slow because it is done in CPU. Since GL4.1 doesn't support compute shader.
-      cloth.computeNormal();
-      particleRenderer.setUniform("isSurface", 1);
-      cloth.draw(Cloth::DrawType::FULL);
-      glEnable(GL_CULL_FACE);
-    } else {
-      particleRenderer.setUniform("isSurface", 0);
     }
-    sphereRenderer.use();
-    if (isSphereColorChange) sphereRenderer.setUniform("color", sphereColor);
-    meshUBO.bindUniformBlockIndex(0, meshOffset, meshOffset);
-    spheres.draw();
-
-    gui.render();
 #ifdef __APPLE__
     glFlush();
 #endif
     glfwSwapBuffers(window);
+    profiler.endFrame();
   }
+  simulation.stop();
   glfwDestroyWindow(window);
   return 0;
 }
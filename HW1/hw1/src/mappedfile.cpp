@@ -0,0 +1,171 @@
+#include "mappedfile.h"
+
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() noexcept :
+#ifdef _WIN32
+    mappingHandle(nullptr),
+#endif
+    fileHandle(invalidHandle),
+    mapped(nullptr),
+    _size(0),
+    writable(false) {
+}
+
+MappedFile::~MappedFile() { close(); }
+
+#ifdef _WIN32
+bool MappedFile::open(const std::filesystem::path& filename_) {
+  close();
+  filename = filename_;
+  fileHandle = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER fileSize;
+  if (fileHandle == invalidHandle || !GetFileSizeEx(fileHandle, &fileSize)) {
+    std::cerr << "Cannot open file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  _size = static_cast<std::size_t>(fileSize.QuadPart);
+  writable = false;
+  return map();
+}
+
+bool MappedFile::create(const std::filesystem::path& filename_, std::size_t size_) {
+  close();
+  filename = filename_;
+  fileHandle = CreateFileW(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (fileHandle == invalidHandle) {
+    std::cerr << "Cannot create file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  writable = true;
+  return resize(size_);
+}
+
+bool MappedFile::resize(std::size_t size_) {
+  if (!writable || fileHandle == invalidHandle) return false;
+  unmap();
+  LARGE_INTEGER fileSize;
+  fileSize.QuadPart = static_cast<LONGLONG>(size_);
+  if (!SetFilePointerEx(fileHandle, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(fileHandle)) {
+    std::cerr << "Cannot resize file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  _size = size_;
+  return map();
+}
+
+bool MappedFile::map() {
+  // Empty files cannot be mapped
+  if (_size == 0) return true;
+  mappingHandle =
+      CreateFileMappingW(fileHandle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+  if (mappingHandle != nullptr) {
+    mapped = static_cast<unsigned char*>(
+        MapViewOfFile(mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, _size));
+  }
+  if (mapped == nullptr) {
+    std::cerr << "Cannot map file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::unmap() noexcept {
+  if (mapped != nullptr) UnmapViewOfFile(mapped);
+  if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+  mapped = nullptr;
+  mappingHandle = nullptr;
+}
+
+void MappedFile::close() noexcept {
+  unmap();
+  if (fileHandle != invalidHandle) CloseHandle(fileHandle);
+  fileHandle = invalidHandle;
+  _size = 0;
+  writable = false;
+}
+#else
+bool MappedFile::open(const std::filesystem::path& filename_) {
+  close();
+  filename = filename_;
+  fileHandle = ::open(filename.c_str(), O_RDONLY);
+  struct stat status;
+  if (fileHandle == invalidHandle || fstat(fileHandle, &status) != 0) {
+    std::cerr << "Cannot open file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  _size = static_cast<std::size_t>(status.st_size);
+  writable = false;
+  return map();
+}
+
+bool MappedFile::create(const std::filesystem::path& filename_, std::size_t size_) {
+  close();
+  filename = filename_;
+  fileHandle = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fileHandle == invalidHandle) {
+    std::cerr << "Cannot create file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  writable = true;
+  return resize(size_);
+}
+
+bool MappedFile::resize(std::size_t size_) {
+  if (!writable || fileHandle == invalidHandle) return false;
+  unmap();
+  if (ftruncate(fileHandle, static_cast<off_t>(size_)) != 0) {
+    std::cerr << "Cannot resize file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  _size = size_;
+  return map();
+}
+
+bool MappedFile::map() {
+  // Empty files cannot be mapped
+  if (_size == 0) return true;
+  void* address = mmap(nullptr, _size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileHandle, 0);
+  if (address == MAP_FAILED) {
+    std::cerr << "Cannot map file: " << filename.string() << std::endl;
+    close();
+    return false;
+  }
+  mapped = static_cast<unsigned char*>(address);
+  return true;
+}
+
+void MappedFile::unmap() noexcept {
+  if (mapped != nullptr) munmap(mapped, _size);
+  mapped = nullptr;
+}
+
+void MappedFile::close() noexcept {
+  unmap();
+  if (fileHandle != invalidHandle) ::close(fileHandle);
+  fileHandle = invalidHandle;
+  _size = 0;
+  writable = false;
+}
+#endif
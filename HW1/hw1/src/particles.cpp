@@ -1,21 +1,35 @@
 #include "particles.h"
 
-Particles::Particles(int size, float mass_) noexcept :
-    _position(4, size), _velocity(4, size), _acceleration(4, size), _mass(size, mass_) {
+#include <algorithm>
+
+template <class Scalar, int Width>
+BasicParticles<Scalar, Width>::BasicParticles(int size, Scalar mass_) noexcept :
+    _position(Width, size),
+    _velocity(Width, size),
+    _acceleration(Width, size),
+    _mass(size, mass_),
+    _activeRanges{{0, std::max(size, 0)}} {
   _position.setZero();
   _velocity.setZero();
   _acceleration.setZero();
 }
 
-void Particles::setZero() {
+template <class Scalar, int Width>
+void BasicParticles<Scalar, Width>::setZero() {
   _position.setZero();
   _velocity.setZero();
   _acceleration.setZero();
 }
 
-void Particles::resize(int newSize) {
+template <class Scalar, int Width>
+void BasicParticles<Scalar, Width>::resize(int newSize) {
   _position.conservativeResize(Eigen::NoChange, newSize);
   _velocity.conservativeResize(Eigen::NoChange, newSize);
   _acceleration.conservativeResize(Eigen::NoChange, newSize);
-  _mass.resize(newSize, 0.0f);
+  _mass.resize(newSize, Scalar(0));
+  _activeRanges.assign(1, {0, newSize});
 }
+
+template class BasicParticles<float, 4>;
+template class BasicParticles<float, 3>;
+template class BasicParticles<double, 4>;
@@ -0,0 +1,144 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+namespace {
+constexpr const char* phaseNames[Profiler::phaseCount] = {"Forces", "Collisions", "Integration", "Normals",
+                                                          "Upload", "Draw",       "ImGui"};
+// Innermost running timer of each thread, the parent of the next one
+thread_local ScopedTimer* currentTimer = nullptr;
+thread_local int currentThreadIndex = -1;
+}  // namespace
+
+Profiler::Profiler() :
+    enabled(false),
+    tracing(false),
+    accumulated{},
+    phaseHistory{},
+    frameTimes{},
+    nextFrame(0),
+    lastFrame(Clock::now()),
+    traceOrigin(lastFrame),
+    threadCount(0) {}
+
+Profiler& Profiler::getProfiler() {
+  static Profiler profiler;
+  return profiler;
+}
+
+const char* Profiler::phaseName(ProfilePhase phase) { return phaseNames[static_cast<int>(phase)]; }
+
+int Profiler::threadIndex() {
+  if (currentThreadIndex < 0) currentThreadIndex = threadCount.fetch_add(1);
+  return currentThreadIndex;
+}
+
+void Profiler::record(ProfilePhase phase, Clock::time_point start, Clock::duration duration,
+                      Clock::duration exclusive) {
+  accumulated[static_cast<int>(phase)].fetch_add(std::chrono::nanoseconds(exclusive).count(),
+                                                 std::memory_order_relaxed);
+  if (!isTracing()) return;
+  int thread = threadIndex();
+  std::lock_guard<std::mutex> guard(traceMutex);
+  // Tracing may have been restarted after start
+  if (start < traceOrigin || traceEvents.size() >= maxTraceEvents) return;
+  traceEvents.push_back({phase, thread, std::chrono::nanoseconds(start - traceOrigin).count(),
+                         std::chrono::nanoseconds(duration).count()});
+}
+
+void Profiler::endFrame() {
+  auto now = Clock::now();
+  for (int phase = 0; phase < phaseCount; ++phase) {
+    phaseHistory[phase][nextFrame] = static_cast<float>(accumulated[phase].exchange(0) * 1e-6);
+  }
+  frameTimes[nextFrame] = std::chrono::duration<float, std::milli>(now - lastFrame).count();
+  lastFrame = now;
+  nextFrame = (nextFrame + 1) % historySize;
+}
+
+float Profiler::average(const float* history) {
+  return std::accumulate(history, history + historySize, 0.0f) / historySize;
+}
+
+void Profiler::setThreadName(const std::string& name) {
+  int thread = threadIndex();
+  std::lock_guard<std::mutex> guard(traceMutex);
+  if (static_cast<int>(threadNames.size()) <= thread) threadNames.resize(thread + 1);
+  threadNames[thread] = name;
+}
+
+void Profiler::setTracing(bool trace) {
+  if (trace == isTracing()) return;
+  std::lock_guard<std::mutex> guard(traceMutex);
+  if (trace) {
+    traceEvents.clear();
+    traceOrigin = Clock::now();
+  }
+  tracing.store(trace, std::memory_order_relaxed);
+}
+
+size_t Profiler::traceEventCount() const {
+  std::lock_guard<std::mutex> guard(traceMutex);
+  return traceEvents.size();
+}
+
+bool Profiler::saveTrace(const std::filesystem::path& filename) const {
+  // Copied so that the timed threads do not wait for the file
+  std::vector<TraceEvent> events;
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> guard(traceMutex);
+    events = traceEvents;
+    names = threadNames;
+  }
+  std::ofstream file(filename, std::ios::trunc);
+  if (!file) {
+    std::cerr << "Cannot open trace file: " << filename.string() << std::endl;
+    return false;
+  }
+  // Complete events with microsecond timestamps, nested scopes of a thread are shown stacked
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" << std::fixed << std::setprecision(3);
+  bool isFirst = true;
+  for (size_t thread = 0; thread < names.size(); ++thread) {
+    if (names[thread].empty()) continue;
+    file << (isFirst ? "" : ",\n") << R"({"name":"thread_name","ph":"M","pid":1,"tid":)" << thread
+         << R"(,"args":{"name":")" << names[thread] << "\"}}";
+    isFirst = false;
+  }
+  for (const TraceEvent& event : events) {
+    bool isRender = event.phase >= ProfilePhase::UPLOAD;
+    file << (isFirst ? "" : ",\n") << R"({"name":")" << phaseName(event.phase) << R"(","cat":")"
+         << (isRender ? "render" : "simulation") << R"(","ph":"X","pid":1,"tid":)" << event.thread
+         << ",\"ts\":" << event.start * 1e-3 << ",\"dur\":" << event.duration * 1e-3 << "}";
+    isFirst = false;
+  }
+  file << "\n]}" << std::endl;
+  if (!file) {
+    std::cerr << "Cannot write trace file: " << filename.string() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+ScopedTimer::ScopedTimer(ProfilePhase phase) :
+    phase(phase),
+    isActive(Profiler::getProfiler().isEnabled()),
+    nested(0),
+    parent(nullptr) {
+  if (!isActive) return;
+  parent = currentTimer;
+  currentTimer = this;
+  start = Profiler::Clock::now();
+}
+
+ScopedTimer::~ScopedTimer() {
+  if (!isActive) return;
+  auto duration = Profiler::Clock::now() - start;
+  currentTimer = parent;
+  if (parent != nullptr) parent->nested += duration;
+  Profiler::getProfiler().record(phase, start, duration, duration - nested);
+}
@@ -0,0 +1,66 @@
+#include "scene.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+Scene::Scene() :
+    particlesPerEdge(25),
+    clothWidth(2.0f),
+    clothHeight(2.0f),
+    clothOffsets{Eigen::Vector4f::Zero()},
+    spherePositions{Eigen::Vector4f(-0.75f, 1, -0.75f, 1), Eigen::Vector4f(0.75f, 1, -0.75f, 1),
+                    Eigen::Vector4f(-0.75f, 1, 0.75f, 1), Eigen::Vector4f(0.75f, 1, 0.75f, 1)},
+    sphereRadius(4, 0.5f) {}
+
+bool Scene::load(const std::filesystem::path& filename) {
+  std::ifstream sceneFile(filename);
+  if (!sceneFile) {
+    std::cerr << "Cannot open scene file: " << filename.string() << std::endl;
+    return false;
+  }
+  bool hasSphere = false;
+  bool hasInstance = false;
+  std::string line;
+  for (int lineNumber = 1; std::getline(sceneFile, line); ++lineNumber) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream entry(line);
+    std::string key;
+    if (!(entry >> key)) continue;
+
+    bool valid = false;
+    if (key == "cloth") {
+      valid = static_cast<bool>(entry >> particlesPerEdge >> clothWidth >> clothHeight);
+      // Bend springs need at least 3 particles per edge
+      valid = valid && particlesPerEdge >= 3 && clothWidth > 0.0f && clothHeight > 0.0f;
+    } else if (key == "instance") {
+      float x, y, z;
+      valid = static_cast<bool>(entry >> x >> y >> z);
+      if (valid) {
+        if (!hasInstance) {
+          clothOffsets.clear();
+          hasInstance = true;
+        }
+        clothOffsets.emplace_back(x, y, z, 0.0f);
+      }
+    } else if (key == "sphere") {
+      float x, y, z, radius;
+      valid = static_cast<bool>(entry >> x >> y >> z >> radius) && radius > 0.0f;
+      if (valid) {
+        if (!hasSphere) {
+          spherePositions.clear();
+          sphereRadius.clear();
+          hasSphere = true;
+        }
+        spherePositions.emplace_back(x, y, z, 1.0f);
+        sphereRadius.emplace_back(radius);
+      }
+    }
+    if (!valid) {
+      std::cerr << filename.string() << ":" << lineNumber << ": invalid scene entry: " << line << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
@@ -15,12 +15,26 @@ void Shape::setModelMatrix(const Eigen::Ref<const Eigen::Matrix4f>& _modelMatrix
 }
 
 void Shape::computeExternalForce() {
-  for (size_t i = 0; i < _particles.mass().size(); ++i) {
-    if (_particles.mass(i) == 0.0f) {
-      _particles.acceleration(i).setZero();
+  for (const auto& [first, last] : _particles.activeRanges()) computeExternalForce(first, last);
+}
+
+void Shape::computeExternalForce(int first, int last) { applyExternalForce(_particles, first, last); }
+
+template <class Scalar, int Width>
+void applyExternalForce(BasicParticles<Scalar, Width>& particles, int first, int last) {
+  using Vector = typename BasicParticles<Scalar, Width>::Vector;
+  Vector gravity = Vector::Zero();
+  gravity[1] = Scalar(-9.8);
+  for (int i = first; i < last; ++i) {
+    if (particles.mass(i) == Scalar(0)) {
+      particles.acceleration(i).setZero();
     } else {
-      _particles.acceleration(i) = Eigen::Vector4f(0, -9.8f, 0, 0);
-      _particles.acceleration(i) -= _particles.velocity(i) * viscousCoef * _particles.inverseMass(i);
+      particles.acceleration(i) = gravity;
+      particles.acceleration(i) -= particles.velocity(i) * Scalar(viscousCoef) * particles.inverseMass(i);
     }
   }
 }
+
+template void applyExternalForce(Particles&, int, int);
+template void applyExternalForce(PackedParticles&, int, int);
+template void applyExternalForce(DoubleParticles&, int, int);
@@ -0,0 +1,163 @@
+#include "simulationthread.h"
+
+#include <algorithm>
+
+#include "configs.h"
+#include "profiler.h"
+
+namespace {
+// The viewer used to simulate baseSpeed seconds per frame at 240 frames per second
+constexpr double timeScale = 240.0 * baseSpeed;
+// Simulated time is dropped beyond this, so that a slow step cannot make the simulation fall further and further behind
+constexpr double maxBacklog = 0.1 * timeScale;
+// Publish at least this often while catching up
+constexpr std::chrono::milliseconds publishInterval(8);
+}  // namespace
+
+SimulationThread::SimulationThread(Cloth& cloth, Spheres& spheres) :
+    cloth(cloth),
+    spheres(spheres),
+    particles{&cloth.particles(), &spheres.particles()},
+    integrator(nullptr),
+    recorder(nullptr),
+    stepsUntilRecord(0),
+    waiting(0),
+    stopping(false),
+    steps(0),
+    publishedNormal(false),
+    _stepsPerSecond(0.0f) {
+  publish();
+}
+
+SimulationThread::~SimulationThread() { stop(); }
+
+void SimulationThread::start() {
+  if (thread.joinable()) return;
+  stopping = false;
+  thread = std::thread(&SimulationThread::run, this);
+}
+
+void SimulationThread::stop() {
+  stopping = true;
+  if (thread.joinable()) thread.join();
+}
+
+std::unique_lock<std::mutex> SimulationThread::lock() {
+  waiting.fetch_add(1);
+  std::unique_lock<std::mutex> guard(mutex);
+  waiting.fetch_sub(1);
+  return guard;
+}
+
+void SimulationThread::step(int count) {
+  auto simulateOneStep = [this]() {
+    {
+      ScopedTimer timer(ProfilePhase::FORCES);
+      cloth.computeForces();
+      spheres.computeExternalForce();
+    }
+    ScopedTimer timer(ProfilePhase::COLLISIONS);
+    spheres.collide(&cloth);
+    spheres.collide();
+    if (isSelfColliding) cloth.collide();
+  };
+  {
+    // Only the integrator itself, the forces and collisions it evaluates are timed on their own
+    ScopedTimer timer(ProfilePhase::INTEGRATION);
+    integrateSubsteps(*integrator, particles, simulateOneStep, count);
+  }
+  cloth.updateSleeping(count);
+  cloth.markPositionsChanged();
+  steps += count;
+  if (recorder != nullptr && (stepsUntilRecord -= count) <= 0) {
+    recorder->append(cloth.particles().position(), spheres.particles().position().leftCols(spheres.count()));
+    stepsUntilRecord = simulationPerFrame;
+  }
+}
+
+void SimulationThread::setRecorder(TrajectoryCache* newRecorder) {
+  recorder = newRecorder;
+  if (recorder == nullptr) return;
+  recorder->append(cloth.particles().position(), spheres.particles().position().leftCols(spheres.count()));
+  stepsUntilRecord = simulationPerFrame;
+}
+
+void SimulationThread::publish() {
+  SimulationSnapshot& snapshot = snapshots.writeBuffer();
+  snapshot.clothPosition = cloth.particles().position();
+  if (isDrawingCloth) {
+    ScopedTimer timer(ProfilePhase::NORMALS);
+    cloth.computeNormal();
+    snapshot.clothNormal = cloth.normal();
+  } else {
+    snapshot.clothNormal.resize(4, 0);
+  }
+  snapshot.sphereCount = spheres.count();
+  snapshot.spherePosition = spheres.particles().position().leftCols(spheres.count());
+  snapshot.steps = steps;
+  publishedNormal = isDrawingCloth;
+  snapshots.publish();
+}
+
+void SimulationThread::run() {
+  Profiler::getProfiler().setThreadName("Simulation");
+  // Simulated time owed to real time
+  double accumulator = 0.0;
+  auto last = Clock::now();
+  auto rateStart = last;
+  long long rateSteps = steps;
+  // Real time of the last step, measured per batch
+  double stepSeconds = 0.0;
+  while (!stopping) {
+    std::unique_lock<std::mutex> guard(mutex);
+    auto now = Clock::now();
+    if (isPaused || integrator == nullptr) {
+      // Surface drawing was turned on or off while paused
+      if (isDrawingCloth != publishedNormal) publish();
+      accumulator = 0.0;
+      last = now;
+      _stepsPerSecond.store(0.0f, std::memory_order_relaxed);
+      guard.unlock();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      continue;
+    }
+    accumulator = std::min(accumulator + timeScale * std::chrono::duration<double>(now - last).count(), maxBacklog);
+    last = now;
+    bool stepped = false;
+    // The owed steps are integrated as few batches as publishInterval allows, the adaptive integrator is free to step
+    // over a whole batch. The lock is handed over between batches, so that the render thread can change configs.
+    auto batchStart = now;
+    while (accumulator >= deltaTime && deltaTime > 0.0f && !stopping && batchStart - now < publishInterval) {
+      // As many steps as are owed and fit in what is left of publishInterval, at least one
+      double budget = std::chrono::duration<double>(publishInterval - (batchStart - now)).count();
+      double fit = stepSeconds > 0.0 ? budget / stepSeconds : 1.0;
+      int count = std::max(1, static_cast<int>(std::min(accumulator / deltaTime, fit)));
+      // Frames are recorded at the end of a batch
+      if (recorder != nullptr) count = std::clamp(stepsUntilRecord, 1, count);
+      step(count);
+      stepSeconds = std::chrono::duration<double>(Clock::now() - batchStart).count() / count;
+      accumulator -= count * deltaTime;
+      stepped = true;
+      // std::mutex is not fair, wait until the other thread got it
+      if (waiting.load() > 0) {
+        guard.unlock();
+        while (waiting.load() > 0) std::this_thread::yield();
+        guard.lock();
+      }
+      if (isPaused) break;
+      batchStart = Clock::now();
+    }
+    if (stepped) publish();
+
+    auto rateElapsed = std::chrono::duration<double>(now - rateStart).count();
+    if (rateElapsed >= 0.5) {
+      _stepsPerSecond.store(static_cast<float>((steps - rateSteps) / rateElapsed), std::memory_order_relaxed);
+      rateStart = now;
+      rateSteps = steps;
+    }
+    // Sleep until the next step is due
+    double wait = deltaTime > 0.0f ? (deltaTime - accumulator) / timeScale : 1e-3;
+    guard.unlock();
+    if (wait > 0.0) std::this_thread::sleep_for(std::chrono::duration<double>(std::min(wait, 5e-3)));
+  }
+}
@@ -0,0 +1,78 @@
+#include "spatialhash.h"
+
+#include <algorithm>
+#include <cmath>
+
+std::array<int, 3> SpatialHash::cellOf(const float* position) const {
+  return {static_cast<int>(std::floor(position[0] * inverseCellSize)),
+          static_cast<int>(std::floor(position[1] * inverseCellSize)),
+          static_cast<int>(std::floor(position[2] * inverseCellSize))};
+}
+
+uint32_t SpatialHash::hashCell(const std::array<int, 3>& cell) const {
+  // Teschner et al. 2003, "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+  uint32_t hash = (static_cast<uint32_t>(cell[0]) * 73856093u) ^ (static_cast<uint32_t>(cell[1]) * 19349663u) ^
+                  (static_cast<uint32_t>(cell[2]) * 83492791u);
+  return hash & tableMask;
+}
+
+void SpatialHash::build(const Eigen::Ref<const Eigen::Matrix4Xf>& positions, float cellSize) {
+  int count = static_cast<int>(positions.cols());
+  _cellSize = cellSize;
+  inverseCellSize = 1.0f / cellSize;
+  // Power of two table with about 2 buckets per particle
+  uint32_t tableSize = 1;
+  while (tableSize < 2u * static_cast<uint32_t>(std::max(count, 1))) tableSize <<= 1;
+  tableMask = tableSize - 1;
+
+  bucketStart.assign(tableSize + 1, 0);
+  particleBucket.resize(count);
+  sortedIndex.resize(count);
+  sortedCell.resize(count);
+  for (int i = 0; i < count; ++i) {
+    particleBucket[i] = hashCell(cellOf(positions.col(i).data()));
+    ++bucketStart[particleBucket[i] + 1];
+  }
+  for (uint32_t i = 0; i < tableSize; ++i) bucketStart[i + 1] += bucketStart[i];
+  // Fill from the back so that each bucket stays sorted by particle index
+  for (int i = count - 1; i >= 0; --i) {
+    int slot = --bucketStart[particleBucket[i] + 1];
+    sortedIndex[slot] = i;
+    sortedCell[slot] = cellOf(positions.col(i).data());
+  }
+  // bucketStart[i + 1] was decremented down to the start of bucket i, shift it back
+  for (uint32_t i = 0; i < tableSize; ++i) bucketStart[i] = bucketStart[i + 1];
+  bucketStart[tableSize] = count;
+}
+
+void SpatialHash::query(const Eigen::Ref<const Eigen::Vector4f>& minCorner,
+                        const Eigen::Ref<const Eigen::Vector4f>& maxCorner,
+                        std::vector<int>& result) const {
+  std::array<int, 3> low = cellOf(minCorner.data());
+  std::array<int, 3> high = cellOf(maxCorner.data());
+  auto inRange = [&](const std::array<int, 3>& cell) {
+    return cell[0] >= low[0] && cell[0] <= high[0] && cell[1] >= low[1] && cell[1] <= high[1] && cell[2] >= low[2] &&
+           cell[2] <= high[2];
+  };
+  long long cellCount = 1;
+  for (int axis = 0; axis < 3; ++axis) cellCount *= static_cast<long long>(high[axis]) - low[axis] + 1;
+  // Box covers more cells than buckets, scanning everything is cheaper
+  if (cellCount > static_cast<long long>(tableMask) + 1) {
+    for (size_t i = 0; i < sortedIndex.size(); ++i) {
+      if (inRange(sortedCell[i])) result.emplace_back(sortedIndex[i]);
+    }
+    return;
+  }
+  std::array<int, 3> cell;
+  for (cell[0] = low[0]; cell[0] <= high[0]; ++cell[0]) {
+    for (cell[1] = low[1]; cell[1] <= high[1]; ++cell[1]) {
+      for (cell[2] = low[2]; cell[2] <= high[2]; ++cell[2]) {
+        uint32_t bucket = hashCell(cell);
+        for (int i = bucketStart[bucket]; i < bucketStart[bucket + 1]; ++i) {
+          // Skip entries of other cells that collide in the table, and report each particle only from its own cell
+          if (sortedCell[i] == cell) result.emplace_back(sortedIndex[i]);
+        }
+      }
+    }
+  }
+}
@@ -1,10 +1,15 @@
 #include "sphere.h"
 
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
 #include <Eigen/Dense>
 
 #include "cloth.h"
 #include "configs.h"
 
+#ifndef HW1_HEADLESS
 namespace {
 void generateVertices(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices) {
   // See http://www.songho.ca/opengl/gl_sphere.html#sphere if you don't know how to create a sphere.
@@ -47,6 +52,122 @@ void generateVertices(std::vector<GLfloat>& vertices, std::vector<GLuint>& indic
   }
 }
 }  // namespace
+#endif
+
+namespace {
+// Earliest t in [0, 1] at which center + t * motion is within radius of point, 0 if it already is
+bool sweepPoint(const Eigen::Vector3f& center, const Eigen::Vector3f& motion, const Eigen::Vector3f& point, float radius,
+                float& t) {
+  Eigen::Vector3f offset = center - point;
+  float c = offset.squaredNorm() - radius * radius;
+  if (c <= 0.0f) {
+    t = 0.0f;
+    return true;
+  }
+  float a = motion.squaredNorm();
+  float b = offset.dot(motion);
+  // Moving away
+  if (b >= 0.0f || a == 0.0f) return false;
+  float discriminant = b * b - a * c;
+  if (discriminant < 0.0f) return false;
+  t = (-b - std::sqrt(discriminant)) / a;
+  return t <= 1.0f;
+}
+
+// Same for the side of the capsule around segment [p, q], its ends are the sweepPoint of p and q
+bool sweepSegment(const Eigen::Vector3f& center, const Eigen::Vector3f& motion, const Eigen::Vector3f& p,
+                  const Eigen::Vector3f& q, float radius, float& t) {
+  Eigen::Vector3f axis = q - p;
+  float squaredLength = axis.squaredNorm();
+  if (squaredLength == 0.0f) return false;
+  Eigen::Vector3f offset = center - p;
+  // An infinite cylinder is a circle in the plane perpendicular to the axis
+  Eigen::Vector3f offsetPerpendicular = offset - (offset.dot(axis) / squaredLength) * axis;
+  Eigen::Vector3f motionPerpendicular = motion - (motion.dot(axis) / squaredLength) * axis;
+  float hit;
+  if (!sweepPoint(offsetPerpendicular, motionPerpendicular, Eigen::Vector3f::Zero(), radius, hit)) return false;
+  float along = (offset + hit * motion).dot(axis) / squaredLength;
+  if (along < 0.0f || along > 1.0f) return false;
+  t = hit;
+  return true;
+}
+
+// Barycentric weights of the point of triangle abc closest to p (Ericson, Real-Time Collision Detection 5.1.5)
+Eigen::Vector3f closestBarycentric(const Eigen::Vector3f& p, const Eigen::Vector3f& a, const Eigen::Vector3f& b,
+                                   const Eigen::Vector3f& c) {
+  Eigen::Vector3f ab = b - a, ac = c - a, ap = p - a;
+  float d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) return {1.0f, 0.0f, 0.0f};
+  Eigen::Vector3f bp = p - b;
+  float d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (d3 >= 0.0f && d4 <= d3) return {0.0f, 1.0f, 0.0f};
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    float v = d1 / (d1 - d3);
+    return {1.0f - v, v, 0.0f};
+  }
+  Eigen::Vector3f cp = p - c;
+  float d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (d6 >= 0.0f && d5 <= d6) return {0.0f, 0.0f, 1.0f};
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    float w = d2 / (d2 - d6);
+    return {1.0f - w, 0.0f, w};
+  }
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+    float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return {0.0f, 1.0f - w, w};
+  }
+  float denominator = 1.0f / (va + vb + vc);
+  float v = vb * denominator, w = vc * denominator;
+  return {1.0f - v - w, v, w};
+}
+
+// Earliest t in [0, 1] at which a sphere moving from center by motion touches triangle abc, 0 if it already does.
+// The triangle inflated by radius is a slab around the face, three capsules around the edges and the corners.
+bool sweepTriangle(const Eigen::Vector3f& center, const Eigen::Vector3f& motion, const Eigen::Vector3f& a,
+                   const Eigen::Vector3f& b, const Eigen::Vector3f& c, float radius, float& t) {
+  Eigen::Vector3f normal = (b - a).cross(c - a);
+  float area = normal.norm();
+  if (area > 0.0f) {
+    normal /= area;
+    float distance = normal.dot(center - a);
+    float approach = normal.dot(motion);
+    // Measure from the side the sphere is on
+    if (distance < 0.0f) {
+      distance = -distance;
+      approach = -approach;
+    }
+    float faceHit = distance <= radius ? 0.0f : approach < 0.0f ? (distance - radius) / -approach : 2.0f;
+    if (faceHit <= 1.0f) {
+      // The face is hit first if the sphere touches the plane inside the triangle
+      Eigen::Vector3f moved = center + faceHit * motion;
+      Eigen::Vector3f weights = closestBarycentric(moved, a, b, c);
+      Eigen::Vector3f closest = weights.x() * a + weights.y() * b + weights.z() * c;
+      if ((moved - closest).squaredNorm() <= radius * radius) {
+        t = faceHit;
+        return true;
+      }
+    }
+  }
+  bool isHit = false;
+  t = 2.0f;
+  float hit;
+  const Eigen::Vector3f* corners[3] = {&a, &b, &c};
+  for (int k = 0; k < 3; ++k) {
+    if (sweepPoint(center, motion, *corners[k], radius, hit) && hit < t) {
+      t = hit;
+      isHit = true;
+    }
+    if (sweepSegment(center, motion, *corners[k], *corners[(k + 1) % 3], radius, hit) && hit < t) {
+      t = hit;
+      isHit = true;
+    }
+  }
+  return isHit;
+}
+}  // namespace
 
 Spheres& Spheres::initSpheres() {
   static Spheres spheres;
@@ -57,8 +178,10 @@ void Spheres::addSphere(const Eigen::Ref<const Eigen::Vector4f>& position, float
   if (sphereCount == _particles.getCapacity()) {
     _particles.resize(sphereCount * 2);
     _radius.resize(sphereCount * 2);
-    offsets.allocate(8 * sphereCount * sizeof(float));
+#ifndef HW1_HEADLESS
+    offsets.allocateRegions(8 * sphereCount * sizeof(float));
     sizes.allocate(2 * sphereCount * sizeof(float));
+#endif
   }
   _radius[sphereCount] = size;
   _particles.position(sphereCount) = position;
@@ -66,12 +189,16 @@ void Spheres::addSphere(const Eigen::Ref<const Eigen::Vector4f>& position, float
   _particles.acceleration(sphereCount).setZero();
   _particles.mass(sphereCount) = sphereDensity * size * size * size;
 
+#ifndef HW1_HEADLESS
   sizes.load(0, _radius.size() * sizeof(float), _radius.data());
+#endif
   ++sphereCount;
 }
 
-Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f) {
-  offsets.allocate(4 * sizeof(float));
+Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f), sweepAxis(-1) {
+#ifndef HW1_HEADLESS
+  uploadedCount = 0;
+  offsets.allocateRegions(4 * sizeof(float));
   sizes.allocate(sizeof(float));
 
   std::vector<GLfloat> vertices;
@@ -103,15 +230,29 @@ Spheres::Spheres() : Shape(1, 1), sphereCount(0), _radius(1, 0.0f) {
   glBindVertexArray(0);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
+}
+
+#ifndef HW1_HEADLESS
+void Spheres::upload(const SimulationSnapshot& snapshot) {
+  // Spheres added after the snapshot was taken are not drawn until the next one
+  uploadedCount = snapshot.sphereCount;
+  GLintptr offset = offsets.nextRegion();
+  offsets.write(0, 4 * uploadedCount * sizeof(GLfloat), snapshot.spherePosition.data());
+  vao.bind();
+  offsets.bind();
+  vao.setAttributePointer(2, 3, 4, offset / sizeof(GLfloat));
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 void Spheres::draw() const {
   vao.bind();
-  offsets.load(0, 4 * sphereCount * sizeof(GLfloat), _particles.getPositionData());
   GLsizei indexCount = static_cast<GLsizei>(ebo.size() / sizeof(GLuint));
-  glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr, sphereCount);
+  glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr, uploadedCount);
   glBindVertexArray(0);
 }
+#endif
 
 void Spheres::collide(Shape* shape) { shape->collide(this); }
 void Spheres::collide(Cloth* cloth) {
@@ -132,11 +273,34 @@ void Spheres::collide(Cloth* cloth) {
   //       _particles.position(j) -= correction;
 
   float frictionCoef = 0.05;
+  // Broadphase: grid with sphere sized cells, so each sphere overlaps at most 2 * 2 * 2 cells.
+  float maxRadius = 0.0f;
+  for (int i = 0; i < sphereCount; i++) maxRadius = std::max(maxRadius, radius(i));
+  if (sphereCount == 0 || maxRadius <= 0.0f) return;
+  clothHash.build(cloth->particles().position(), 2.0f * maxRadius);
+
   for (int i = 0; i < sphereCount; i++) {
-    for (int j = 0; j < cloth->particles().getCapacity(); j++) {
-      float distance = (_particles.position(i) - cloth->particles().position(j)).norm();
-      Eigen::Vector4f normalVec = (_particles.position(i) - cloth->particles().position(j)).normalized();
-      if (distance < radius(i) && (_particles.velocity(i) - cloth->particles().velocity(j)).dot(normalVec) < 0) {
+    Eigen::Vector4f extent(radius(i), radius(i), radius(i), 0.0f);
+    candidates.clear();
+    clothHash.query(_particles.position(i) - extent, _particles.position(i) + extent, candidates);
+    // Same order as testing every particle
+    std::sort(candidates.begin(), candidates.end());
+    for (int j : candidates) {
+      Eigen::Vector4f difference = _particles.position(i) - cloth->particles().position(j);
+      float squaredDistance = difference.squaredNorm();
+      // Narrowphase, only normalize after a contact is found
+      if (squaredDistance >= radius(i) * radius(i)) continue;
+      float distance = std::sqrt(squaredDistance);
+      Eigen::Vector4f normalVec = distance > 0.0f ? Eigen::Vector4f(difference / distance) : difference;
+      if ((_particles.velocity(i) - cloth->particles().velocity(j)).dot(normalVec) < 0) {
+        // A sleeping particle does not move, only the sphere responds. Approaching faster than sleepVelocity wakes it.
+        if (cloth->isSleeping(j)) {
+          float normalVelocity = _particles.velocity(i).dot(normalVec);
+          if (normalVelocity < -sleepVelocity) cloth->wake(j);
+          _particles.velocity(i) -= normalVelocity * normalVec;
+          _particles.position(i) += (radius(i) - distance) * normalVec * 0.15f;
+          continue;
+        }
         Eigen::Vector4f tangentVelocity_i = _particles.velocity(i) - (_particles.velocity(i).dot(normalVec) * normalVec);
         Eigen::Vector4f normalVelocity_i = (_particles.velocity(i).dot(normalVec)) * normalVec; 
         Eigen::Vector4f tangentVelocity_j =
@@ -167,10 +331,108 @@ void Spheres::collide(Cloth* cloth) {
       }
     }
   }
+  if (isUsingContinuousCollision) collideContinuous(cloth);
+}
+
+void Spheres::collideContinuous(Cloth* cloth) {
+  Particles& clothParticles = cloth->particles();
+  // Motion over the coming step, exact for explicit euler and off by h^2 * a for the others
+  clothDisplacement = deltaTime * clothParticles.velocity() + (deltaTime * deltaTime) * clothParticles.acceleration();
+  TriangleBVH& bvh = cloth->triangleBVH();
+  bvh.refit(clothParticles.position(), clothDisplacement);
+  const std::vector<std::array<int, 3>>& triangles = cloth->triangles();
+
+  if (contactNormal.cols() != sphereCount) contactNormal.setZero(4, sphereCount);
+  for (int i = 0; i < sphereCount; i++) {
+    // Normal of the last step, zero without a contact
+    Eigen::Vector4f previousNormal = contactNormal.col(i);
+    contactNormal.col(i).setZero();
+    Eigen::Vector4f start = _particles.position(i);
+    Eigen::Vector4f motion = deltaTime * _particles.velocity(i) + (deltaTime * deltaTime) * _particles.acceleration(i);
+    Eigen::Vector4f extent(radius(i), radius(i), radius(i), 0.0f);
+    candidates.clear();
+    bvh.query(start.cwiseMin(start + motion) - extent, start.cwiseMax(start + motion) + extent, candidates);
+    // Earliest hit, ties go to the lower triangle so that the query order does not matter
+    float firstHit = 2.0f;
+    int hitTriangle = -1;
+    Eigen::Vector3f hitMotion;
+    for (int k : candidates) {
+      const auto& [a, b, c] = triangles[k];
+      // Relative to the triangle, which moves with the average of its corners
+      Eigen::Vector3f relativeMotion =
+          (motion - (clothDisplacement.col(a) + clothDisplacement.col(b) + clothDisplacement.col(c)) / 3.0f).head<3>();
+      float hit;
+      if (!sweepTriangle(start.head<3>(), relativeMotion, clothParticles.position(a).head<3>(),
+                         clothParticles.position(b).head<3>(), clothParticles.position(c).head<3>(), radius(i), hit))
+        continue;
+      if (hit < firstHit || (hit == firstHit && k < hitTriangle)) {
+        firstHit = hit;
+        hitTriangle = k;
+        hitMotion = relativeMotion;
+      }
+    }
+    if (hitTriangle < 0) continue;
+
+    const std::array<int, 3>& corners = triangles[hitTriangle];
+    Eigen::Vector3f a = clothParticles.position(corners[0]).head<3>();
+    Eigen::Vector3f b = clothParticles.position(corners[1]).head<3>();
+    Eigen::Vector3f c = clothParticles.position(corners[2]).head<3>();
+    Eigen::Vector3f center = start.head<3>() + firstHit * hitMotion;
+    Eigen::Vector3f weights = closestBarycentric(center, a, b, c);
+    Eigen::Vector3f normal = center - (weights.x() * a + weights.y() * b + weights.z() * c);
+    float distance = normal.norm();
+    if (distance > 0.0f) {
+      normal /= distance;
+    } else {
+      // Center on the triangle, push back against the motion
+      normal = (b - a).cross(c - a).normalized();
+      if (normal.dot(hitMotion) > 0.0f) normal = -normal;
+    }
+    Eigen::Vector4f normalVec(normal.x(), normal.y(), normal.z(), 0.0f);
+    // Depth of the overlap at the start of the step
+    float depth = radius(i) - distance;
+    // The cloth was pulled over the center, which would push the sphere the rest of the way through. Keep the side of
+    // the last contact instead.
+    if (depth > 0.0f && normalVec.dot(previousNormal) < 0.0f) {
+      normalVec = -normalVec;
+      depth = radius(i) + distance;
+    }
+    contactNormal.col(i) = normalVec;
+    Eigen::Vector4f clothVelocity = Eigen::Vector4f::Zero();
+    // Inverse mass of the contact point, fixed and sleeping corners do not move
+    float clothInverseMass = 0.0f;
+    Eigen::Vector3f cornerInverseMass;
+    for (int k = 0; k < 3; ++k) {
+      cornerInverseMass[k] = cloth->isSleeping(corners[k]) ? 0.0f : clothParticles.inverseMass(corners[k]);
+      clothVelocity += weights[k] * clothParticles.velocity(corners[k]);
+      clothInverseMass += weights[k] * weights[k] * cornerInverseMass[k];
+    }
+    float inverseMassSum = _particles.inverseMass(i) + clothInverseMass;
+    if (inverseMassSum == 0.0f) continue;
+    // Inelastic like the particle contacts, the approaching normal velocity is removed
+    float normalVelocity = (_particles.velocity(i) - clothVelocity).dot(normalVec);
+    // Sleeping corners wake for the next step when hit faster than sleepVelocity
+    if (normalVelocity < -sleepVelocity) {
+      for (int corner : corners) {
+        if (cloth->isSleeping(corner)) cloth->wake(corner);
+      }
+    }
+    if (normalVelocity < 0.0f) {
+      float impulse = -normalVelocity / inverseMassSum;
+      _particles.velocity(i) += impulse * _particles.inverseMass(i) * normalVec;
+      for (int k = 0; k < 3; ++k)
+        clothParticles.velocity(corners[k]) -= weights[k] * impulse * cornerInverseMass[k] * normalVec;
+    }
+    // Already overlapping at the start of the step, the whole overlap is removed or it builds up over the steps
+    if (depth > 0.0f) {
+      Eigen::Vector4f correction = depth / inverseMassSum * normalVec;
+      _particles.position(i) += _particles.inverseMass(i) * correction;
+      for (int k = 0; k < 3; ++k) clothParticles.position(corners[k]) -= weights[k] * cornerInverseMass[k] * correction;
+    }
+  }
 }
 
 void Spheres::collide() {
-  constexpr float coefRestitution = 0.8f;
   // TODO: Collide with another sphere (Rigidbody collision)
   //   1. Detect collision.
   //   2. If collided, update impulse directly to particles' velocity
@@ -182,39 +444,99 @@ void Spheres::collide() {
   // Hint:
   //   1. You can simply push particles back to prevent penetration.
 
-  float frictionCoef = 0.03;
+  // Broadphase: sweep and prune along one axis, pairs whose intervals overlap go to narrowphase.
+  updateSweepOrder();
+  sweepPairs.clear();
+  for (int a = 0; a < sphereCount; a++) {
+    int i = sweepOrder[a];
+    float intervalEnd = sweepKey[i] + 2.0f * radius(i);
+    for (int b = a + 1; b < sphereCount && sweepKey[sweepOrder[b]] <= intervalEnd; b++) {
+      int j = sweepOrder[b];
+      // Bounding boxes must overlap on the other axes too
+      float radiusSum = radius(i) + radius(j);
+      Eigen::Vector4f difference = (_particles.position(i) - _particles.position(j)).cwiseAbs();
+      if (difference[0] > radiusSum || difference[1] > radiusSum || difference[2] > radiusSum) continue;
+      sweepPairs.emplace_back(std::min(i, j), std::max(i, j));
+    }
+  }
+  // Same order as testing every pair
+  std::sort(sweepPairs.begin(), sweepPairs.end());
+  for (const auto& [i, j] : sweepPairs) collidePair(i, j);
+}
+
+void Spheres::collideAllPairs() {
   for (int i = 0; i < sphereCount; i++) {
-    for (int j = i+1; j < sphereCount; j++) {
-      float distance = (_particles.position(i) - _particles.position(j)).norm();
-      Eigen::Vector4f normalVec = (_particles.position(i) - _particles.position(j)).normalized();
-      if (distance < (radius(i) + radius(j)) && (_particles.velocity(i) - _particles.velocity(j)).dot(normalVec) < 0) {
-        Eigen::Vector4f tangentVelocity_i =
-            _particles.velocity(i) - (_particles.velocity(i).dot(normalVec) * normalVec);
-        Eigen::Vector4f normalVelocity_i = (_particles.velocity(i).dot(normalVec)) * normalVec;
+    for (int j = i + 1; j < sphereCount; j++) collidePair(i, j);
+  }
+}
 
-        Eigen::Vector4f tangentVelocity_j =
-            _particles.velocity(j) - (_particles.velocity(j).dot(normalVec) * normalVec);
-        Eigen::Vector4f normalVelocity_j = (_particles.velocity(j).dot(normalVec)) * normalVec;
+void Spheres::updateSweepOrder() {
+  if (sphereCount == 0) return;
+  // Sweep along the axis of largest variance, it separates the spheres best
+  Eigen::Vector4f mean = Eigen::Vector4f::Zero();
+  for (int i = 0; i < sphereCount; i++) mean += _particles.position(i);
+  mean /= static_cast<float>(sphereCount);
+  Eigen::Vector4f variance = Eigen::Vector4f::Zero();
+  for (int i = 0; i < sphereCount; i++) variance += (_particles.position(i) - mean).cwiseAbs2();
+  int axis;
+  variance.head<3>().maxCoeff(&axis);
+  // Some hysteresis, so that the order is not thrown away when two axes are close
+  bool axisChanged = sweepAxis < 0 || (axis != sweepAxis && variance[axis] > 1.2f * variance[sweepAxis]);
+  if (axisChanged) sweepAxis = axis;
 
-        Eigen::Vector4f va = (_particles.mass(i) * normalVelocity_i + _particles.mass(j) * normalVelocity_j +
-                              _particles.mass(j) * coefRestitution * (normalVelocity_j - normalVelocity_i))  / (_particles.mass(i) + _particles.mass(j));
-        Eigen::Vector4f vb = (_particles.mass(i) * normalVelocity_i + _particles.mass(j) * normalVelocity_j +
-                              _particles.mass(i) * coefRestitution * (normalVelocity_i - normalVelocity_j)) / (_particles.mass(i) + _particles.mass(j));
-        _particles.velocity(i) = va  + tangentVelocity_i;
-        _particles.velocity(j) = vb  + tangentVelocity_j;
+  sweepKey.resize(sphereCount);
+  for (int i = 0; i < sphereCount; i++) sweepKey[i] = _particles.position(i)[sweepAxis] - radius(i);
+  auto lessKey = [this](int a, int b) { return sweepKey[a] < sweepKey[b]; };
+  if (axisChanged || static_cast<int>(sweepOrder.size()) != sphereCount) {
+    sweepOrder.resize(sphereCount);
+    std::iota(sweepOrder.begin(), sweepOrder.end(), 0);
+    std::sort(sweepOrder.begin(), sweepOrder.end(), lessKey);
+    return;
+  }
+  // Spheres move a little every step, insertion sort on the previous order is nearly linear
+  for (int a = 1; a < sphereCount; a++) {
+    int current = sweepOrder[a];
+    int b = a - 1;
+    for (; b >= 0 && lessKey(current, sweepOrder[b]); b--) sweepOrder[b + 1] = sweepOrder[b];
+    sweepOrder[b + 1] = current;
+  }
+}
 
-        Eigen::Vector4f correction = (radius(i) + radius(j) - distance) * normalVec * 0.15f;
-        _particles.position(i) += correction;
-        _particles.position(j) -= correction;
+void Spheres::collidePair(int i, int j) {
+  constexpr float coefRestitution = 0.8f;
+  float frictionCoef = 0.03;
+  Eigen::Vector4f difference = _particles.position(i) - _particles.position(j);
+  float squaredDistance = difference.squaredNorm();
+  float radiusSum = radius(i) + radius(j);
+  if (squaredDistance >= radiusSum * radiusSum) return;
+  float distance = std::sqrt(squaredDistance);
+  Eigen::Vector4f normalVec = distance > 0.0f ? Eigen::Vector4f(difference / distance) : difference;
+  if ((_particles.velocity(i) - _particles.velocity(j)).dot(normalVec) < 0) {
+    Eigen::Vector4f tangentVelocity_i =
+        _particles.velocity(i) - (_particles.velocity(i).dot(normalVec) * normalVec);
+    Eigen::Vector4f normalVelocity_i = (_particles.velocity(i).dot(normalVec)) * normalVec;
 
-        // friction force
-        Eigen::Vector4f fricitonForce_i = 
-            (-frictionCoef) * (-normalVec.dot(_particles.mass(i) * _particles.acceleration(i))) * tangentVelocity_i.normalized();
-        Eigen::Vector4f fricitonForce_j = 
-            (-frictionCoef) * (-normalVec.dot(_particles.mass(j) * _particles.acceleration(j))) * tangentVelocity_j.normalized();
-        _particles.acceleration(i) += fricitonForce_i * _particles.inverseMass(i);
-        _particles.acceleration(j) += fricitonForce_j * _particles.inverseMass(j);
-      }
-    }
+    Eigen::Vector4f tangentVelocity_j =
+        _particles.velocity(j) - (_particles.velocity(j).dot(normalVec) * normalVec);
+    Eigen::Vector4f normalVelocity_j = (_particles.velocity(j).dot(normalVec)) * normalVec;
+
+    Eigen::Vector4f va = (_particles.mass(i) * normalVelocity_i + _particles.mass(j) * normalVelocity_j +
+                          _particles.mass(j) * coefRestitution * (normalVelocity_j - normalVelocity_i))  / (_particles.mass(i) + _particles.mass(j));
+    Eigen::Vector4f vb = (_particles.mass(i) * normalVelocity_i + _particles.mass(j) * normalVelocity_j +
+                          _particles.mass(i) * coefRestitution * (normalVelocity_i - normalVelocity_j)) / (_particles.mass(i) + _particles.mass(j));
+    _particles.velocity(i) = va  + tangentVelocity_i;
+    _particles.velocity(j) = vb  + tangentVelocity_j;
+
+    Eigen::Vector4f correction = (radius(i) + radius(j) - distance) * normalVec * 0.15f;
+    _particles.position(i) += correction;
+    _particles.position(j) -= correction;
+
+    // friction force
+    Eigen::Vector4f fricitonForce_i = 
+        (-frictionCoef) * (-normalVec.dot(_particles.mass(i) * _particles.acceleration(i))) * tangentVelocity_i.normalized();
+    Eigen::Vector4f fricitonForce_j = 
+        (-frictionCoef) * (-normalVec.dot(_particles.mass(j) * _particles.acceleration(j))) * tangentVelocity_j.normalized();
+    _particles.acceleration(i) += fricitonForce_i * _particles.inverseMass(i);
+    _particles.acceleration(j) += fricitonForce_j * _particles.inverseMass(j);
   }
 }
@@ -0,0 +1,227 @@
+#include "spring.h"
+
+#include <cmath>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "configs.h"
+#include "particles.h"
+
+namespace {
+struct KernelData {
+  const float* position;
+  const float* velocity;
+  float* acceleration;
+  const float* mass;
+  const int32_t* start;
+  const int32_t* end;
+  const float* restLength;
+  const int32_t* type;
+  float stiffness[3];
+};
+
+inline float inverseMass(const float* mass, int i) { return (mass[i] == 0.0f) ? 0.0f : 1.0f / mass[i]; }
+
+// a * b + c, fused like the vector kernels so that results don't depend on where the remainder loop starts.
+inline float multiplyAdd(float a, float b, float c) {
+#if defined(__AVX2__) || defined(__AVX512F__)
+  return std::fma(a, b, c);
+#else
+  return a * b + c;
+#endif
+}
+
+// Same math as the vector kernels, used for the remainder and on CPUs without AVX2.
+void accumulateScalar(const KernelData& d, int first, int last) {
+  for (int i = first; i < last; ++i) {
+    const int s = 4 * d.start[i], e = 4 * d.end[i];
+    float dx = d.position[s] - d.position[e];
+    float dy = d.position[s + 1] - d.position[e + 1];
+    float dz = d.position[s + 2] - d.position[e + 2];
+    float length = std::sqrt(multiplyAdd(dx, dx, multiplyAdd(dy, dy, dz * dz)));
+    float inverseLength = length > 0.0f ? 1.0f / length : 0.0f;
+    dx *= inverseLength;
+    dy *= inverseLength;
+    dz *= inverseLength;
+    float deltaV = multiplyAdd(d.velocity[s] - d.velocity[e], dx,
+                               multiplyAdd(d.velocity[s + 1] - d.velocity[e + 1], dy,
+                                           (d.velocity[s + 2] - d.velocity[e + 2]) * dz));
+    // Spring force + damper force, based on start particle
+    float magnitude = -multiplyAdd(springCoef * d.stiffness[d.type[i]], length - d.restLength[i], damperCoef * deltaV);
+    float startScale = magnitude * inverseMass(d.mass, d.start[i]);
+    float endScale = -(magnitude * inverseMass(d.mass, d.end[i]));
+    d.acceleration[s] = multiplyAdd(dx, startScale, d.acceleration[s]);
+    d.acceleration[s + 1] = multiplyAdd(dy, startScale, d.acceleration[s + 1]);
+    d.acceleration[s + 2] = multiplyAdd(dz, startScale, d.acceleration[s + 2]);
+    d.acceleration[e] = multiplyAdd(dx, endScale, d.acceleration[e]);
+    d.acceleration[e + 1] = multiplyAdd(dy, endScale, d.acceleration[e + 1]);
+    d.acceleration[e + 2] = multiplyAdd(dz, endScale, d.acceleration[e + 2]);
+  }
+}
+
+#if defined(__AVX512F__)
+constexpr int simdWidth = 16;
+
+inline __m512 inverseMass(const float* mass, __m512i index) {
+  __m512 m = _mm512_i32gather_ps(index, mass, 4);
+  __mmask16 nonZero = _mm512_cmp_ps_mask(m, _mm512_setzero_ps(), _CMP_NEQ_OQ);
+  return _mm512_maskz_div_ps(nonZero, _mm512_set1_ps(1.0f), m);
+}
+
+// data += (x, y, z) * scale
+inline void scatterAdd(float* data, __m512i index4, __m512 x, __m512 y, __m512 z, __m512 scale) {
+  // No conflict detection needed, springs in a color group never share particles.
+  const __m512i one = _mm512_set1_epi32(1);
+  __m512i index = index4;
+  _mm512_i32scatter_ps(data, index, _mm512_fmadd_ps(x, scale, _mm512_i32gather_ps(index, data, 4)), 4);
+  index = _mm512_add_epi32(index, one);
+  _mm512_i32scatter_ps(data, index, _mm512_fmadd_ps(y, scale, _mm512_i32gather_ps(index, data, 4)), 4);
+  index = _mm512_add_epi32(index, one);
+  _mm512_i32scatter_ps(data, index, _mm512_fmadd_ps(z, scale, _mm512_i32gather_ps(index, data, 4)), 4);
+}
+
+void accumulateVector(const KernelData& d, int first, int last) {
+  const __m512 stiffness = _mm512_mul_ps(
+      _mm512_set1_ps(springCoef), _mm512_setr_ps(d.stiffness[0], d.stiffness[1], d.stiffness[2], 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 0, 0, 0, 0, 0));
+  const __m512 damper = _mm512_set1_ps(damperCoef);
+  const __m512i one = _mm512_set1_epi32(1);
+  int i = first;
+  for (; i + simdWidth <= last; i += simdWidth) {
+    __m512i start = _mm512_loadu_si512(d.start + i);
+    __m512i end = _mm512_loadu_si512(d.end + i);
+    __m512i s = _mm512_slli_epi32(start, 2), e = _mm512_slli_epi32(end, 2);
+    __m512i s1 = _mm512_add_epi32(s, one), e1 = _mm512_add_epi32(e, one);
+    __m512i s2 = _mm512_add_epi32(s1, one), e2 = _mm512_add_epi32(e1, one);
+    // Difference vector, computed once
+    __m512 dx = _mm512_sub_ps(_mm512_i32gather_ps(s, d.position, 4), _mm512_i32gather_ps(e, d.position, 4));
+    __m512 dy = _mm512_sub_ps(_mm512_i32gather_ps(s1, d.position, 4), _mm512_i32gather_ps(e1, d.position, 4));
+    __m512 dz = _mm512_sub_ps(_mm512_i32gather_ps(s2, d.position, 4), _mm512_i32gather_ps(e2, d.position, 4));
+    __m512 length = _mm512_sqrt_ps(_mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz))));
+    __mmask16 nonZero = _mm512_cmp_ps_mask(length, _mm512_setzero_ps(), _CMP_GT_OQ);
+    __m512 inverseLength = _mm512_maskz_div_ps(nonZero, _mm512_set1_ps(1.0f), length);
+    dx = _mm512_mul_ps(dx, inverseLength);
+    dy = _mm512_mul_ps(dy, inverseLength);
+    dz = _mm512_mul_ps(dz, inverseLength);
+
+    __m512 vx = _mm512_sub_ps(_mm512_i32gather_ps(s, d.velocity, 4), _mm512_i32gather_ps(e, d.velocity, 4));
+    __m512 vy = _mm512_sub_ps(_mm512_i32gather_ps(s1, d.velocity, 4), _mm512_i32gather_ps(e1, d.velocity, 4));
+    __m512 vz = _mm512_sub_ps(_mm512_i32gather_ps(s2, d.velocity, 4), _mm512_i32gather_ps(e2, d.velocity, 4));
+    __m512 deltaV = _mm512_fmadd_ps(vx, dx, _mm512_fmadd_ps(vy, dy, _mm512_mul_ps(vz, dz)));
+
+    __m512 k = _mm512_permutexvar_ps(_mm512_loadu_si512(d.type + i), stiffness);
+    __m512 deltaL = _mm512_sub_ps(length, _mm512_loadu_ps(d.restLength + i));
+    __m512 magnitude = _mm512_sub_ps(_mm512_setzero_ps(), _mm512_fmadd_ps(k, deltaL, _mm512_mul_ps(damper, deltaV)));
+
+    __m512 startScale = _mm512_mul_ps(magnitude, inverseMass(d.mass, start));
+    __m512 endScale = _mm512_sub_ps(_mm512_setzero_ps(), _mm512_mul_ps(magnitude, inverseMass(d.mass, end)));
+    scatterAdd(d.acceleration, s, dx, dy, dz, startScale);
+    scatterAdd(d.acceleration, e, dx, dy, dz, endScale);
+  }
+  accumulateScalar(d, i, last);
+}
+#elif defined(__AVX2__)
+constexpr int simdWidth = 8;
+
+inline __m256 inverseMass(const float* mass, __m256i index) {
+  __m256 m = _mm256_i32gather_ps(mass, index, 4);
+  __m256 nonZero = _mm256_cmp_ps(m, _mm256_setzero_ps(), _CMP_NEQ_OQ);
+  return _mm256_and_ps(nonZero, _mm256_div_ps(_mm256_set1_ps(1.0f), m));
+}
+
+void accumulateVector(const KernelData& d, int first, int last) {
+  const __m256 stiffness = _mm256_mul_ps(_mm256_set1_ps(springCoef),
+                                         _mm256_setr_ps(d.stiffness[0], d.stiffness[1], d.stiffness[2], 0, 0, 0, 0, 0));
+  const __m256 damper = _mm256_set1_ps(damperCoef);
+  alignas(32) float result[5][simdWidth];
+  int i = first;
+  for (; i + simdWidth <= last; i += simdWidth) {
+    __m256i start = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d.start + i));
+    __m256i end = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d.end + i));
+    __m256i s = _mm256_slli_epi32(start, 2), e = _mm256_slli_epi32(end, 2);
+    // Difference vector, computed once
+    __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(d.position, s, 4), _mm256_i32gather_ps(d.position, e, 4));
+    __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(d.position + 1, s, 4), _mm256_i32gather_ps(d.position + 1, e, 4));
+    __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(d.position + 2, s, 4), _mm256_i32gather_ps(d.position + 2, e, 4));
+    __m256 length = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz))));
+    __m256 nonZero = _mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 inverseLength = _mm256_and_ps(nonZero, _mm256_div_ps(_mm256_set1_ps(1.0f), length));
+    dx = _mm256_mul_ps(dx, inverseLength);
+    dy = _mm256_mul_ps(dy, inverseLength);
+    dz = _mm256_mul_ps(dz, inverseLength);
+
+    __m256 vx = _mm256_sub_ps(_mm256_i32gather_ps(d.velocity, s, 4), _mm256_i32gather_ps(d.velocity, e, 4));
+    __m256 vy = _mm256_sub_ps(_mm256_i32gather_ps(d.velocity + 1, s, 4), _mm256_i32gather_ps(d.velocity + 1, e, 4));
+    __m256 vz = _mm256_sub_ps(_mm256_i32gather_ps(d.velocity + 2, s, 4), _mm256_i32gather_ps(d.velocity + 2, e, 4));
+    __m256 deltaV = _mm256_fmadd_ps(vx, dx, _mm256_fmadd_ps(vy, dy, _mm256_mul_ps(vz, dz)));
+
+    __m256i type = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d.type + i));
+    __m256 k = _mm256_permutevar8x32_ps(stiffness, type);
+    __m256 deltaL = _mm256_sub_ps(length, _mm256_loadu_ps(d.restLength + i));
+    __m256 magnitude = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_fmadd_ps(k, deltaL, _mm256_mul_ps(damper, deltaV)));
+
+    __m256 startScale = _mm256_mul_ps(magnitude, inverseMass(d.mass, start));
+    __m256 endScale = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_mul_ps(magnitude, inverseMass(d.mass, end)));
+    _mm256_store_ps(result[0], dx);
+    _mm256_store_ps(result[1], dy);
+    _mm256_store_ps(result[2], dz);
+    _mm256_store_ps(result[3], startScale);
+    _mm256_store_ps(result[4], endScale);
+    // AVX2 has no scatter
+    for (int lane = 0; lane < simdWidth; ++lane) {
+      float* startAcceleration = d.acceleration + 4 * d.start[i + lane];
+      float* endAcceleration = d.acceleration + 4 * d.end[i + lane];
+      for (int k = 0; k < 3; ++k) {
+        startAcceleration[k] = multiplyAdd(result[k][lane], result[3][lane], startAcceleration[k]);
+        endAcceleration[k] = multiplyAdd(result[k][lane], result[4][lane], endAcceleration[k]);
+      }
+    }
+  }
+  accumulateScalar(d, i, last);
+}
+#else
+void accumulateVector(const KernelData& d, int first, int last) { accumulateScalar(d, first, last); }
+#endif
+}  // namespace
+
+void SpringArray::assign(const std::vector<Spring>& springs) {
+  _startIndex.resize(springs.size());
+  _endIndex.resize(springs.size());
+  _restLength.resize(springs.size());
+  _type.resize(springs.size());
+  for (size_t i = 0; i < springs.size(); ++i) {
+    _startIndex[i] = static_cast<int32_t>(springs[i].startParticleIndex());
+    _endIndex[i] = static_cast<int32_t>(springs[i].endParticleIndex());
+    _restLength[i] = springs[i].length();
+    _type[i] = static_cast<int32_t>(springs[i].type());
+  }
+}
+
+size_t SpringArray::memoryBytes() const {
+  return (_startIndex.capacity() + _endIndex.capacity() + _type.capacity()) * sizeof(int32_t) +
+         _restLength.capacity() * sizeof(float);
+}
+
+void SpringArray::accumulateForce(Particles& particles, int first, int last) const {
+  KernelData data{particles.getPositionData(),
+                  particles.getVelocityData(),
+                  particles.acceleration().data(),
+                  particles.getMassData(),
+                  _startIndex.data(),
+                  _endIndex.data(),
+                  _restLength.data(),
+                  _type.data(),
+                  {springStiffness[0], springStiffness[1], springStiffness[2]}};
+  accumulateVector(data, first, last);
+}
+
+const char* SpringArray::kernelName() {
+#if defined(__AVX512F__)
+  return "AVX-512";
+#elif defined(__AVX2__)
+  return "AVX2";
+#else
+  return "Scalar";
+#endif
+}
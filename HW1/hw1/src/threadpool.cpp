@@ -0,0 +1,94 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool() :
+    threadCount(1),
+    currentTask(nullptr),
+    generation(0),
+    pending(0),
+    stopping(false),
+    barrierCount(0),
+    barrierGeneration(0) {}
+
+ThreadPool::~ThreadPool() { stopWorkers(); }
+
+ThreadPool& ThreadPool::getPool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::resize(int newSize) {
+  if (newSize < 1) newSize = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  if (newSize == threadCount) return;
+  stopWorkers();
+  threadCount = newSize;
+  workers.reserve(threadCount - 1);
+  for (int i = 1; i < threadCount; ++i) workers.emplace_back(&ThreadPool::workerLoop, this, i, generation);
+}
+
+void ThreadPool::run(const std::function<void(int)>& task) {
+  if (threadCount == 1) {
+    task(0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    currentTask = &task;
+    pending = threadCount - 1;
+    ++generation;
+  }
+  wakeup.notify_all();
+  task(0);
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [this] { return pending == 0; });
+  currentTask = nullptr;
+}
+
+void ThreadPool::barrier() {
+  if (threadCount == 1) return;
+  // Sense reversing barrier, the last thread to arrive releases the others.
+  int currentGeneration = barrierGeneration.load(std::memory_order_acquire);
+  if (barrierCount.fetch_add(1, std::memory_order_acq_rel) + 1 == threadCount) {
+    barrierCount.store(0, std::memory_order_relaxed);
+    barrierGeneration.fetch_add(1, std::memory_order_release);
+  } else {
+    while (barrierGeneration.load(std::memory_order_acquire) == currentGeneration) std::this_thread::yield();
+  }
+}
+
+std::pair<int, int> ThreadPool::range(int begin, int end, int threadIndex) const {
+  long long count = std::max(0, end - begin);
+  int first = begin + static_cast<int>(count * threadIndex / threadCount);
+  int last = begin + static_cast<int>(count * (threadIndex + 1) / threadCount);
+  return {first, last};
+}
+
+void ThreadPool::workerLoop(int threadIndex, unsigned long long seen) {
+  while (true) {
+    const std::function<void(int)>* task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+      task = currentTask;
+    }
+    (*task)(threadIndex);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0) finished.notify_one();
+    }
+  }
+}
+
+void ThreadPool::stopWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto& worker : workers) worker.join();
+  workers.clear();
+  stopping = false;
+}
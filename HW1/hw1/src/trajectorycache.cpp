@@ -0,0 +1,172 @@
+#include "trajectorycache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+constexpr char trajectoryMagic[8] = {'H', 'W', '1', 'T', 'R', 'A', 'J', '\0'};
+constexpr uint32_t trajectoryVersion = 1;
+constexpr std::size_t recordAlignment = 16;
+// The file grows by doubling, starting from this
+constexpr std::size_t initialFileSize = 1 << 20;
+constexpr float quantizationRange = 32767.0f;
+
+struct TrajectoryHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t clothParticles;
+  int32_t sphereCount;
+  int32_t keyframeInterval;
+  float tolerance;
+  int32_t frameCount;
+  // Bytes used by the header and the frames
+  uint64_t dataSize;
+};
+
+// Followed by 3 x count floats for a keyframe, 3 x count int16 for a delta
+struct FrameRecord {
+  uint32_t type;
+  float scale;
+  uint32_t padding[2];
+};
+
+constexpr std::size_t headerSize = (sizeof(TrajectoryHeader) + recordAlignment - 1) / recordAlignment * recordAlignment;
+
+std::size_t alignRecord(std::size_t size) { return (size + recordAlignment - 1) / recordAlignment * recordAlignment; }
+
+// Shared by the encoder and the decoder, so both see bitwise the same frame
+void applyDelta(Eigen::Matrix3Xf& positions, const int16_t* quantized, float scale) {
+  Eigen::Map<const Eigen::Matrix<int16_t, 3, Eigen::Dynamic>> delta(quantized, 3, positions.cols());
+  positions += delta.cast<float>() * scale;
+}
+}  // namespace
+
+TrajectoryCache::TrajectoryCache(int keyframeInterval_, float tolerance_) noexcept :
+    keyframeInterval(std::max(1, keyframeInterval_)),
+    tolerance(tolerance_),
+    _clothParticles(0),
+    _sphereCount(0),
+    used(0),
+    keyframes(0),
+    decodedIndex(-1) {}
+
+TrajectoryCache::~TrajectoryCache() { close(); }
+
+bool TrajectoryCache::create(const std::filesystem::path& filename, int clothParticles_, int sphereCount_) {
+  close();
+  if (!file.create(filename, initialFileSize)) return false;
+  _clothParticles = clothParticles_;
+  _sphereCount = sphereCount_;
+  used = headerSize;
+  keyframes = 0;
+  frameOffsets.clear();
+  keyframeOf.clear();
+  int count = _clothParticles + _sphereCount;
+  encoded.resize(3, count);
+  delta.resize(3, count);
+  quantized.resize(3 * static_cast<std::size_t>(count));
+  decoded.resize(3, count);
+  decodedIndex = -1;
+  writeHeader();
+  return true;
+}
+
+void TrajectoryCache::close() {
+  if (!file.isOpen()) return;
+  writeHeader();
+  file.resize(used);
+  file.close();
+}
+
+bool TrajectoryCache::reserve(std::size_t extra) {
+  if (used + extra <= file.size()) return true;
+  return file.resize(std::max(2 * file.size(), used + extra));
+}
+
+void TrajectoryCache::writeHeader() {
+  TrajectoryHeader header{};
+  std::memcpy(header.magic, trajectoryMagic, sizeof(trajectoryMagic));
+  header.version = trajectoryVersion;
+  header.clothParticles = _clothParticles;
+  header.sphereCount = _sphereCount;
+  header.keyframeInterval = keyframeInterval;
+  header.tolerance = tolerance;
+  header.frameCount = frameCount();
+  header.dataSize = used;
+  std::memcpy(file.writableData(), &header, sizeof(header));
+}
+
+bool TrajectoryCache::append(const Eigen::Ref<const Eigen::Matrix4Xf>& cloth,
+                             const Eigen::Ref<const Eigen::Matrix4Xf>& spheres) {
+  if (!file.isWritable() || cloth.cols() != _clothParticles || spheres.cols() != _sphereCount) return false;
+  int count = _clothParticles + _sphereCount;
+  int previousKey = frameOffsets.empty() ? -1 : keyframeOf.back();
+  bool isKeyframe = previousKey < 0 || frameCount() - previousKey >= keyframeInterval;
+  float scale = 0.0f;
+  if (!isKeyframe) {
+    delta.leftCols(_clothParticles) = cloth.topRows<3>() - encoded.leftCols(_clothParticles);
+    delta.rightCols(_sphereCount) = spheres.topRows<3>() - encoded.rightCols(_sphereCount);
+    float maxDelta = delta.cwiseAbs().maxCoeff();
+    scale = maxDelta / quantizationRange;
+    // Rounding is off by at most half a step
+    isKeyframe = !std::isfinite(maxDelta) || 0.5f * scale > tolerance;
+  }
+
+  std::size_t payload = isKeyframe ? 3 * count * sizeof(float) : 3 * count * sizeof(int16_t);
+  std::size_t recordSize = alignRecord(sizeof(FrameRecord) + payload);
+  if (!reserve(recordSize)) return false;
+  unsigned char* record = file.writableData() + used;
+  FrameRecord header{static_cast<uint32_t>(isKeyframe ? FrameType::KEYFRAME : FrameType::DELTA), scale, {0, 0}};
+  std::memcpy(record, &header, sizeof(header));
+  unsigned char* data = record + sizeof(FrameRecord);
+  if (isKeyframe) {
+    encoded.leftCols(_clothParticles) = cloth.topRows<3>();
+    encoded.rightCols(_sphereCount) = spheres.topRows<3>();
+    std::memcpy(data, encoded.data(), payload);
+    keyframes++;
+    keyframeOf.emplace_back(frameCount());
+  } else {
+    float inverseScale = scale > 0.0f ? 1.0f / scale : 0.0f;
+    const float* source = delta.data();
+    for (std::size_t i = 0; i < quantized.size(); ++i) {
+      long value = std::lround(source[i] * inverseScale);
+      quantized[i] = static_cast<int16_t>(std::clamp(value, -32767L, 32767L));
+    }
+    std::memcpy(data, quantized.data(), payload);
+    applyDelta(encoded, quantized.data(), scale);
+    keyframeOf.emplace_back(previousKey);
+  }
+  std::memset(data + payload, 0, recordSize - sizeof(FrameRecord) - payload);
+  frameOffsets.emplace_back(used);
+  used += recordSize;
+  writeHeader();
+  return true;
+}
+
+void TrajectoryCache::decode(std::size_t offset) {
+  FrameRecord header;
+  std::memcpy(&header, file.data() + offset, sizeof(header));
+  const unsigned char* data = file.data() + offset + sizeof(FrameRecord);
+  if (header.type == static_cast<uint32_t>(FrameType::KEYFRAME)) {
+    std::memcpy(decoded.data(), data, decoded.size() * sizeof(float));
+  } else {
+    // The mapping is page aligned and records 16-byte aligned
+    applyDelta(decoded, reinterpret_cast<const int16_t*>(data), header.scale);
+  }
+}
+
+bool TrajectoryCache::frame(int index, Eigen::Ref<Eigen::Matrix4Xf> cloth, Eigen::Ref<Eigen::Matrix4Xf> spheres) {
+  if (index < 0 || index >= frameCount() || cloth.cols() != _clothParticles || spheres.cols() != _sphereCount)
+    return false;
+  int key = keyframeOf[index];
+  // Scrubbing forward within the same keyframe continues from the last frame
+  if (decodedIndex < key || decodedIndex > index) {
+    decodedIndex = key;
+    decode(frameOffsets[key]);
+  }
+  while (decodedIndex < index) decode(frameOffsets[++decodedIndex]);
+  cloth.topRows<3>() = decoded.leftCols(_clothParticles);
+  spheres.topRows<3>() = decoded.rightCols(_sphereCount);
+  return true;
+}